@@ -413,6 +413,7 @@ enum dns_opt {		/* options */
   DNS_OPT_NDOTS,	/* ndots */
   DNS_OPT_UDPSIZE,	/* EDNS0 UDP size */
   DNS_OPT_PORT,		/* port to use */
+  DNS_OPT_PARALLEL,	/* servers to query at once */
 };
 
 /* set or get (if val<0) an option */
@@ -435,6 +436,21 @@ typedef void
 UDNS_API void
 dns_set_dbgfn(struct dns_ctx *ctx, dns_dbgfn *dbgfn);
 
+/* per-nameserver counters, kept by the resolver */
+struct dns_serv_stat {
+  unsigned dnss_queries;	/* queries sent */
+  unsigned dnss_replies;	/* replies received */
+  unsigned dnss_failures;	/* error replies and timeouts */
+  unsigned dnss_srtt;		/* smoothed round trip time, msec */
+  unsigned dnss_fail;		/* smoothed failure rate, 1/1024 */
+};
+
+/* fill in counters of nameserver #servi and return its address,
+ * or return NULL if there's no such server */
+UDNS_API const struct sockaddr *
+dns_serv_stat(const struct dns_ctx *ctx, unsigned servi,
+              struct dns_serv_stat *st);
+
 /* open and return UDP socket */
 UDNS_API int
 dns_open(struct dns_ctx *ctx);
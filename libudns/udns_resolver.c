@@ -75,6 +75,8 @@ struct dns_query {
   unsigned dnsq_servwait;		/* bitmask: servers left to wait */
   unsigned dnsq_servskip;		/* bitmask: servers to skip */
   unsigned dnsq_servnEDNS0;		/* bitmask: servers refusing EDNS0 */
+  unsigned dnsq_servlate;		/* bitmask: servers counted as timed out */
+  unsigned dnsq_sent[DNS_MAXSERV];	/* when sent to each server, msec */
   unsigned dnsq_try;			/* number of tries made so far */
   dnscc_t *dnsq_nxtsrch;		/* next search pointer @dnsc_srchbuf */
   time_t dnsq_deadline;			/* when current try will expire */
@@ -87,6 +89,7 @@ struct dns_query {
   /* char fields at the end to avoid padding */
   dnsc_t dnsq_id[2];			/* query ID */
   dnsc_t dnsq_typcls[4];		/* requested RR type+class */
+  dnsc_t dnsq_rank[DNS_MAXSERV];	/* servers in order to try */
   dnsc_t dnsq_dn[DNS_MAXDN+DNS_DNPAD];	/* the query DN +alignment */
 };
 
@@ -149,10 +152,12 @@ struct dns_ctx {		/* resolver context */
   unsigned dnsc_ndots;			/* ndots to assume absolute name */
   unsigned dnsc_port;			/* default port (DNS_PORT) */
   unsigned dnsc_udpbuf;			/* size of UDP buffer */
+  unsigned dnsc_parallel;		/* servers to query at once */
   /* array of nameserver addresses */
   union sockaddr_ns dnsc_serv[DNS_MAXSERV];
   unsigned dnsc_nserv;			/* number of nameservers */
   unsigned dnsc_salen;			/* length of socket addresses */
+  struct dns_serv_stat dnsc_stat[DNS_MAXSERV]; /* per-server counters */
   dnsc_t dnsc_srchbuf[1024];		/* buffer for searchlist */
   dnsc_t *dnsc_srchend;			/* current end of srchbuf */
 
@@ -187,6 +192,7 @@ static const struct {
   opt("ndots", DNS_OPT_NDOTS, dnsc_ndots, 0,1000),
   opt("port", DNS_OPT_PORT, dnsc_port, 1,0xffff),
   opt("udpbuf", DNS_OPT_UDPSIZE, dnsc_udpbuf, DNS_MAXPACKET,65536),
+  opt("parallel", DNS_OPT_PARALLEL, dnsc_parallel, 1,DNS_MAXSERV),
 #undef opt
 };
 #define dns_ctxopt(ctx,idx) (*((unsigned*)(((char*)ctx)+dns_opts[idx].offset)))
@@ -444,6 +450,7 @@ void dns_reset(struct dns_ctx *ctx) {
   ctx->dnsc_ntries = 3;
   ctx->dnsc_ndots = 1;
   ctx->dnsc_udpbuf = DNS_EDNS0PACKET;
+  ctx->dnsc_parallel = 1;
   ctx->dnsc_port = DNS_PORT;
   ctx->dnsc_udpsock = -1;
   ctx->dnsc_srchend = ctx->dnsc_srchbuf;
@@ -580,6 +587,17 @@ int dns_open(struct dns_ctx *ctx) {
   return sock;
 }
 
+const struct sockaddr *
+dns_serv_stat(const struct dns_ctx *ctx, unsigned servi,
+              struct dns_serv_stat *st) {
+  SETCTXINITED(ctx);
+  if (servi >= ctx->dnsc_nserv)
+    return NULL;
+  if (st)
+    *st = ctx->dnsc_stat[servi];
+  return &ctx->dnsc_serv[servi].sa;
+}
+
 int dns_sock(const struct dns_ctx *ctx) {
   SETCTXINITED(ctx);
   return ctx->dnsc_udpsock;
@@ -600,6 +618,58 @@ void dns_setstatus(struct dns_ctx *ctx, int status) {
   ctx->dnsc_qstatus = status;
 }
 
+/* millisecond clock for round trip times; only differences are used */
+static unsigned dns_clock_ms(void) {
+#ifdef __MINGW32__
+  return GetTickCount();
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/* fold one reply (or timeout) into the server's moving averages.
+ * Both averages use a gain of 1/8, like TCP's smoothed RTT.
+ */
+static void
+dns_serv_sample(struct dns_ctx *ctx, unsigned servi,
+                unsigned rtt, int failed) {
+  struct dns_serv_stat *st = &ctx->dnsc_stat[servi];
+  if (failed) {
+    ++st->dnss_failures;
+    st->dnss_fail += (1024 - (int)st->dnss_fail) / 8;
+  }
+  else
+    st->dnss_fail -= st->dnss_fail / 8;
+  if (rtt == (unsigned)-1)
+    return;
+  if (rtt > 60000)	/* the clock has stepped */
+    rtt = 60000;
+  if (!st->dnss_srtt)
+    st->dnss_srtt = rtt;
+  else
+    st->dnss_srtt += ((int)rtt - (int)st->dnss_srtt) / 8;
+}
+
+/* servers which still haven't replied when the query ends have lost
+ * the race: take the time they had as a lower bound of their RTT.
+ */
+static void dns_serv_lost(struct dns_ctx *ctx, const struct dns_query *q) {
+  unsigned wait = q->dnsq_servwait;
+  unsigned servi, rtt, now = dns_clock_ms();
+  for(servi = 0; wait; ++servi, wait >>= 1) {
+    struct dns_serv_stat *st = &ctx->dnsc_stat[servi];
+    if (!(wait & 1))
+      continue;
+    rtt = now - q->dnsq_sent[servi];
+    if (rtt > 60000)
+      rtt = 60000;
+    if (rtt > st->dnss_srtt)
+      st->dnss_srtt += (rtt - st->dnss_srtt + 7) / 8;
+  }
+}
+
 /* End the query: disconnect it from the active list, free it,
  * and return the result to the caller.
  */
@@ -614,6 +684,8 @@ dns_end_query(struct dns_ctx *ctx, struct dns_query *q,
   assert(ctx->dnsc_nactive > 0);
   --ctx->dnsc_nactive;
   qlist_remove(&ctx->dnsc_qactive, q);
+  if (q->dnsq_servwait)
+    dns_serv_lost(ctx, q);
   /* force the query to be unconnected */
   /*memset(q, 0, sizeof(*q));*/
 #ifndef NDEBUG
@@ -721,6 +793,7 @@ static void dns_newid(struct dns_ctx *ctx, struct dns_query *q) {
   /*XXX probably should keep dnsq_servnEDNS0 bits?
    * See also comments in dns_ioevent() about FORMERR case */
   q->dnsq_servwait = q->dnsq_servskip = q->dnsq_servnEDNS0 = 0;
+  q->dnsq_servlate = 0;
 }
 
 /* Find next search suffix and fills in q->dnsq_dn.
@@ -745,14 +818,37 @@ static int dns_next_srch(struct dns_ctx *ctx, struct dns_query *q) {
   return 1;
 }
 
+/* expected cost of asking a server: its smoothed RTT plus the
+ * timeout weighted by how often it failed lately.  Servers not
+ * heard from yet score 0, so they get probed early.
+ */
+static unsigned dns_serv_score(const struct dns_ctx *ctx, unsigned servi) {
+  const struct dns_serv_stat *st = &ctx->dnsc_stat[servi];
+  return st->dnss_srtt + st->dnss_fail * ctx->dnsc_timeout * 1000 / 1024;
+}
+
+/* order the servers for the next iteration, best score first;
+ * ties keep the configured order.
+ */
+static void dns_rank_serv(const struct dns_ctx *ctx, struct dns_query *q) {
+  unsigned i, j, s;
+  for(i = 0; i < ctx->dnsc_nserv; ++i) {
+    s = dns_serv_score(ctx, i);
+    for(j = i; j > 0 && dns_serv_score(ctx, q->dnsq_rank[j-1]) > s; --j)
+      q->dnsq_rank[j] = q->dnsq_rank[j-1];
+    q->dnsq_rank[j] = (dnsc_t)i;
+  }
+}
+
 /* find the server to try for current iteration.
  * Note that current dnsq_servi may point to a server we should skip --
  * in that case advance to the next server.
+ * dnsq_servi indexes dnsq_rank, not dnsc_serv.
  * Return true if found, false if all tried.
  */
 static int dns_find_serv(const struct dns_ctx *ctx, struct dns_query *q) {
   while(q->dnsq_servi < ctx->dnsc_nserv) {
-    if (!(q->dnsq_servskip & (1 << q->dnsq_servi)))
+    if (!(q->dnsq_servskip & (1 << q->dnsq_rank[q->dnsq_servi])))
       return 1;
     ++q->dnsq_servi;
   }
@@ -817,6 +913,8 @@ dns_send_this(struct dns_ctx *ctx, struct dns_query *q,
            &ctx->dnsc_serv[servi].sa, sizeof(union sockaddr_ns),
            ctx->dnsc_pbuf, qlen);
   q->dnsq_servwait |= 1 << servi;	/* expect reply from this ns */
+  q->dnsq_sent[servi] = dns_clock_ms();
+  ++ctx->dnsc_stat[servi].dnss_queries;
 
   q->dnsq_deadline = now +
     (dns_find_serv(ctx, q) ? 1 : ctx->dnsc_timeout << q->dnsq_try);
@@ -836,19 +934,29 @@ dns_send_this(struct dns_ctx *ctx, struct dns_query *q,
 
 /* send the query out using next available server
  * and add it to the active list, or, if no servers available,
- * end it.
+ * end it.  At the start of an iteration the query goes to the
+ * dnsc_parallel best ranked servers at once, and the first
+ * definitive reply wins.
  */
 static void
 dns_send(struct dns_ctx *ctx, struct dns_query *q, time_t now) {
+  unsigned n = 1;
 
   /* if we can't send the query, return TEMPFAIL even when searching:
    * we can't be sure whenever the name we tried to search exists or not,
    * so don't continue searching, or we may find the wrong name. */
 
+  if (!q->dnsq_servi) {
+    dns_rank_serv(ctx, q);
+    n = ctx->dnsc_parallel;
+  }
+
   if (!dns_find_serv(ctx, q)) {
     /* no more servers in this iteration.  Try the next cycle */
     q->dnsq_servi = 0;	/* reset */
     q->dnsq_try++;	/* next try */
+    dns_rank_serv(ctx, q);
+    n = ctx->dnsc_parallel;
     if (q->dnsq_try >= ctx->dnsc_ntries ||
         !dns_find_serv(ctx, q)) {
       /* no more servers and tries, fail the query */
@@ -862,7 +970,10 @@ dns_send(struct dns_ctx *ctx, struct dns_query *q, time_t now) {
     }
   }
 
-  dns_send_this(ctx, q, q->dnsq_servi++, now);
+  do
+    if (dns_send_this(ctx, q, q->dnsq_rank[q->dnsq_servi++], now) < 0)
+      return;	/* the query has been ended */
+  while(--n && dns_find_serv(ctx, q));
 }
 
 static void dns_dummy_cb(struct dns_ctx *ctx, void *result, void *data) {
@@ -1079,6 +1190,12 @@ again: /* receive the reply */
 
   DNS_DBGQ(ctx, q, 0, &sns.sa, slen, pbuf, r);
   q->dnsq_servwait &= ~(1 << servi);	/* don't expect reply from this serv */
+  ++ctx->dnsc_stat[servi].dnss_replies;
+
+  /* only NOERROR and NXDOMAIN answer the query for sure */
+  dns_serv_sample(ctx, servi, dns_clock_ms() - q->dnsq_sent[servi],
+                  !((dns_rcode(pbuf) == DNS_R_NOERROR && !dns_tc(pbuf)) ||
+                    dns_rcode(pbuf) == DNS_R_NXDOMAIN));
 
   /* process the RCODE */
   switch(dns_rcode(pbuf)) {
@@ -1226,7 +1343,14 @@ int dns_timeouts(struct dns_ctx *ctx, int maxwait, time_t now) {
       break;
     }
     else {
-      /* process expired deadline */
+      /* process expired deadline; servers still silent count as
+       * failed once, their late replies are accepted anyway */
+      unsigned late = q->dnsq_servwait & ~q->dnsq_servlate;
+      unsigned servi;
+      for(servi = 0; late; ++servi, late >>= 1)
+        if (late & 1)
+          dns_serv_sample(ctx, servi, (unsigned)-1, 1);
+      q->dnsq_servlate |= q->dnsq_servwait;
       dns_send(ctx, q, now);
     }
   } while((q = ctx->dnsc_qactive.head) != NULL);
@@ -0,0 +1,265 @@
+/*
+ * accesslog.c - Write a JSON line for each closed session of ss-server
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "accesslog.h"
+#include "utils.h"
+
+#define ACCESS_BUF_SIZE (64 * 1024)
+#define ACCESS_LINE_SIZE 1024
+#define ACCESS_FLUSH_INTERVAL 1 // seconds
+
+/*
+ * Records are appended to the active buffer on the event loop. The log
+ * thread swaps it with the spare one at least once a second, or as soon
+ * as it is half full, and writes it out without holding the lock.
+ */
+static int log_fd     = -1;
+static int log_sample = 1;
+static unsigned long log_seq     = 0;
+static unsigned long log_dropped = 0;
+
+static char log_bufs[2][ACCESS_BUF_SIZE];
+static char *log_active  = log_bufs[0];
+static size_t log_len    = 0;
+static int log_stop      = 0;
+static int log_started   = 0;
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond   = PTHREAD_COND_INITIALIZER;
+
+static void write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *log_thread_main(void *arg)
+{
+    pthread_mutex_lock(&log_mutex);
+
+    for (;;) {
+        if (log_len == 0 && !log_stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ACCESS_FLUSH_INTERVAL;
+            pthread_cond_timedwait(&log_cond, &log_mutex, &deadline);
+        }
+
+        char *buf  = log_active;
+        size_t len = log_len;
+        int stop   = log_stop;
+
+        log_active = buf == log_bufs[0] ? log_bufs[1] : log_bufs[0];
+        log_len    = 0;
+
+        pthread_mutex_unlock(&log_mutex);
+        write_all(buf, len);
+        pthread_mutex_lock(&log_mutex);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&log_mutex);
+    return NULL;
+}
+
+/*
+ * Append to a JSON line. Once the line is full, len only grows past
+ * ACCESS_LINE_SIZE and nothing more is written, so the caller checks once.
+ */
+static int append(char *line, int len, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (len >= ACCESS_LINE_SIZE) {
+        return len;
+    }
+
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, ACCESS_LINE_SIZE - len, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/*
+ * Append the string to a JSON line, escaping as needed. A string too long
+ * for the line is cut short, keeping room for the rest of the record.
+ */
+static int append_string(char *line, int len, const char *s)
+{
+    len = append(line, len, "\"");
+    for (; *s != '\0' && len + 6 < ACCESS_LINE_SIZE - 256; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            line[len++] = '\\';
+            line[len++] = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            len = append(line, len, "\\u%04x", c);
+        } else {
+            line[len++] = c;
+        }
+    }
+    return append(line, len, "\"");
+}
+
+// null for stages never reached
+static int append_ms(char *line, int len, double seconds)
+{
+    if (seconds < 0) {
+        return append(line, len, "null");
+    }
+    return append(line, len, "%.1f", seconds * 1000);
+}
+
+int access_log_open(const char *path, int sample)
+{
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd == -1) {
+        ERROR("access log");
+        return -1;
+    }
+
+    log_sample = sample > 0 ? sample : 1;
+
+    return 0;
+}
+
+/*
+ * Whether the next session should be logged, one in every sample
+ */
+int access_log_sampled(void)
+{
+    return log_fd != -1 && log_seq++ % log_sample == 0;
+}
+
+void access_log_write(const struct access_record *r)
+{
+    char line[ACCESS_LINE_SIZE];
+    char peer[INET6_ADDRSTRLEN] = "";
+    int peer_port = 0;
+    int len;
+
+    if (r->peer != NULL && r->peer->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)r->peer;
+        inet_ntop(AF_INET, &in->sin_addr, peer, sizeof(peer));
+        peer_port = ntohs(in->sin_port);
+    } else if (r->peer != NULL && r->peer->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in = (const struct sockaddr_in6 *)r->peer;
+        inet_ntop(AF_INET6, &in->sin6_addr, peer, sizeof(peer));
+        peer_port = ntohs(in->sin6_port);
+    }
+
+    len = append(line, 0,
+                 "{\"time\":%.3f,\"peer\":\"%s\",\"peer_port\":%d,\"host\":",
+                 r->time, peer, peer_port);
+    if (r->host != NULL) {
+        len = append_string(line, len, r->host);
+    } else {
+        len = append(line, len, "null");
+    }
+    len = append(line, len, ",\"port\":%u,\"resolve_ms\":", r->port);
+    len = append_ms(line, len, r->resolve);
+    len = append(line, len, ",\"connect_ms\":");
+    len = append_ms(line, len, r->connect);
+    len = append(line, len,
+                 ",\"duration_ms\":%.1f,\"up\":%llu,\"down\":%llu,"
+                 "\"close\":\"%s\"}\n",
+                 r->duration * 1000, (unsigned long long)r->up,
+                 (unsigned long long)r->down, r->reason);
+    if (len >= ACCESS_LINE_SIZE) {
+        return;
+    }
+
+    // started on first use, as threads don't survive daemonizing
+    if (!log_started) {
+        if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+            LOGE("failed to start the access log thread");
+            access_log_close();
+            return;
+        }
+        log_started = 1;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    if (log_len + len > ACCESS_BUF_SIZE) {
+        log_dropped++;
+    } else {
+        memcpy(log_active + log_len, line, len);
+        log_len += len;
+        if (log_len > ACCESS_BUF_SIZE / 2) {
+            pthread_cond_signal(&log_cond);
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void access_log_close(void)
+{
+    if (log_fd == -1) {
+        return;
+    }
+
+    if (log_started) {
+        pthread_mutex_lock(&log_mutex);
+        log_stop = 1;
+        pthread_cond_signal(&log_cond);
+        pthread_mutex_unlock(&log_mutex);
+        pthread_join(log_thread, NULL);
+        log_started = 0;
+    }
+
+    if (log_dropped) {
+        LOGE("%lu access log records dropped", log_dropped);
+    }
+
+    close(log_fd);
+    log_fd = -1;
+}
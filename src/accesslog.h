@@ -0,0 +1,52 @@
+/*
+ * accesslog.h - Define the per-connection access log of ss-server
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <stdint.h>
+
+struct sockaddr;
+
+/**
+ * What is known about a session when it closes. Durations are in seconds,
+ * negative when the stage was never reached.
+ */
+struct access_record {
+    double time;                  /**<Wall clock time of the close */
+    const struct sockaddr *peer;  /**<Client address, or NULL */
+    const char *host;             /**<Target host, or NULL before the header */
+    uint16_t port;                /**<Target port, host order */
+    double resolve;
+    double connect;
+    double duration;
+    uint64_t up;                  /**<Bytes from the client */
+    uint64_t down;                /**<Bytes to the client */
+    const char *reason;
+};
+
+int access_log_open(const char *path, int sample);
+int access_log_sampled(void);
+void access_log_write(const struct access_record *record);
+void access_log_close(void);
+
+#endif // _ACCESSLOG_H
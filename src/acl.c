@@ -20,12 +20,120 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include <ipset/ipset.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include <libcork/core.h>
 
 #include "utils.h"
+#include "acl.h"
+
+/*
+ * The rules are compiled at load time into sorted arrays of disjoint
+ * address ranges, so a lookup is a binary search over plain integers. The
+ * IPv4 ranges are additionally indexed by the top ACL_V4_INDEX_BITS of the
+ * address, which narrows the search down to a handful of entries.
+ *
+ * Domain rules go into an open-addressing hash set keyed by the name read
+ * backwards, so the hash of every suffix of a queried name falls out of a
+ * single pass from its end, and a lookup costs one probe per label.
+ *
+ * The compiled tables live in one block laid out exactly like the binary
+ * image written by ss-aclc: a header followed by the index, the IPv4 and
+ * IPv6 ranges, the domain slots and their name pool, each aligned to 8
+ * bytes. An image is mapped read-only and used in place, so all processes
+ * loading it share the same pages.
+ */
+
+#define ACL_V4_INDEX_BITS 12
+#define ACL_V4_INDEX_SIZE (1 << ACL_V4_INDEX_BITS)
+
+#define ACL_IMAGE_MAGIC "SSACL\0\0"
+#define ACL_IMAGE_VERSION 2
+
+#define ACL_MAX_DOMAIN_LEN 253
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
 
-static struct ip_set acl_ipv4_set;
-static struct ip_set acl_ipv6_set;
+struct acl_range4 {
+    uint32_t first;
+    uint32_t last;
+};
+
+struct acl_addr6 {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+struct acl_range6 {
+    struct acl_addr6 first;
+    struct acl_addr6 last;
+};
+
+struct acl_domain {
+    uint32_t hash;      // 0 marks an empty slot
+    uint32_t offset;    // of the lowercase name in the pool
+    uint8_t len;
+    uint8_t suffix;     // also matches every subdomain
+    uint16_t reserved;
+};
+
+// all fields are in host byte order, images are not portable across endianness
+struct acl_image {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;  // FNV-1a of everything after the header
+    uint32_t v4_count;
+    uint32_t v6_count;
+    uint32_t domain_slots;  // 0 or a power of two
+    uint32_t pool_size;
+    uint64_t size;      // of the whole image, header included
+};
+
+struct acl_layout {
+    size_t v4;
+    size_t v6;
+    size_t domains;
+    size_t pool;
+    size_t size;
+};
+
+struct acl_set {
+    uint32_t v4_count;
+    uint32_t v6_count;
+    uint32_t domain_slots;
+    const uint32_t *v4_index;
+    const struct acl_range4 *v4;
+    const struct acl_range6 *v6;
+    const struct acl_domain *domains;
+    const char *pool;
+    void *data;         // the image, either on the heap or mapped
+    size_t map_len;     // 0 unless data is mapped
+};
+
+// rules collected from a text list before they are compiled
+struct acl_rules {
+    struct acl_range4 *v4;
+    struct acl_range6 *v6;
+    struct acl_domain *domains;
+    char *pool;
+    uint32_t v4_count, v6_count, domain_count, pool_size;
+    size_t v4_cap, v6_cap, domain_cap, pool_cap;
+};
+
+static struct acl_set acl_set;
+static char *acl_path;
 
 static void parse_addr_cidr(const char *str, char *host, int *cidr)
 {
@@ -48,26 +156,395 @@ static void parse_addr_cidr(const char *str, char *host, int *cidr)
     }
 }
 
-int init_acl(const char *path)
+static uint32_t load_addr4(const void *addr)
 {
-    // initialize ipset
-    ipset_init_library();
-    ipset_init(&acl_ipv4_set);
-    ipset_init(&acl_ipv6_set);
+    const uint8_t *p = addr;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
 
-    FILE *f = fopen(path, "r");
-    if (f == NULL) {
-        LOGE("Invalid acl path.");
+static struct acl_addr6 load_addr6(const void *addr)
+{
+    const uint8_t *p = addr;
+    struct acl_addr6 a = { 0, 0 };
+    int i;
+    for (i = 0; i < 8; i++) {
+        a.hi = a.hi << 8 | p[i];
+        a.lo = a.lo << 8 | p[i + 8];
+    }
+    return a;
+}
+
+static int addr6_cmp(const struct acl_addr6 *a, const struct acl_addr6 *b)
+{
+    if (a->hi != b->hi) {
+        return a->hi < b->hi ? -1 : 1;
+    }
+    if (a->lo != b->lo) {
+        return a->lo < b->lo ? -1 : 1;
+    }
+    return 0;
+}
+
+static int range4_cmp(const void *a, const void *b)
+{
+    const struct acl_range4 *x = a, *y = b;
+    if (x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
+    }
+    return 0;
+}
+
+static int range6_cmp(const void *a, const void *b)
+{
+    const struct acl_range6 *x = a, *y = b;
+    return addr6_cmp(&x->first, &y->first);
+}
+
+static void add_range4(struct acl_range4 **v4, uint32_t *count, size_t *cap,
+                       uint32_t addr, int cidr)
+{
+    uint32_t mask = cidr == 0 ? 0 : 0xffffffffU << (32 - cidr);
+
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *v4 = realloc(*v4, *cap * sizeof(struct acl_range4));
+    }
+    (*v4)[*count].first = addr & mask;
+    (*v4)[*count].last = addr | ~mask;
+    (*count)++;
+}
+
+static void add_range6(struct acl_range6 **v6, uint32_t *count, size_t *cap,
+                       struct acl_addr6 addr, int cidr)
+{
+    uint64_t mask_hi, mask_lo;
+
+    if (cidr <= 64) {
+        mask_hi = cidr == 0 ? 0 : ~0ULL << (64 - cidr);
+        mask_lo = 0;
+    } else {
+        mask_hi = ~0ULL;
+        mask_lo = ~0ULL << (128 - cidr);
+    }
+
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *v6 = realloc(*v6, *cap * sizeof(struct acl_range6));
+    }
+    (*v6)[*count].first.hi = addr.hi & mask_hi;
+    (*v6)[*count].first.lo = addr.lo & mask_lo;
+    (*v6)[*count].last.hi = addr.hi | ~mask_hi;
+    (*v6)[*count].last.lo = addr.lo | ~mask_lo;
+    (*count)++;
+}
+
+/*
+ * Sort the ranges and merge the ones that overlap or touch, so that every
+ * address is covered by at most one range. Returns the new count.
+ */
+static uint32_t merge_range4(struct acl_range4 *v4, uint32_t count)
+{
+    uint32_t i, n;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(v4, count, sizeof(struct acl_range4), range4_cmp);
+    for (i = 1, n = 0; i < count; i++) {
+        struct acl_range4 *cur = &v4[n];
+        if (cur->last == 0xffffffffU || v4[i].first <= cur->last + 1) {
+            if (v4[i].last > cur->last) {
+                cur->last = v4[i].last;
+            }
+        } else {
+            v4[++n] = v4[i];
+        }
+    }
+
+    return n + 1;
+}
+
+static uint32_t merge_range6(struct acl_range6 *v6, uint32_t count)
+{
+    uint32_t i, n;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(v6, count, sizeof(struct acl_range6), range6_cmp);
+    for (i = 1, n = 0; i < count; i++) {
+        struct acl_range6 *cur = &v6[n];
+        struct acl_addr6 next = cur->last;
+        next.lo++;
+        if (next.lo == 0) {
+            next.hi++;
+        }
+        if ((next.hi == 0 && next.lo == 0)
+            || addr6_cmp(&v6[i].first, &next) <= 0) {
+            if (addr6_cmp(&v6[i].last, &cur->last) > 0) {
+                cur->last = v6[i].last;
+            }
+        } else {
+            v6[++n] = v6[i];
+        }
+    }
+
+    return n + 1;
+}
+
+static uint32_t image_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 16777619U;
+    }
+    return h;
+}
+
+static uint32_t domain_hash_step(uint32_t h, char c)
+{
+    return (h ^ (uint8_t)tolower((unsigned char)c)) * 16777619U;
+}
+
+static uint32_t domain_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+    while (len > 0) {
+        h = domain_hash_step(h, name[--len]);
+    }
+    return h ? h : 1;
+}
+
+/*
+ * Append count items after offset, aligned to 8 bytes. The counts come from
+ * the image header, so the arithmetic is checked against size_t wrapping.
+ */
+static int layout_section(size_t *next, size_t offset, uint32_t count,
+                          size_t item)
+{
+    if (count > (SIZE_MAX - 7 - offset) / item) {
+        return -1;
+    }
+    *next = ALIGN8(offset + count * item);
+    return 0;
+}
+
+static int image_layout(struct acl_layout *l, uint32_t v4_count,
+                        uint32_t v6_count, uint32_t domain_slots,
+                        uint32_t pool_size)
+{
+    l->v4 = ALIGN8(sizeof(struct acl_image) +
+                   (ACL_V4_INDEX_SIZE + 1) * sizeof(uint32_t));
+    if (layout_section(&l->v6, l->v4, v4_count, sizeof(struct acl_range4))
+        || layout_section(&l->domains, l->v6, v6_count,
+                          sizeof(struct acl_range6))
+        || layout_section(&l->pool, l->domains, domain_slots,
+                          sizeof(struct acl_domain))
+        || pool_size > SIZE_MAX - l->pool) {
+        return -1;
+    }
+    l->size = l->pool + pool_size;
+    return 0;
+}
+
+static void acl_set_attach(struct acl_set *set, void *data, size_t map_len)
+{
+    struct acl_image *image = data;
+    uint8_t *base = data;
+    struct acl_layout l;
+
+    // already checked by check_image or build_acl
+    image_layout(&l, image->v4_count, image->v6_count, image->domain_slots,
+                 image->pool_size);
+
+    set->v4_count = image->v4_count;
+    set->v6_count = image->v6_count;
+    set->domain_slots = image->domain_slots;
+    set->v4_index = (const uint32_t *)(base + sizeof(struct acl_image));
+    set->v4 = (const struct acl_range4 *)(base + l.v4);
+    set->v6 = (const struct acl_range6 *)(base + l.v6);
+    set->domains = (const struct acl_domain *)(base + l.domains);
+    set->pool = (const char *)(base + l.pool);
+    set->data = data;
+    set->map_len = map_len;
+}
+
+static const struct acl_domain *find_domain(const struct acl_domain *slots,
+                                            uint32_t mask, const char *pool,
+                                            uint32_t hash, const char *name,
+                                            size_t len)
+{
+    uint32_t i = hash & mask;
+
+    while (slots[i].hash != 0) {
+        if (slots[i].hash == hash && slots[i].len == len
+            && strncasecmp(pool + slots[i].offset, name, len) == 0) {
+            return &slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/*
+ * Lay the merged rules out as an image on the heap and build the index:
+ * v4_index[b] is the first range ending at or after the start of bucket b.
+ * Duplicate domain rules collapse into one slot.
+ */
+static int build_acl(struct acl_set *set, const struct acl_rules *rules)
+{
+    uint32_t slots = 0, pool_size = 0, i, n;
+    struct acl_layout l;
+
+    if (rules->domain_count > 0) {
+        slots = 16;
+        while (slots < rules->domain_count * 2) {
+            slots *= 2;
+        }
+        pool_size = rules->pool_size;
+    }
+
+    uint8_t *data = NULL;
+    if (image_layout(&l, rules->v4_count, rules->v6_count, slots, pool_size)
+        || (data = calloc(1, l.size)) == NULL) {
+        LOGE("acl too large");
         return -1;
     }
 
+    struct acl_image *image = (struct acl_image *)data;
+    uint32_t *index = (uint32_t *)(data + sizeof(struct acl_image));
+    struct acl_domain *domains = (struct acl_domain *)(data + l.domains);
+    char *pool = (char *)(data + l.pool);
+
+    memcpy(image->magic, ACL_IMAGE_MAGIC, sizeof(image->magic));
+    image->version = ACL_IMAGE_VERSION;
+    image->v4_count = rules->v4_count;
+    image->v6_count = rules->v6_count;
+    image->domain_slots = slots;
+    image->pool_size = pool_size;
+    image->size = l.size;
+
+    if (rules->v4_count > 0) {
+        memcpy(data + l.v4, rules->v4,
+               rules->v4_count * sizeof(struct acl_range4));
+    }
+    if (rules->v6_count > 0) {
+        memcpy(data + l.v6, rules->v6,
+               rules->v6_count * sizeof(struct acl_range6));
+    }
+    if (pool_size > 0) {
+        memcpy(pool, rules->pool, pool_size);
+    }
+
+    for (i = 0, n = 0; i < ACL_V4_INDEX_SIZE; i++) {
+        uint32_t start = i << (32 - ACL_V4_INDEX_BITS);
+        while (n < rules->v4_count && rules->v4[n].last < start) {
+            n++;
+        }
+        index[i] = n;
+    }
+    index[ACL_V4_INDEX_SIZE] = rules->v4_count;
+
+    for (i = 0; i < rules->domain_count; i++) {
+        const struct acl_domain *d = &rules->domains[i];
+        struct acl_domain *found = (struct acl_domain *)
+                                   find_domain(domains, slots - 1, pool, d->hash,
+                                               pool + d->offset, d->len);
+        if (found != NULL) {
+            found->suffix |= d->suffix;
+        } else {
+            n = d->hash & (slots - 1);
+            while (domains[n].hash != 0) {
+                n = (n + 1) & (slots - 1);
+            }
+            domains[n] = *d;
+        }
+    }
+
+    image->checksum = image_checksum(data + sizeof(struct acl_image),
+                                     l.size - sizeof(struct acl_image));
+
+    acl_set_attach(set, data, 0);
+
+    return 0;
+}
+
+/*
+ * A domain rule is a host name, optionally with a leading dot, which makes
+ * it match the domain itself and all of its subdomains.
+ */
+static void add_domain(struct acl_rules *rules, const char *line)
+{
+    int suffix = 0;
+    size_t len, i;
+
+    if (line[0] == '.') {
+        suffix = 1;
+        line++;
+    }
+
+    len = strlen(line);
+    if (len > 0 && line[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len > ACL_MAX_DOMAIN_LEN) {
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        char c = line[i];
+        if (c == '.') {
+            if (i == 0 || line[i - 1] == '.') {
+                return;
+            }
+        } else if (!isalnum((unsigned char)c) && c != '-' && c != '_') {
+            return;
+        }
+    }
+
+    if (rules->domain_count == rules->domain_cap) {
+        rules->domain_cap = rules->domain_cap ? rules->domain_cap * 2 : 64;
+        rules->domains = realloc(rules->domains,
+                                 rules->domain_cap * sizeof(struct acl_domain));
+    }
+    while (rules->pool_size + len > rules->pool_cap) {
+        rules->pool_cap = rules->pool_cap ? rules->pool_cap * 2 : 1024;
+        rules->pool = realloc(rules->pool, rules->pool_cap);
+    }
+
+    struct acl_domain *d = &rules->domains[rules->domain_count++];
+    d->hash = domain_hash(line, len);
+    d->offset = rules->pool_size;
+    d->len = len;
+    d->suffix = suffix;
+    d->reserved = 0;
+
+    for (i = 0; i < len; i++) {
+        rules->pool[rules->pool_size++] = tolower((unsigned char)line[i]);
+    }
+}
+
+static int parse_acl(FILE *f, struct acl_set *set)
+{
+    struct acl_rules rules;
+
+    memset(&rules, 0, sizeof(struct acl_rules));
+
     char line[256];
     while (!feof(f)) {
         if (fgets(line, 256, f)) {
             // Trim the newline
             int len = strlen(line);
-            if (len > 0 && line[len - 1] == '\n') {
-                line[len - 1] = '\0';
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                line[--len] = '\0';
+            }
+
+            if (len == 0 || line[0] == '#') {
+                continue;
             }
 
             char host[256];
@@ -78,31 +555,294 @@ int init_acl(const char *path)
             int err = cork_ip_init(&addr, host);
             if (!err) {
                 if (addr.version == 4) {
-                    if (cidr >= 0) {
-                        ipset_ipv4_add_network(&acl_ipv4_set, &(addr.ip.v4), cidr);
-                    } else {
-                        ipset_ipv4_add(&acl_ipv4_set, &(addr.ip.v4));
+                    if (cidr < 0) {
+                        cidr = 32;
+                    }
+                    if (cidr <= 32) {
+                        add_range4(&rules.v4, &rules.v4_count, &rules.v4_cap,
+                                   load_addr4(&addr.ip.v4), cidr);
                     }
                 } else if (addr.version == 6) {
-                    if (cidr >= 0) {
-                        ipset_ipv6_add_network(&acl_ipv6_set, &(addr.ip.v6), cidr);
-                    } else {
-                        ipset_ipv6_add(&acl_ipv6_set, &(addr.ip.v6));
+                    if (cidr < 0) {
+                        cidr = 128;
+                    }
+                    if (cidr <= 128) {
+                        add_range6(&rules.v6, &rules.v6_count, &rules.v6_cap,
+                                   load_addr6(&addr.ip.v6), cidr);
                     }
                 }
+            } else if (cidr < 0) {
+                add_domain(&rules, line);
             }
         }
     }
 
+    rules.v4_count = merge_range4(rules.v4, rules.v4_count);
+    rules.v6_count = merge_range6(rules.v6, rules.v6_count);
+    int ret = build_acl(set, &rules);
+
+    free(rules.v4);
+    free(rules.v6);
+    free(rules.domains);
+    free(rules.pool);
+
+    return ret;
+}
+
+static int check_image(const uint8_t *data, size_t len)
+{
+    const struct acl_image *image = (const struct acl_image *)data;
+    const uint32_t *index = (const uint32_t *)(data + sizeof(struct acl_image));
+    struct acl_layout l;
+    uint32_t i, empty = 0;
+
+    if (len < sizeof(struct acl_image)) {
+        LOGE("truncated acl image");
+        return -1;
+    }
+    if (image->version != ACL_IMAGE_VERSION) {
+        LOGE("unsupported acl image version or byte order");
+        return -1;
+    }
+    if (image_layout(&l, image->v4_count, image->v6_count,
+                     image->domain_slots, image->pool_size)
+        || image->size != len || len != l.size) {
+        LOGE("acl image sections do not match its size");
+        return -1;
+    }
+    if (image->checksum != image_checksum(data + sizeof(struct acl_image),
+                                          len - sizeof(struct acl_image))) {
+        LOGE("acl image checksum mismatch");
+        return -1;
+    }
+    for (i = 0; i < ACL_V4_INDEX_SIZE; i++) {
+        if (index[i] > index[i + 1]) {
+            break;
+        }
+    }
+    if (i < ACL_V4_INDEX_SIZE || index[ACL_V4_INDEX_SIZE] != image->v4_count) {
+        LOGE("corrupted acl image index");
+        return -1;
+    }
+    if (image->domain_slots & (image->domain_slots - 1)) {
+        LOGE("corrupted acl image domains");
+        return -1;
+    }
+    for (i = 0; i < image->domain_slots; i++) {
+        const struct acl_domain *d =
+            (const struct acl_domain *)(data + l.domains) + i;
+        if (d->hash == 0) {
+            empty++;
+        } else if ((uint64_t)d->offset + d->len > image->pool_size) {
+            break;
+        }
+    }
+    if (i < image->domain_slots || (image->domain_slots > 0 && empty == 0)) {
+        LOGE("corrupted acl image domains");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int load_acl_image(const char *path, struct acl_set *set)
+{
+    struct stat st;
+    void *data;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        ERROR("open");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        LOGE("acl image too large");
+        close(fd);
+        return -1;
+    }
+
+#ifndef __MINGW32__
+    /*
+     * The pages still follow the file, so check_image only holds as long as
+     * the image is replaced by rename and never rewritten or truncated in
+     * place, which would also raise SIGBUS.
+     */
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ERROR("mmap");
+        return -1;
+    }
+    if (check_image(data, st.st_size)) {
+        munmap(data, st.st_size);
+        return -1;
+    }
+    acl_set_attach(set, data, st.st_size);
+#else
+    data = malloc(st.st_size);
+    ssize_t r = read(fd, data, st.st_size);
+    close(fd);
+    if (r != st.st_size || check_image(data, st.st_size)) {
+        free(data);
+        return -1;
+    }
+    acl_set_attach(set, data, 0);
+#endif
+
+    return 0;
+}
+
+static int load_acl(const char *path, struct acl_set *set)
+{
+    char magic[8];
+    int ret;
+
+    memset(set, 0, sizeof(struct acl_set));
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("Invalid acl path.");
+        return -1;
+    }
+
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+        && memcmp(magic, ACL_IMAGE_MAGIC, sizeof(magic)) == 0) {
+        fclose(f);
+        return load_acl_image(path, set);
+    }
+
+    rewind(f);
+    ret = parse_acl(f, set);
     fclose(f);
 
+    return ret;
+}
+
+static void release_acl(struct acl_set *set)
+{
+#ifndef __MINGW32__
+    if (set->map_len > 0) {
+        munmap(set->data, set->map_len);
+    } else
+#endif
+    free(set->data);
+    memset(set, 0, sizeof(struct acl_set));
+}
+
+int init_acl(const char *path)
+{
+    free(acl_path);
+    acl_path = strdup(path);
+
+    return load_acl(path, &acl_set);
+}
+
+/*
+ * Load the list given to init_acl() again and swap it in. Lookups only run
+ * from event callbacks and keep no references into the tables, so the old
+ * set can be released right away. On failure the current rules stay.
+ */
+int reload_acl(void)
+{
+    struct acl_set set;
+
+    if (acl_path == NULL) {
+        return -1;
+    }
+
+    if (load_acl(acl_path, &set)) {
+        LOGE("failed to reload acl, keeping the current rules");
+        return -1;
+    }
+
+    release_acl(&acl_set);
+    acl_set = set;
+
+    LOGI("acl reloaded: %u IPv4 and %u IPv6 ranges", acl_set.v4_count,
+         acl_set.v6_count);
+
+    return 0;
+}
+
+int save_acl(const char *path)
+{
+    const struct acl_image *image = acl_set.data;
+    char tmp[PATH_MAX];
+
+    if (image == NULL) {
+        return -1;
+    }
+
+    // write aside and rename, processes may have the old image mapped
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        ERROR("fopen");
+        return -1;
+    }
+    if (fwrite(image, 1, image->size, f) != image->size) {
+        ERROR("fwrite");
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        ERROR("rename");
+        unlink(tmp);
+        return -1;
+    }
+
     return 0;
 }
 
 void free_acl(void)
 {
-    ipset_done(&acl_ipv4_set);
-    ipset_done(&acl_ipv6_set);
+    release_acl(&acl_set);
+    free(acl_path);
+    acl_path = NULL;
+}
+
+int acl_contains_ipv4(const struct in_addr *addr)
+{
+    uint32_t ip = load_addr4(addr);
+    uint32_t b = ip >> (32 - ACL_V4_INDEX_BITS);
+    uint32_t lo = acl_set.v4_index[b];
+    uint32_t hi = acl_set.v4_index[b + 1];
+
+    // the range holding ip, if any, is the first one ending at or after it
+    if (hi < acl_set.v4_count) {
+        hi++;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (acl_set.v4[mid].last < ip) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < acl_set.v4_count && acl_set.v4[lo].first <= ip;
+}
+
+int acl_contains_ipv6(const struct in6_addr *addr)
+{
+    struct acl_addr6 ip = load_addr6(addr);
+    uint32_t lo = 0, hi = acl_set.v6_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (addr6_cmp(&acl_set.v6[mid].last, &ip) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < acl_set.v6_count && addr6_cmp(&acl_set.v6[lo].first, &ip) <= 0;
 }
 
 int acl_contains_ip(const char * host)
@@ -114,9 +854,38 @@ int acl_contains_ip(const char * host)
     }
 
     if (addr.version == 4) {
-        return ipset_contains_ipv4(&acl_ipv4_set, &(addr.ip.v4));
+        return acl_contains_ipv4((const struct in_addr *)&addr.ip.v4);
     } else if (addr.version == 6) {
-        return ipset_contains_ipv6(&acl_ipv6_set, &(addr.ip.v6));
+        return acl_contains_ipv6((const struct in6_addr *)&addr.ip.v6);
+    }
+
+    return 0;
+}
+
+int acl_contains_domain(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    if (acl_set.domain_slots == 0) {
+        return 0;
+    }
+
+    if (len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+
+    // hash the name backwards, probing at every label boundary
+    for (i = len; i > 0; i--) {
+        h = domain_hash_step(h, name[i - 1]);
+        if (i == 1 || name[i - 2] == '.') {
+            const struct acl_domain *d =
+                find_domain(acl_set.domains, acl_set.domain_slots - 1,
+                            acl_set.pool, h ? h : 1, name + i - 1, len - i + 1);
+            if (d != NULL && (d->suffix || i == 1)) {
+                return 1;
+            }
+        }
     }
 
     return 0;
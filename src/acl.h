@@ -23,9 +23,19 @@
 #ifndef _ACL_H
 #define _ACL_H
 
+#include <stddef.h>
+
+struct in_addr;
+struct in6_addr;
+
 int init_acl(const char *path);
 void free_acl(void);
+int reload_acl(void);
+int save_acl(const char *path);
 
 int acl_contains_ip(const char * ip);
+int acl_contains_ipv4(const struct in_addr *addr);
+int acl_contains_ipv6(const struct in6_addr *addr);
+int acl_contains_domain(const char *name, size_t len);
 
 #endif // _ACL_H
@@ -0,0 +1,54 @@
+/*
+ * aclc.c - Compile an ACL (Access Control List) into a binary image
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "utils.h"
+#include "acl.h"
+
+int main(int argc, char **argv)
+{
+    USE_TTY();
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: ss-aclc <acl_file> <output_image>\n");
+        return 1;
+    }
+
+    if (init_acl(argv[1])) {
+        return 1;
+    }
+
+    if (save_acl(argv[2])) {
+        free_acl();
+        return 1;
+    }
+
+    free_acl();
+
+    return 0;
+}
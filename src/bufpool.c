@@ -0,0 +1,81 @@
+/*
+ * bufpool.c - Hand out relay buffers on demand and recycle them
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+size_t buf_budget = 0;
+size_t buf_used   = 0;
+
+char *buf_pool_get(struct buf_pool *pool)
+{
+    void **buf = pool->free_list;
+
+    buf_used += pool->size;
+
+    if (buf == NULL) {
+        return malloc(pool->size);
+    }
+
+    pool->free_list = *buf;
+    pool->free_num--;
+    return (char *)buf;
+}
+
+/*
+ * Buffers grown by ss_encrypt()/ss_decrypt() are at least as large as the
+ * others, so they are recycled all the same.
+ */
+void buf_pool_put(struct buf_pool *pool, char *buf)
+{
+    buf_used -= pool->size;
+
+    if (pool->free_num >= pool->max_free) {
+        free(buf);
+        return;
+    }
+
+    *(void **)buf   = pool->free_list;
+    pool->free_list = buf;
+    pool->free_num++;
+}
+
+/*
+ * Account for a buffer freed by someone else, as ss_encrypt() and
+ * ss_decrypt() do on failure
+ */
+void buf_pool_drop(struct buf_pool *pool)
+{
+    buf_used -= pool->size;
+}
+
+void buf_pool_done(struct buf_pool *pool)
+{
+    void **buf;
+
+    while ((buf = pool->free_list) != NULL) {
+        pool->free_list = *buf;
+        free(buf);
+    }
+    pool->free_num = 0;
+}
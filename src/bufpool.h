@@ -0,0 +1,90 @@
+/*
+ * bufpool.h - Define the pool of relay buffers shared by all sessions
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+
+#include <stddef.h>
+
+#define BUF_POOL_MAX_FREE 1024
+
+/**
+ * Buffers of one size, kept on a free list threaded through the buffers
+ * themselves once given back. Sessions attach a buffer only while it holds
+ * data, so the pool is sized by the traffic in flight rather than by the
+ * number of sessions.
+ */
+struct buf_pool {
+    size_t size;      /**<Size of each buffer */
+    size_t max_free;  /**<Free buffers kept, the rest are released */
+    size_t free_num;
+    void *free_list;
+};
+
+#define BUF_POOL_INIT(size) { (size), BUF_POOL_MAX_FREE, 0, NULL }
+
+/*
+ * Bytes handed out by all pools, plus what callers charge for their own
+ * copies, against an optional process-wide budget. Reading is throttled
+ * once the budget is used up, and resumes below three quarters of it.
+ */
+extern size_t buf_budget; // 0 for no limit
+extern size_t buf_used;
+
+char *buf_pool_get(struct buf_pool *pool);
+void buf_pool_put(struct buf_pool *pool, char *buf);
+void buf_pool_drop(struct buf_pool *pool);
+void buf_pool_done(struct buf_pool *pool);
+
+static inline int buf_budget_exhausted(void)
+{
+    return buf_budget > 0 && buf_used >= buf_budget;
+}
+
+static inline int buf_budget_relieved(void)
+{
+    return buf_used <= buf_budget / 4 * 3;
+}
+
+/*
+ * Make sure *buf holds a buffer, taking one from the pool if needed
+ */
+static inline char *buf_attach(struct buf_pool *pool, char **buf)
+{
+    if (*buf == NULL) {
+        *buf = buf_pool_get(pool);
+    }
+    return *buf;
+}
+
+/*
+ * Give the buffer held by *buf, if any, back to the pool
+ */
+static inline void buf_release(struct buf_pool *pool, char **buf)
+{
+    if (*buf != NULL) {
+        buf_pool_put(pool, *buf);
+        *buf = NULL;
+    }
+}
+
+#endif // _BUFPOOL_H
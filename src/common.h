@@ -53,17 +53,26 @@
 #define TCP_AND_UDP  1
 #define UDP_ONLY     3
 
+// the address header of a TCP connection carrying UDP datagrams
+#define UOT_ADDRTYPE 0x7e
+
 int init_udprelay(const char *server_host, const char *server_port,
 #ifdef UDPRELAY_LOCAL
-                  const struct sockaddr *remote_addr, const int remote_addr_len,
+                  const struct sockaddr *remote_addr, int over_tcp,
 #ifdef UDPRELAY_TUNNEL
-                  const ss_addr_t tunnel_addr,
+                  const ss_addr_t tunnel_addr, int dns_cache,
 #endif
 #endif
                   int method, int timeout, const char *iface);
 
 void free_udprelay(void);
 
+#ifdef UDPRELAY_REMOTE
+void drain_udprelay(void);
+void udprelay_accept(EV_P_ int fd, struct enc_ctx *e_ctx,
+                     struct enc_ctx *d_ctx, const char *frames, int len);
+#endif
+
 #ifdef ANDROID
 int protect_socket(int fd);
 #endif
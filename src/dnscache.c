@@ -0,0 +1,331 @@
+/*
+ * dnscache.c - Answer repeated DNS queries of ss-tunnel locally
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dnscache.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_KEY (255 + 4 + 1)
+#define DNS_MAX_UDP 512 // without EDNS
+
+#define DNS_TYPE_OPT 41
+
+// the last byte of the key, responses differ with each of them
+#define DNS_KEY_CD   0x01
+#define DNS_KEY_EDNS 0x02
+#define DNS_KEY_DO   0x04
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+static inline unsigned int load16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/*
+ * Copy the question of a message, with the name in lowercase, into key.
+ * Only plain one-question QUERY messages are accepted. Returns the offset
+ * right after the question, or 0.
+ */
+static int dns_question(const uint8_t *msg, int len, char *key, int *key_len)
+{
+    int off = DNS_HEADER_SIZE;
+    int k = 0;
+
+    if (len < DNS_HEADER_SIZE || load16(msg + 4) != 1
+        || (msg[2] & 0x78) != 0) {
+        return 0;
+    }
+
+    while (off < len && msg[off] != 0) {
+        int l = msg[off];
+        // names in the question are never compressed
+        if (l > 63 || off + 1 + l >= len || k + 1 + l >= 255) {
+            return 0;
+        }
+        key[k++] = l;
+        for (int i = 1; i <= l; i++) {
+            key[k++] = tolower(msg[off + i]);
+        }
+        off += 1 + l;
+    }
+
+    if (off + 5 > len) {
+        return 0;
+    }
+    key[k++] = 0;
+    off++;
+
+    // QTYPE and QCLASS
+    memcpy(key + k, msg + off, 4);
+    *key_len = k + 4;
+
+    return off + 4;
+}
+
+static int skip_name(const uint8_t *msg, int len, int off)
+{
+    while (off < len) {
+        if (msg[off] == 0) {
+            return off + 1;
+        }
+        if ((msg[off] & 0xc0) == 0xc0) {
+            return off + 2 <= len ? off + 2 : 0;
+        }
+        if (msg[off] & 0xc0) {
+            return 0;
+        }
+        off += msg[off] + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Finish the key of a message with its CD bit and what its OPT record
+ * asks for, and find the largest response its sender accepts. Queries
+ * and responses agree on these, as servers copy them into the response.
+ */
+static int dns_key_edns(const uint8_t *msg, int len, int off, char *key,
+                        int *key_len, int *udp_size)
+{
+    int count = load16(msg + 6) + load16(msg + 8) + load16(msg + 10);
+    uint8_t flags = (msg[3] & 0x10) ? DNS_KEY_CD : 0;
+
+    *udp_size = DNS_MAX_UDP;
+    for (int i = 0; i < count; i++) {
+        off = skip_name(msg, len, off);
+        if (off == 0 || off + 10 > len) {
+            return -1;
+        }
+
+        if (load16(msg + off) == DNS_TYPE_OPT) {
+            flags |= DNS_KEY_EDNS;
+            if (msg[off + 6] & 0x80) {
+                flags |= DNS_KEY_DO;
+            }
+            if (load16(msg + off + 2) > DNS_MAX_UDP) {
+                *udp_size = load16(msg + off + 2);
+            }
+        }
+
+        off += 10 + load16(msg + off + 8);
+        if (off > len) {
+            return -1;
+        }
+    }
+
+    key[(*key_len)++] = flags;
+    return 0;
+}
+
+/*
+ * Visit the TTL of every record after the question. With min set, find
+ * the lowest one; otherwise age them all by the given seconds. The OPT
+ * pseudo record keeps flags in its TTL field and is skipped.
+ */
+static int visit_ttls(uint8_t *msg, int len, int off, uint32_t *min,
+                      uint32_t age)
+{
+    int count = load16(msg + 6) + load16(msg + 8) + load16(msg + 10);
+
+    for (int i = 0; i < count; i++) {
+        off = skip_name(msg, len, off);
+        if (off == 0 || off + 10 > len) {
+            return -1;
+        }
+
+        if (load16(msg + off) != DNS_TYPE_OPT) {
+            uint8_t *p   = msg + off + 4;
+            uint32_t ttl = ((uint32_t)p[0] << 24) | (p[1] << 16)
+                           | (p[2] << 8) | p[3];
+            if (min != NULL) {
+                if (ttl < *min) {
+                    *min = ttl;
+                }
+            } else {
+                ttl  = ttl > age ? ttl - age : 0;
+                p[0] = ttl >> 24;
+                p[1] = ttl >> 16;
+                p[2] = ttl >> 8;
+                p[3] = ttl;
+            }
+        }
+
+        off += 10 + load16(msg + off + 8);
+        if (off > len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void remove_entry(struct dns_cache *cache, struct dns_cache_entry *entry)
+{
+    HASH_DELETE(hh, cache->entries, entry);
+    free(entry);
+}
+
+int dns_cache_create(struct dns_cache **dst, const size_t capacity)
+{
+    struct dns_cache *new = NULL;
+
+    if (!dst) {
+        return EINVAL;
+    }
+
+    if ((new = malloc(sizeof(*new))) == NULL) {
+        return ENOMEM;
+    }
+
+    memset(new, 0, sizeof(*new));
+    new->max_entries = capacity;
+    *dst = new;
+    return 0;
+}
+
+void dns_cache_delete(struct dns_cache *cache)
+{
+    struct dns_cache_entry *entry, *tmp;
+
+    if (!cache) {
+        return;
+    }
+
+    HASH_ITER(hh, cache->entries, entry, tmp){
+        remove_entry(cache, entry);
+    }
+
+    free(cache);
+}
+
+/*
+ * Answer a query from the cache. On a hit the response replaces the query
+ * in buf, keeping the query's ID and the exact spelling of its question,
+ * with TTLs lowered by the time spent in the cache. Returns the length of
+ * the response, or 0 on a miss.
+ */
+int dns_cache_lookup(struct dns_cache *cache, char *buf, int len, int size,
+                     ev_tstamp now)
+{
+    uint8_t *msg = (uint8_t *)buf;
+    char key[DNS_MAX_KEY];
+    int key_len, question_end, udp_size;
+    struct dns_cache_entry *entry = NULL;
+
+    if (len < DNS_HEADER_SIZE || (msg[2] & 0x80)) {
+        return 0;
+    }
+    question_end = dns_question(msg, len, key, &key_len);
+    if (question_end == 0
+        || dns_key_edns(msg, len, question_end, key, &key_len, &udp_size)) {
+        return 0;
+    }
+
+    HASH_FIND(hh, cache->entries, key, key_len, entry);
+    if (entry != NULL && now >= entry->expires) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if (entry == NULL || entry->msg_len > size || entry->msg_len > udp_size) {
+        cache->misses++;
+        return 0;
+    }
+
+    // move to the tail of the LRU order
+    HASH_DELETE(hh, cache->entries, entry);
+    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+
+    // everything but the ID and the question
+    memcpy(buf + 2, entry->msg + 2, DNS_HEADER_SIZE - 2);
+    memcpy(buf + entry->question_end, entry->msg + entry->question_end,
+           entry->msg_len - entry->question_end);
+    visit_ttls(msg, entry->msg_len, entry->question_end, NULL,
+               (uint32_t)(now - entry->stored));
+
+    cache->hits++;
+    return entry->msg_len;
+}
+
+/*
+ * Keep a response until its lowest TTL runs out. Only complete answers,
+ * and NXDOMAIN or empty answers carrying an SOA, are kept.
+ */
+void dns_cache_insert(struct dns_cache *cache, const char *msg, int len,
+                      ev_tstamp now)
+{
+    const uint8_t *p = (const uint8_t *)msg;
+    char key[DNS_MAX_KEY];
+    int key_len, question_end, udp_size;
+    uint32_t ttl = DNS_CACHE_MAX_TTL;
+    struct dns_cache_entry *entry = NULL;
+
+    if (len < DNS_HEADER_SIZE || !(p[2] & 0x80) || (p[2] & 0x02)) {
+        return;
+    }
+    if ((p[3] & 0x0f) != DNS_RCODE_NOERROR
+        && (p[3] & 0x0f) != DNS_RCODE_NXDOMAIN) {
+        return;
+    }
+    if (load16(p + 6) + load16(p + 8) == 0) {
+        return;
+    }
+
+    question_end = dns_question(p, len, key, &key_len);
+    if (question_end == 0
+        || dns_key_edns(p, len, question_end, key, &key_len, &udp_size)
+        || visit_ttls((uint8_t *)p, len, question_end, &ttl, 0) || ttl == 0) {
+        return;
+    }
+
+    HASH_FIND(hh, cache->entries, key, key_len, entry);
+    if (entry != NULL) {
+        remove_entry(cache, entry);
+    }
+
+    entry = malloc(sizeof(*entry) + key_len + len);
+    if (entry == NULL) {
+        return;
+    }
+    entry->key          = (char *)(entry + 1);
+    entry->key_len      = key_len;
+    entry->msg          = entry->key + key_len;
+    entry->msg_len      = len;
+    entry->question_end = question_end;
+    entry->stored       = now;
+    entry->expires      = now + ttl;
+    memcpy(entry->key, key, key_len);
+    memcpy(entry->msg, msg, len);
+    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+
+    if (HASH_COUNT(cache->entries) > cache->max_entries) {
+        // the head is the least recently used
+        remove_entry(cache, cache->entries);
+    }
+}
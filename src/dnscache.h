@@ -0,0 +1,61 @@
+/*
+ * dnscache.h - Define the DNS response cache of ss-tunnel
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DNSCACHE_H
+#define _DNSCACHE_H
+
+#include <ev.h>
+
+#include "uthash.h"
+
+#define DNS_CACHE_SIZE 1024
+#define DNS_CACHE_MAX_TTL 86400
+
+/**
+ * A cached response, keyed by its question
+ */
+struct dns_cache_entry {
+    char *key;         /**<Lowercase QNAME, QTYPE, QCLASS, CD and EDNS flags */
+    int key_len;
+    char *msg;         /**<The response as received */
+    int msg_len;
+    int question_end;  /**<Offset of the first record */
+    ev_tstamp stored;  /**<When the response was received */
+    ev_tstamp expires; /**<When its lowest TTL runs out */
+    UT_hash_handle hh; /**<Hash Handle for uthash, in LRU order */
+};
+
+struct dns_cache {
+    size_t max_entries;
+    size_t hits;
+    size_t misses;
+    struct dns_cache_entry *entries;
+};
+
+int dns_cache_create(struct dns_cache **dst, const size_t capacity);
+void dns_cache_delete(struct dns_cache *cache);
+int dns_cache_lookup(struct dns_cache *cache, char *buf, int len, int size,
+                     ev_tstamp now);
+void dns_cache_insert(struct dns_cache *cache, const char *msg, int len,
+                      ev_tstamp now);
+
+#endif // _DNSCACHE_H
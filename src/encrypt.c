@@ -67,13 +67,23 @@
 
 #include <sodium.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TABLE_SIMD
+#include <immintrin.h>
+#endif
+
 #include "encrypt.h"
 #include "utils.h"
 
 #define OFFSET_ROL(p, o) ((uint64_t)(*(p + o)) << (8 * o))
+#define TABLE_ROUNDS 1024
 
 static uint8_t *enc_table;
 static uint8_t *dec_table;
+static uint8_t enc_rows[256];
+static uint8_t dec_rows[256];
+static void (*table_substitute)(uint8_t *buf, size_t len,
+                                const uint8_t *table, const uint8_t *rows);
 static uint8_t enc_key[MAX_KEY_LENGTH];
 static int enc_key_len;
 static int enc_iv_len;
@@ -207,82 +217,145 @@ static int crypto_stream_xor_ic(uint8_t *c, const uint8_t *m, uint64_t mlen,
     return 0;
 }
 
-static int random_compare(const void *_x, const void *_y, uint32_t i,
-                          uint64_t a)
+/*
+ * One round of the legacy table derivation: a stable sort of the table by
+ * (key % (x + salt)). The sort keys never exceed 255 + salt, so a counting
+ * sort yields exactly the same permutation as the merge sort used before.
+ * The residues are looked up from a precomputed array instead of doing a
+ * 64-bit modulo per comparison.
+ */
+static void table_sort(uint8_t *table, uint32_t salt, const uint16_t *residue)
 {
-    uint8_t x = *((uint8_t *)_x);
-    uint8_t y = *((uint8_t *)_y);
-    return a % (x + i) - a % (y + i);
-}
+    uint16_t rank[256];
+    uint16_t count[TABLE_ROUNDS + 256];
+    uint8_t sorted[256];
+    uint32_t buckets = 256 + salt;
+    uint32_t i, sum;
 
-static void merge(uint8_t *left, int llength, uint8_t *right,
-                  int rlength, uint32_t salt, uint64_t key)
-{
-    uint8_t *ltmp = (uint8_t *)malloc(llength * sizeof(uint8_t));
-    uint8_t *rtmp = (uint8_t *)malloc(rlength * sizeof(uint8_t));
+    memset(count, 0, buckets * sizeof(uint16_t));
 
-    uint8_t *ll = ltmp;
-    uint8_t *rr = rtmp;
+    for (i = 0; i < 256; i++) {
+        rank[i] = residue[table[i] + salt];
+        count[rank[i]]++;
+    }
 
-    uint8_t *result = left;
+    for (i = 0, sum = 0; i < buckets; i++) {
+        uint16_t c = count[i];
+        count[i] = sum;
+        sum     += c;
+    }
 
-    memcpy(ltmp, left, llength * sizeof(uint8_t));
-    memcpy(rtmp, right, rlength * sizeof(uint8_t));
+    for (i = 0; i < 256; i++) {
+        sorted[count[rank[i]]++] = table[i];
+    }
 
-    while (llength > 0 && rlength > 0) {
-        if (random_compare(ll, rr, salt, key) <= 0) {
-            *result = *ll;
-            ++ll;
-            --llength;
-        } else {
-            *result = *rr;
-            ++rr;
-            --rlength;
-        }
-        ++result;
+    memcpy(table, sorted, 256);
+}
+
+static void table_substitute_scalar(uint8_t *buf, size_t len,
+                                    const uint8_t *table, const uint8_t *rows)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        buf[i] = table[buf[i]];
     }
+}
 
-    if (llength > 0) {
-        while (llength > 0) {
-            *result = *ll;
-            ++result;
-            ++ll;
-            --llength;
-        }
-    } else {
-        while (rlength > 0) {
-            *result = *rr;
-            ++result;
-            ++rr;
-            --rlength;
+#ifdef TABLE_SIMD
+
+/*
+ * pshufb looks up 16 entries at a time and yields zero for indices with
+ * the sign bit set. The table is walked in 16-entry rows: the index is
+ * decreased by 16 with signed saturation per row, so a lane stays active
+ * (non-negative) for every row up to and including its own, and the rows
+ * are stored as deltas so that the XOR of all active lookups telescopes
+ * to the wanted entry. The upper half of the table is handled the same
+ * way after flipping the sign bit of the input.
+ */
+
+__attribute__((target("ssse3")))
+static void table_substitute_ssse3(uint8_t *buf, size_t len,
+                                   const uint8_t *table, const uint8_t *rows)
+{
+    const __m128i step  = _mm_set1_epi8(16);
+    const __m128i sign  = _mm_set1_epi8(-128);
+    size_t i;
+    int h;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x   = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i lo  = x;
+        __m128i hi  = _mm_xor_si128(x, sign);
+        __m128i out = _mm_setzero_si128();
+        for (h = 0; h < 8; h++) {
+            __m128i rlo = _mm_loadu_si128((const __m128i *)(rows + h * 16));
+            __m128i rhi = _mm_loadu_si128((const __m128i *)(rows + 128 + h * 16));
+            out = _mm_xor_si128(out, _mm_shuffle_epi8(rlo, lo));
+            out = _mm_xor_si128(out, _mm_shuffle_epi8(rhi, hi));
+            lo  = _mm_subs_epi8(lo, step);
+            hi  = _mm_subs_epi8(hi, step);
         }
+        _mm_storeu_si128((__m128i *)(buf + i), out);
     }
 
-    free(ltmp);
-    free(rtmp);
+    table_substitute_scalar(buf + i, len - i, table, rows);
 }
 
-static void merge_sort(uint8_t array[], int length,
-                       uint32_t salt, uint64_t key)
+__attribute__((target("avx2")))
+static void table_substitute_avx2(uint8_t *buf, size_t len,
+                                  const uint8_t *table, const uint8_t *rows)
 {
-    uint8_t middle;
-    uint8_t *left, *right;
-    int llength;
-
-    if (length <= 1) {
-        return;
+    const __m256i step  = _mm256_set1_epi8(16);
+    const __m256i sign  = _mm256_set1_epi8(-128);
+    size_t i;
+    int h;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i x   = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i lo  = x;
+        __m256i hi  = _mm256_xor_si256(x, sign);
+        __m256i out = _mm256_setzero_si256();
+        for (h = 0; h < 8; h++) {
+            __m256i rlo = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)(rows + h * 16)));
+            __m256i rhi = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)(rows + 128 + h * 16)));
+            out = _mm256_xor_si256(out, _mm256_shuffle_epi8(rlo, lo));
+            out = _mm256_xor_si256(out, _mm256_shuffle_epi8(rhi, hi));
+            lo  = _mm256_subs_epi8(lo, step);
+            hi  = _mm256_subs_epi8(hi, step);
+        }
+        _mm256_storeu_si256((__m256i *)(buf + i), out);
     }
 
-    middle = length / 2;
+    table_substitute_scalar(buf + i, len - i, table, rows);
+}
 
-    llength = length - middle;
+#endif
 
-    left = array;
-    right = array + llength;
+static void table_rows_init(uint8_t *rows, const uint8_t *table)
+{
+    int i;
+    for (i = 0; i < 128; i++) {
+        rows[i]       = table[i] ^ (i < 16 ? 0 : table[i - 16]);
+        rows[i + 128] = table[i + 128] ^ (i < 16 ? 0 : table[i + 112]);
+    }
+}
 
-    merge_sort(left, llength, salt, key);
-    merge_sort(right, middle, salt, key);
-    merge(left, llength, right, middle, salt, key);
+static void table_substitute_init(void)
+{
+    table_rows_init(enc_rows, enc_table);
+    table_rows_init(dec_rows, dec_table);
+
+    table_substitute = table_substitute_scalar;
+#ifdef TABLE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        table_substitute = table_substitute_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        table_substitute = table_substitute_ssse3;
+    }
+#endif
 }
 
 int enc_get_iv_len()
@@ -290,6 +363,14 @@ int enc_get_iv_len()
     return enc_iv_len;
 }
 
+const char *enc_get_method_name(int method)
+{
+    if (method < TABLE || method >= CIPHER_NUM) {
+        return NULL;
+    }
+    return supported_ciphers[method];
+}
+
 unsigned char *enc_md5(const unsigned char *d, size_t n, unsigned char *md)
 {
 #if defined(USE_CRYPTO_OPENSSL)
@@ -316,6 +397,7 @@ void enc_table_init(const char *pass)
     uint32_t i;
     uint64_t key = 0;
     uint8_t *digest;
+    uint16_t residue[TABLE_ROUNDS + 256];
 
     enc_table = malloc(256);
     dec_table = malloc(256);
@@ -326,16 +408,23 @@ void enc_table_init(const char *pass)
         key += OFFSET_ROL(digest, i);
     }
 
+    // every round divides by (x + salt), so each divisor is reduced only once
+    for (i = 1; i < TABLE_ROUNDS + 256; i++) {
+        residue[i] = key % i;
+    }
+
     for (i = 0; i < 256; ++i) {
         enc_table[i] = i;
     }
-    for (i = 1; i < 1024; ++i) {
-        merge_sort(enc_table, 256, i, key);
+    for (i = 1; i < TABLE_ROUNDS; ++i) {
+        table_sort(enc_table, i, residue);
     }
     for (i = 0; i < 256; ++i) {
         // gen decrypt table from encrypt table
         dec_table[enc_table[i]] = i;
     }
+
+    table_substitute_init();
 }
 
 int cipher_iv_size(const cipher_kt_t *cipher)
@@ -1027,6 +1116,7 @@ char * ss_encrypt_all(int buf_size, char *plaintext, ssize_t *len, int method)
 {
     if (method > TABLE) {
         cipher_ctx_t evp;
+        memset(&evp, 0, sizeof(cipher_ctx_t));
         cipher_context_init(&evp, method, 1);
 
         int p_len = *len, c_len = *len;
@@ -1078,12 +1168,8 @@ char * ss_encrypt_all(int buf_size, char *plaintext, ssize_t *len, int method)
 
         return plaintext;
     } else {
-        char *begin = plaintext;
-        while (plaintext < begin + *len) {
-            *plaintext = (char)enc_table[(uint8_t)*plaintext];
-            plaintext++;
-        }
-        return begin;
+        table_substitute((uint8_t *)plaintext, *len, enc_table, enc_rows);
+        return plaintext;
     }
 }
 
@@ -1165,12 +1251,8 @@ char * ss_encrypt(int buf_size, char *plaintext, ssize_t *len,
 
         return plaintext;
     } else {
-        char *begin = plaintext;
-        while (plaintext < begin + *len) {
-            *plaintext = (char)enc_table[(uint8_t)*plaintext];
-            plaintext++;
-        }
-        return begin;
+        table_substitute((uint8_t *)plaintext, *len, enc_table, enc_rows);
+        return plaintext;
     }
 }
 
@@ -1178,6 +1260,7 @@ char * ss_decrypt_all(int buf_size, char *ciphertext, ssize_t *len, int method)
 {
     if (method > TABLE) {
         cipher_ctx_t evp;
+        memset(&evp, 0, sizeof(cipher_ctx_t));
         cipher_context_init(&evp, method, 0);
         int iv_len = enc_iv_len;
         int c_len = *len, p_len = *len - iv_len;
@@ -1228,12 +1311,8 @@ char * ss_decrypt_all(int buf_size, char *ciphertext, ssize_t *len, int method)
 
         return ciphertext;
     } else {
-        char *begin = ciphertext;
-        while (ciphertext < begin + *len) {
-            *ciphertext = (char)dec_table[(uint8_t)*ciphertext];
-            ciphertext++;
-        }
-        return begin;
+        table_substitute((uint8_t *)ciphertext, *len, dec_table, dec_rows);
+        return ciphertext;
     }
 }
 
@@ -1314,12 +1393,8 @@ char * ss_decrypt(int buf_size, char *ciphertext, ssize_t *len,
 
         return ciphertext;
     } else {
-        char *begin = ciphertext;
-        while (ciphertext < begin + *len) {
-            *ciphertext = (char)dec_table[(uint8_t)*ciphertext];
-            ciphertext++;
-        }
-        return begin;
+        table_substitute((uint8_t *)ciphertext, *len, dec_table, dec_rows);
+        return ciphertext;
     }
 }
 
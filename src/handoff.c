@@ -0,0 +1,506 @@
+/*
+ * handoff.c - Hand the listening sockets of ss-server to its successor
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "handoff.h"
+
+#ifdef HANDOFF_SUPPORTED
+
+#define HANDOFF_MAGIC 0x73736830 // "ssh0", bumped when the layout changes
+
+struct handoff_entry {
+    int32_t type;
+    char host[256];
+    char port[16];
+};
+
+struct handoff_msg {
+    uint32_t magic;
+    uint32_t num;
+    struct handoff_entry entries[HANDOFF_MAX_SOCKETS];
+};
+
+struct handoff_socket {
+    struct handoff_entry entry;
+    int fd;  /**<-1 once taken */
+};
+
+extern int verbose;
+
+// sockets of this process, handed to the next one
+static struct handoff_socket sockets[HANDOFF_MAX_SOCKETS];
+static int socket_num = 0;
+
+// sockets received from the previous process
+static struct handoff_socket received[HANDOFF_MAX_SOCKETS];
+static int received_num = 0;
+
+static int listen_fd    = -1;
+static char *listen_path = NULL;
+static ev_io listen_io;
+static int peer_fd = -1; // the other process, while handing off
+static ev_io peer_io;
+static void (*handoff_done)(EV_P) = NULL;
+
+static void entry_init(struct handoff_entry *entry, int type,
+                       const char *host, const char *port)
+{
+    memset(entry, 0, sizeof(struct handoff_entry));
+    entry->type = type;
+    if (host != NULL) {
+        strncpy(entry->host, host, sizeof(entry->host) - 1);
+    }
+    if (port != NULL) {
+        strncpy(entry->port, port, sizeof(entry->port) - 1);
+    }
+}
+
+static int unix_socket(int nonblock)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (nonblock) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+    return fd;
+}
+
+static int unix_address(const char *path, struct sockaddr_un *sun)
+{
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        LOGE("handoff path too long: %s", path);
+        return -1;
+    }
+
+    memset(sun, 0, sizeof(struct sockaddr_un));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+/*
+ * Only a process of the same user may take the sockets, or hand them over
+ */
+static int peer_trusted(int fd)
+{
+    uid_t uid;
+
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        ERROR("getsockopt");
+        return 0;
+    }
+    uid = cred.uid;
+#else
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) == -1) {
+        ERROR("getpeereid");
+        return 0;
+    }
+#endif
+
+    if (uid != geteuid()) {
+        LOGE("handoff refused, peer runs as uid %d", (int)uid);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Take over the sockets of the ss-server listening on path. Returns the
+ * number of sockets received, 0 if no process is listening there.
+ */
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un sun;
+    struct handoff_msg msg;
+    struct iovec iov;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    int fds[HANDOFF_MAX_SOCKETS];
+    int fd_num = 0;
+    ssize_t len;
+    int fd;
+
+    if (unix_address(path, &sun) == -1) {
+        return 0;
+    }
+
+    fd = unix_socket(0);
+    if (fd == -1) {
+        ERROR("socket");
+        return 0;
+    }
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(struct sockaddr_un))
+        == -1) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            ERROR("handoff connect");
+        }
+        close(fd);
+        return 0;
+    }
+
+    if (!peer_trusted(fd)) {
+        close(fd);
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &msg;
+    iov.iov_len  = sizeof(msg);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov        = &iov;
+    hdr.msg_iovlen     = 1;
+    hdr.msg_control    = control;
+    hdr.msg_controllen = sizeof(control);
+
+    len = recvmsg(fd, &hdr, 0);
+    if (len == -1) {
+        ERROR("handoff recvmsg");
+        close(fd);
+        return 0;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), fd_num * sizeof(int));
+        }
+    }
+    for (int i = 0; i < fd_num; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (len < (ssize_t)offsetof(struct handoff_msg, entries)
+        || msg.magic != HANDOFF_MAGIC || msg.num != (uint32_t)fd_num
+        || len != (ssize_t)(offsetof(struct handoff_msg, entries)
+                            + msg.num * sizeof(struct handoff_entry))
+        || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        LOGE("invalid handoff from %s", path);
+        for (int i = 0; i < fd_num; i++) {
+            close(fds[i]);
+        }
+        close(fd);
+        return 0;
+    }
+
+    for (int i = 0; i < fd_num; i++) {
+        received[i].entry = msg.entries[i];
+        received[i].fd    = fds[i];
+    }
+    received_num = fd_num;
+    peer_fd      = fd;
+
+    LOGI("took over %d sockets from %s", fd_num, path);
+    return fd_num;
+}
+
+/*
+ * A received socket bound for host and port, -1 if there is none
+ */
+int handoff_take(int type, const char *host, const char *port)
+{
+    struct handoff_entry entry;
+    entry_init(&entry, type, host, port);
+
+    for (int i = 0; i < received_num; i++) {
+        if (received[i].fd != -1 && received[i].entry.type == type
+            && strcmp(received[i].entry.host, entry.host) == 0
+            && strcmp(received[i].entry.port, entry.port) == 0) {
+            int fd = received[i].fd;
+            received[i].fd = -1;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Tell the previous process this one serves the sockets now, and close
+ * those no longer configured
+ */
+void handoff_ready(void)
+{
+    char ready = 1;
+
+    for (int i = 0; i < received_num; i++) {
+        if (received[i].fd != -1) {
+            if (verbose) {
+                LOGI("closing unused socket of %s:%s",
+                     received[i].entry.host, received[i].entry.port);
+            }
+            close(received[i].fd);
+            received[i].fd = -1;
+        }
+    }
+    received_num = 0;
+
+    if (peer_fd != -1) {
+        if (send(peer_fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+            ERROR("handoff send");
+        }
+        close(peer_fd);
+        peer_fd = -1;
+    }
+}
+
+void handoff_register(int type, const char *host, const char *port, int fd)
+{
+    if (socket_num >= HANDOFF_MAX_SOCKETS) {
+        LOGE("too many sockets to hand off");
+        return;
+    }
+
+    entry_init(&sockets[socket_num].entry, type, host, port);
+    sockets[socket_num].fd = fd;
+    socket_num++;
+}
+
+static void close_peer(EV_P)
+{
+    ev_io_stop(EV_A_ & peer_io);
+    close(peer_fd);
+    peer_fd = -1;
+}
+
+static void peer_cb(EV_P_ ev_io *w, int revents)
+{
+    char ready;
+    ssize_t r = recv(peer_fd, &ready, 1, 0);
+
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == EINTR)) {
+        return;
+    }
+
+    close_peer(EV_A);
+
+    if (r != 1) {
+        LOGE("the new process went away, keep serving");
+        return;
+    }
+
+    // the successor owns the path now
+    free(listen_path);
+    listen_path = NULL;
+    handoff_close(EV_A);
+
+    LOGI("sockets handed off");
+    handoff_done(EV_A);
+}
+
+static void send_sockets(EV_P_ int fd)
+{
+    struct handoff_msg msg;
+    struct iovec iov;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+    int fds[HANDOFF_MAX_SOCKETS];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = HANDOFF_MAGIC;
+    msg.num   = socket_num;
+    for (int i = 0; i < socket_num; i++) {
+        msg.entries[i] = sockets[i].entry;
+        fds[i]         = sockets[i].fd;
+    }
+
+    iov.iov_base = &msg;
+    iov.iov_len  = offsetof(struct handoff_msg, entries)
+                   + socket_num * sizeof(struct handoff_entry);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov    = &iov;
+    hdr.msg_iovlen = 1;
+    if (socket_num > 0) {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control    = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(int) * socket_num);
+        cmsg               = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int) * socket_num);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * socket_num);
+    }
+
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) == -1) {
+        ERROR("handoff sendmsg");
+        close(fd);
+        return;
+    }
+
+    // keep serving until the new process is ready
+    peer_fd = fd;
+    ev_io_init(&peer_io, peer_cb, fd, EV_READ);
+    ev_io_start(EV_A_ & peer_io);
+    LOGI("handing off %d sockets", socket_num);
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            ERROR("handoff accept");
+        }
+        return;
+    }
+
+    if (peer_fd != -1) {
+        LOGE("a handoff is in progress already");
+        close(fd);
+        return;
+    }
+
+    if (!peer_trusted(fd)) {
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    send_sockets(EV_A_ fd);
+}
+
+/*
+ * Hand the registered sockets to the next ss-server connecting to path
+ */
+int handoff_listen(EV_P_ const char *path, void (*done)(EV_P))
+{
+    struct sockaddr_un sun;
+    mode_t mask;
+    int err;
+
+    if (unix_address(path, &sun) == -1) {
+        return -1;
+    }
+
+    listen_fd = unix_socket(1);
+    if (listen_fd == -1) {
+        ERROR("socket");
+        return -1;
+    }
+
+    // replaces the socket of the previous process, which is done with it,
+    // connecting takes write permission, so only the owner may
+    unlink(path);
+    mask = umask(S_IRWXG | S_IRWXO);
+    err  = bind(listen_fd, (struct sockaddr *)&sun, sizeof(struct sockaddr_un));
+    umask(mask);
+    if (err == -1 || listen(listen_fd, 1) == -1) {
+        ERROR("handoff bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    listen_path  = strdup(path);
+    handoff_done = done;
+    ev_io_init(&listen_io, accept_cb, listen_fd, EV_READ);
+    ev_io_start(EV_A_ & listen_io);
+
+    return 0;
+}
+
+void handoff_close(EV_P)
+{
+    if (peer_fd != -1) {
+        close_peer(EV_A);
+    }
+
+    if (listen_fd == -1) {
+        return;
+    }
+
+    ev_io_stop(EV_A_ & listen_io);
+    close(listen_fd);
+    listen_fd = -1;
+
+    if (listen_path != NULL) {
+        unlink(listen_path);
+        free(listen_path);
+        listen_path = NULL;
+    }
+}
+
+#else
+
+int handoff_connect(const char *path)
+{
+    return 0;
+}
+
+int handoff_take(int type, const char *host, const char *port)
+{
+    return -1;
+}
+
+void handoff_ready(void)
+{
+}
+
+void handoff_register(int type, const char *host, const char *port, int fd)
+{
+}
+
+int handoff_listen(EV_P_ const char *path, void (*done)(EV_P))
+{
+    LOGE("socket handoff is not supported on this platform");
+    return -1;
+}
+
+void handoff_close(EV_P)
+{
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * handoff.h - Define the socket handoff between ss-server processes
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <sys/socket.h>
+#include <ev.h>
+
+/*
+ * A restarted ss-server connects to the UNIX socket of the running one,
+ * which answers with a single message: a description of each socket it
+ * listens on, and the sockets themselves as SCM_RIGHTS. The new process
+ * takes those matching its configuration instead of binding, and sends one
+ * byte back once it serves them. Only then does the old process stop
+ * accepting, so a new process failing to start leaves the old one serving.
+ */
+#if defined(__linux__) && defined(SO_PEERCRED)
+#define HANDOFF_SUPPORTED // SO_PEERCRED
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) \
+    || defined(__DragonFly__)
+#define HANDOFF_SUPPORTED // getpeereid()
+#endif
+
+#define HANDOFF_TCP     1
+#define HANDOFF_UDP     2
+#define HANDOFF_METRICS 3
+
+#define HANDOFF_MAX_SOCKETS 32
+#define HANDOFF_TIMEOUT 10 // seconds to wait for the running process
+
+/* the new process */
+int handoff_connect(const char *path);
+int handoff_take(int type, const char *host, const char *port);
+void handoff_ready(void);
+
+/* both, for every socket there is to hand off */
+void handoff_register(int type, const char *host, const char *port, int fd);
+
+/* the running process, done is called once the sockets are handed off */
+int handoff_listen(EV_P_ const char *path, void (*done)(EV_P));
+void handoff_close(EV_P);
+
+#endif // _HANDOFF_H
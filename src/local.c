@@ -62,6 +62,9 @@
 #endif
 
 #include "netutils.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "mux.h"
 #include "utils.h"
 #include "socks5.h"
 #include "acl.h"
@@ -79,6 +82,10 @@
 #define BUF_SIZE 2048
 #endif
 
+#ifndef ACCEPT_BATCH
+#define ACCEPT_BATCH 16
+#endif
+
 int verbose = 0;
 #ifdef ANDROID
 int vpn = 0;
@@ -88,6 +95,18 @@ static int acl = 0;
 static int mode = TCP_ONLY;
 
 static int fast_open = 0;
+static int mux = 0; // tunnels to the server, 0 for a connection per client
+static int udp_over_tcp = 0;
+static struct sockopt_profile remote_sockopt;
+#ifndef LIB_ONLY
+static int fast_open_queue = 0;
+static int defer_accept = 0;
+static struct sockopt_profile client_sockopt;
+#endif
+
+// bytes read from clients and from remotes
+uint64_t tx = 0;
+uint64_t rx = 0;
 #ifdef HAVE_SETRLIMIT
 #ifndef LIB_ONLY
 static int nofile = 0;
@@ -100,19 +119,22 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_send_cb(EV_P_ ev_io *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
 static void signal_cb(EV_P_ ev_signal *w, int revents);
+static void server_resolve_cb(struct sockaddr *addr, void *data);
 
 static int create_and_bind(const char *addr, const char *port);
-static struct remote * create_remote(struct listen_ctx *listener, struct sockaddr *addr);
+static struct remote * create_remote(struct server *server, struct sockaddr *addr);
 static void free_remote(struct remote *remote);
 static void close_and_free_remote(EV_P_ struct remote *remote);
 static void free_server(struct server *server);
 static void close_and_free_server(EV_P_ struct server *server);
 
-static struct remote * new_remote(int fd, int timeout);
+static struct remote * new_remote(struct server *server, int fd, int timeout);
 static struct server * new_server(int fd, int method);
 
 static struct cork_dllist connections;
 
+static struct buf_pool buf_pool = BUF_POOL_INIT(BUF_SIZE);
+
 #ifndef __MINGW32__
 int setnonblocking(int fd)
 {
@@ -185,16 +207,35 @@ int create_and_bind(const char *addr, const char *port)
     return listen_sock;
 }
 
+/*
+ * Give the buffers holding no data back to the pool, so that an idle
+ * session keeps none
+ */
+static void release_idle_bufs(struct server *server)
+{
+    struct remote *remote = server->remote;
+
+    if (server->buf_len == 0) {
+        buf_release(&buf_pool, &server->buf);
+    }
+    if (remote != NULL && remote->buf_len == 0) {
+        buf_release(&buf_pool, &remote->buf);
+    }
+}
+
 static void free_connections(struct ev_loop *loop)
 {
     struct cork_dllist_item *curr;
+    struct cork_dllist_item *next;
     for (curr = cork_dllist_start(&connections);
          !cork_dllist_is_end(&connections, curr);
-         curr = curr->next) {
+         curr = next) {
         struct server *server = cork_container_of(curr, struct server, entries);
         struct remote *remote = server->remote;
-        close_and_free_server(loop, server);
+        next = curr->next;
+        // the remote lives inside the server, release it first
         close_and_free_remote(loop, remote);
+        close_and_free_server(loop, server);
     }
 }
 
@@ -206,9 +247,9 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     char *buf;
 
     if (remote == NULL) {
-        buf = server->buf;
+        buf = buf_attach(&buf_pool, &server->buf);
     } else {
-        buf = remote->buf;
+        buf = buf_attach(&buf_pool, &remote->buf);
     }
 
     ssize_t r;
@@ -224,6 +265,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            release_idle_bufs(server);
             return;
         } else {
             ERROR("server_recv_cb_recv");
@@ -233,6 +275,8 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         }
     }
 
+    tx += r;
+
     while (1) {
         // local socks5 server
         if (server->stage == 5) {
@@ -248,6 +292,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                                          server->e_ctx);
 
                 if (remote->buf == NULL) {
+                    buf_pool_drop(&buf_pool);
                     LOGE("invalid password or cipher");
                     close_and_free_remote(EV_A_ remote);
                     close_and_free_server(EV_A_ server);
@@ -255,7 +300,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 }
             }
 
-            if (!remote->send_ctx->connected) {
+            if (!remote->send_ctx.connected) {
 
 #ifdef ANDROID
                 if (vpn) {
@@ -273,14 +318,16 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 
                 if (!fast_open || remote->direct) {
                     // connecting, wait until connected
+                    remote->connect_start = ev_now(EV_A);
                     connect(remote->fd, (struct sockaddr *)&(remote->addr), remote->addr_len);
 
                     // wait on remote connected event
                     ev_io_stop(EV_A_ & server_recv_ctx->io);
-                    ev_io_start(EV_A_ & remote->send_ctx->io);
-                    ev_timer_start(EV_A_ & remote->send_ctx->watcher);
+                    ev_io_start(EV_A_ & remote->send_ctx.io);
+                    ev_timer_start(EV_A_ & remote->send_ctx.watcher);
                 } else {
 #ifdef TCP_FASTOPEN
+                    remote->connect_start = ev_now(EV_A);
                     int s = sendto(remote->fd, remote->buf, r, MSG_FASTOPEN,
                                    (struct sockaddr *)&(remote->addr), remote->addr_len);
                     if (s == -1) {
@@ -289,7 +336,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                             remote->buf_idx = 0;
                             remote->buf_len = r;
                             ev_io_stop(EV_A_ & server_recv_ctx->io);
-                            ev_io_start(EV_A_ & remote->send_ctx->io);
+                            ev_io_start(EV_A_ & remote->send_ctx.io);
                             return;
                         } else {
                             ERROR("sendto");
@@ -303,15 +350,23 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                             close_and_free_server(EV_A_ server);
                             return;
                         }
-                    } else if (s < r) {
-                        remote->buf_len = r - s;
-                        remote->buf_idx = s;
                     }
 
                     // Just connected
-                    remote->send_ctx->connected = 1;
-                    ev_timer_stop(EV_A_ & remote->send_ctx->watcher);
-                    ev_io_start(EV_A_ & remote->recv_ctx->io);
+                    remote->send_ctx.connected = 1;
+                    ev_timer_stop(EV_A_ & remote->send_ctx.watcher);
+                    ev_io_start(EV_A_ & remote->recv_ctx.io);
+
+                    if (s < r) {
+                        // send the rest once the remote is writable
+                        remote->buf_len = r - s;
+                        remote->buf_idx = s;
+                        ev_io_stop(EV_A_ & server_recv_ctx->io);
+                        ev_io_start(EV_A_ & remote->send_ctx.io);
+                        return;
+                    }
+                    remote->buf_len = 0;
+                    remote->buf_idx = 0;
 #else
                     // if TCP_FASTOPEN is not defined, fast_open will always be 0
                     LOGE("can't come here");
@@ -326,7 +381,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                         remote->buf_idx = 0;
                         remote->buf_len = r;
                         ev_io_stop(EV_A_ & server_recv_ctx->io);
-                        ev_io_start(EV_A_ & remote->send_ctx->io);
+                        ev_io_start(EV_A_ & remote->send_ctx.io);
                         return;
                     } else {
                         ERROR("server_recv_cb_send");
@@ -338,12 +393,13 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                     remote->buf_len = r - s;
                     remote->buf_idx = s;
                     ev_io_stop(EV_A_ & server_recv_ctx->io);
-                    ev_io_start(EV_A_ & remote->send_ctx->io);
+                    ev_io_start(EV_A_ & remote->send_ctx.io);
                     return;
                 }
             }
 
             // all processed
+            release_idle_bufs(server);
             return;
         } else if (server->stage == 0) {
             struct method_select_response response;
@@ -352,6 +408,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             char *send_buf = (char *)&response;
             send(server->fd, send_buf, sizeof(response), 0);
             server->stage = 1;
+            release_idle_bufs(server);
             return;
         } else if (server->stage == 1) {
             struct socks5_request *request = (struct socks5_request *)buf;
@@ -360,6 +417,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             memset(&sock_addr, 0, sizeof(sock_addr));
 
             int udp_assc = 0;
+            ssize_t tunnel_header_len = 0;
 
             if (mode != TCP_ONLY && request->cmd == 3) {
                 udp_assc = 1;
@@ -371,6 +429,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 }
             } else if (request->cmd != 1) {
                 LOGE("unsupported cmd: %d", request->cmd);
+                metrics.handshake_failures++;
                 struct socks5_response response;
                 response.ver = SVERSION;
                 response.rep = CMD_NOT_SUPPORTED;
@@ -383,20 +442,32 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 return;
             } else {
                 char host[256], port[16];
-                char ss_addr_to_send[320];
+                struct sockaddr_storage storage;
+                int bypass = 0;
+                int resolve = 0;
+                uint16_t resolve_port = 0;
 
-                ssize_t addr_len = 0;
-                ss_addr_to_send[addr_len++] = request->atyp;
+                // From ATYP on, the request is laid out exactly like the
+                // shadowsocks address header, so it is forwarded in place.
+                ssize_t addr_len = 1;
 
                 // get remote addr and port
                 if (request->atyp == 1) {
                     // IP V4
                     size_t in_addr_len = sizeof(struct in_addr);
-                    memcpy(ss_addr_to_send + addr_len, buf + 4, in_addr_len +
-                           2);
                     addr_len += in_addr_len + 2;
 
-                    if (acl || verbose) {
+                    if (acl && acl_contains_ipv4((struct in_addr *)(buf + 4))) {
+                        struct sockaddr_in *addr =
+                            (struct sockaddr_in *)&storage;
+                        memset(&storage, 0, sizeof(struct sockaddr_storage));
+                        addr->sin_family = AF_INET;
+                        memcpy(&addr->sin_addr, buf + 4, in_addr_len);
+                        memcpy(&addr->sin_port, buf + 4 + in_addr_len, 2);
+                        bypass = 1;
+                    }
+
+                    if (verbose) {
                         uint16_t p =
                             ntohs(*(uint16_t *)(buf + 4 + in_addr_len));
                         dns_ntop(AF_INET, (const void *)(buf + 4),
@@ -406,12 +477,14 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 } else if (request->atyp == 3) {
                     // Domain name
                     uint8_t name_len = *(uint8_t *)(buf + 4);
-                    ss_addr_to_send[addr_len++] = name_len;
-                    memcpy(ss_addr_to_send + addr_len, buf + 4 + 1, name_len +
-                           2);
-                    addr_len += name_len + 2;
+                    addr_len += 1 + name_len + 2;
+
+                    if (acl && acl_contains_domain(buf + 4 + 1, name_len)) {
+                        resolve_port = *(uint16_t *)(buf + 4 + 1 + name_len);
+                        resolve = 1;
+                    }
 
-                    if (acl || verbose) {
+                    if (resolve || verbose) {
                         uint16_t p =
                             ntohs(*(uint16_t *)(buf + 4 + 1 + name_len));
                         memcpy(host, buf + 4 + 1, name_len);
@@ -421,11 +494,19 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 } else if (request->atyp == 4) {
                     // IP V6
                     size_t in6_addr_len = sizeof(struct in6_addr);
-                    memcpy(ss_addr_to_send + addr_len, buf + 4, in6_addr_len +
-                           2);
                     addr_len += in6_addr_len + 2;
 
-                    if (acl || verbose) {
+                    if (acl && acl_contains_ipv6((struct in6_addr *)(buf + 4))) {
+                        struct sockaddr_in6 *addr =
+                            (struct sockaddr_in6 *)&storage;
+                        memset(&storage, 0, sizeof(struct sockaddr_storage));
+                        addr->sin6_family = AF_INET6;
+                        memcpy(&addr->sin6_addr, buf + 4, in6_addr_len);
+                        memcpy(&addr->sin6_port, buf + 4 + in6_addr_len, 2);
+                        bypass = 1;
+                    }
+
+                    if (verbose) {
                         uint16_t p =
                             ntohs(*(uint16_t *)(buf + 4 + in6_addr_len));
                         dns_ntop(AF_INET6, (const void *)(buf + 4),
@@ -434,6 +515,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                     }
                 } else {
                     LOGE("unsupported addrtype: %d", request->atyp);
+                    metrics.handshake_failures++;
                     close_and_free_remote(EV_A_ remote);
                     close_and_free_server(EV_A_ server);
                     return;
@@ -448,40 +530,60 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                     LOGI("connect to %s:%s", host, port);
                 }
 
-                if ((acl && (request->atyp == 1 || request->atyp == 4) && acl_contains_ip(host))) {
+                if (resolve) {
+                    if (verbose) {
+                        LOGI("bypass %s:%s", host, port);
+                    }
+                    // hold the payload until the name is resolved
+                    server->buf_len = r > 0 ? r : 0;
+                    memmove(server->buf, buf, server->buf_len);
+                    server->resolve_start = ev_now(EV_A);
+                    metrics.dns_queries++;
+                    server->query = resolv_query(host, server_resolve_cb, NULL,
+                                                 server, resolve_port);
+                    if (server->query == NULL) {
+                        close_and_free_server(EV_A_ server);
+                        return;
+                    }
+                    server->stage = 4;
+                    ev_io_stop(EV_A_ & server_recv_ctx->io);
+                } else if (bypass) {
                     if (verbose) {
                         LOGI("bypass %s:%s", host, port);
                     }
-                    struct sockaddr_storage storage;
-                    memset(&storage, 0, sizeof(struct sockaddr_storage));
-                    if (get_sockaddr(host, port, &storage, 0) != -1) {
-                        remote = create_remote(server->listener, (struct sockaddr *)&storage);
+                    remote = create_remote(server, (struct sockaddr *)&storage);
+                    if (remote != NULL) {
                         remote->direct = 1;
                     }
+                } else if (mux) {
+                    tunnel_header_len = addr_len;
                 } else {
-                    remote = create_remote(server->listener, NULL);
+                    remote = create_remote(server, NULL);
                 }
 
-                if (remote == NULL) {
+                if (remote == NULL && !resolve && !tunnel_header_len) {
                     LOGE("invalid remote addr");
                     close_and_free_server(EV_A_ server);
                     return;
                 }
 
-                if (!remote->direct) {
-                    memcpy(remote->buf, ss_addr_to_send, addr_len);
-                    if (r > 0) {
-                        memcpy(remote->buf + addr_len, buf, r);
-                    }
+                if (resolve || tunnel_header_len) {
+                    // connected from server_resolve_cb, or by the tunnel
+                } else if (!remote->direct) {
+                    // header and payload go out together in one copy
+                    memcpy(buf_attach(&buf_pool, &remote->buf), buf - addr_len,
+                           addr_len + (r > 0 ? r : 0));
                     r += addr_len;
                 } else {
                     if (r > 0) {
-                        memcpy(remote->buf, buf, r);
+                        memcpy(buf_attach(&buf_pool, &remote->buf), buf, r);
                     }
                 }
 
-                server->remote = remote;
-                remote->server = server;
+                if (remote != NULL) {
+                    server->remote = remote;
+                    remote->server = server;
+                }
             }
 
             // Fake reply
@@ -491,17 +593,18 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             response.rsv = 0;
             response.atyp = 1;
 
-            memcpy(server->buf, &response, sizeof(struct socks5_response));
-            memcpy(server->buf + sizeof(struct socks5_response),
+            char reply[sizeof(struct socks5_response) +
+                       sizeof(sock_addr.sin_addr) + sizeof(sock_addr.sin_port)];
+
+            memcpy(reply, &response, sizeof(struct socks5_response));
+            memcpy(reply + sizeof(struct socks5_response),
                    &sock_addr.sin_addr, sizeof(sock_addr.sin_addr));
-            memcpy(server->buf + sizeof(struct socks5_response) +
+            memcpy(reply + sizeof(struct socks5_response) +
                    sizeof(sock_addr.sin_addr),
                    &sock_addr.sin_port, sizeof(sock_addr.sin_port));
 
-            int reply_size = sizeof(struct socks5_response) +
-                             sizeof(sock_addr.sin_addr) +
-                             sizeof(sock_addr.sin_port);
-            int s = send(server->fd, server->buf, reply_size, 0);
+            int reply_size = sizeof(reply);
+            int s = send(server->fd, reply, reply_size, 0);
             if (s < reply_size) {
                 LOGE("failed to send fake reply");
                 close_and_free_remote(EV_A_ remote);
@@ -514,6 +617,25 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 close_and_free_server(EV_A_ server);
                 return;
             }
+
+            if (tunnel_header_len) {
+                // relayed as a stream of a shared tunnel from now on
+                if (mux_open(EV_A_ server->fd, buf - tunnel_header_len,
+                             tunnel_header_len, buf, r > 0 ? r : 0) == -1) {
+                    close_and_free_server(EV_A_ server);
+                    return;
+                }
+                ev_io_stop(EV_A_ & server->send_ctx.io);
+                ev_io_stop(EV_A_ & server->recv_ctx.io);
+                free_server(server);
+                return;
+            }
+
+            if (server->stage == 4) {
+                // wait for the resolver
+                release_idle_bufs(server);
+                return;
+            }
         }
     }
 }
@@ -548,8 +670,9 @@ static void server_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             server->buf_len = 0;
             server->buf_idx = 0;
+            buf_release(&buf_pool, &server->buf);
             ev_io_stop(EV_A_ & server_send_ctx->io);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            ev_io_start(EV_A_ & remote->recv_ctx.io);
         }
     }
 
@@ -576,9 +699,10 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
     struct remote *remote = remote_recv_ctx->remote;
     struct server *server = remote->server;
 
-    ev_timer_again(EV_A_ & remote->recv_ctx->watcher);
+    ev_timer_again(EV_A_ & remote->recv_ctx.watcher);
 
-    ssize_t r = recv(remote->fd, server->buf, BUF_SIZE, 0);
+    ssize_t r = recv(remote->fd, buf_attach(&buf_pool, &server->buf),
+                     BUF_SIZE, 0);
 
     if (r == 0) {
         // connection closed
@@ -589,6 +713,7 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            buf_release(&buf_pool, &server->buf);
             return;
         } else {
             ERROR("remote_recv_cb_recv");
@@ -598,9 +723,12 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
         }
     }
 
+    rx += r;
+
     if (!remote->direct) {
         server->buf = ss_decrypt(BUF_SIZE, server->buf, &r, server->d_ctx);
         if (server->buf == NULL) {
+            buf_pool_drop(&buf_pool);
             LOGE("invalid password or cipher");
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
@@ -616,7 +744,7 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
             server->buf_len = r;
             server->buf_idx = 0;
             ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
+            ev_io_start(EV_A_ & server->send_ctx.io);
             return;
         } else {
             ERROR("remote_recv_cb_send");
@@ -628,9 +756,11 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
         server->buf_len = r - s;
         server->buf_idx = s;
         ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
+        ev_io_start(EV_A_ & server->send_ctx.io);
         return;
     }
+
+    buf_release(&buf_pool, &server->buf);
 }
 
 static void remote_send_cb(EV_P_ ev_io *w, int revents)
@@ -645,14 +775,16 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
         int r = getpeername(remote->fd, (struct sockaddr *)&addr, &len);
         if (r == 0) {
             remote_send_ctx->connected = 1;
+            metrics_observe(&metrics.connect_latency,
+                            ev_now(EV_A) - remote->connect_start);
             ev_timer_stop(EV_A_ & remote_send_ctx->watcher);
-            ev_timer_start(EV_A_ & remote->recv_ctx->watcher);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            ev_timer_start(EV_A_ & remote->recv_ctx.watcher);
+            ev_io_start(EV_A_ & remote->recv_ctx.io);
 
             // no need to send any data
             if (remote->buf_len == 0) {
                 ev_io_stop(EV_A_ & remote_send_ctx->io);
-                ev_io_start(EV_A_ & server->recv_ctx->io);
+                ev_io_start(EV_A_ & server->recv_ctx.io);
                 return;
             }
         } else {
@@ -690,37 +822,83 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             remote->buf_len = 0;
             remote->buf_idx = 0;
+            buf_release(&buf_pool, &remote->buf);
             ev_io_stop(EV_A_ & remote_send_ctx->io);
-            ev_io_start(EV_A_ & server->recv_ctx->io);
+            ev_io_start(EV_A_ & server->recv_ctx.io);
         }
     }
 }
 
-static struct remote * new_remote(int fd, int timeout)
+static void server_resolve_cb(struct sockaddr *addr, void *data)
 {
-    struct remote *remote;
-    remote = malloc(sizeof(struct remote));
+    struct server *server = (struct server *)data;
+    struct ev_loop *loop = EV_DEFAULT;
+
+    server->query = NULL;
+    metrics_observe(&metrics.dns_latency, ev_now(EV_A) - server->resolve_start);
+
+    if (addr == NULL) {
+        LOGE("unable to resolve");
+        metrics.dns_failures++;
+        close_and_free_server(EV_A_ server);
+        return;
+    }
+
+    struct remote *remote = create_remote(server, addr);
+    if (remote == NULL) {
+        LOGE("invalid remote addr");
+        close_and_free_server(EV_A_ server);
+        return;
+    }
+
+#ifdef ANDROID
+    if (vpn) {
+        if (protect_socket(remote->fd) == -1) {
+            ERROR("protect_socket");
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+            return;
+        }
+    }
+#endif
+
+    // the held payload goes out from the same buffer
+    remote->direct = 1;
+    remote->buf = server->buf;
+    remote->buf_idx = 0;
+    remote->buf_len = server->buf_len;
+    server->buf = NULL;
+    server->buf_len = 0;
+    server->remote = remote;
+    remote->server = server;
+    server->stage = 5;
+
+    // connecting, wait until connected
+    remote->connect_start = ev_now(EV_A);
+    connect(remote->fd, (struct sockaddr *)&(remote->addr), remote->addr_len);
+    ev_io_start(EV_A_ & remote->send_ctx.io);
+    ev_timer_start(EV_A_ & remote->send_ctx.watcher);
+}
+
+static struct remote * new_remote(struct server *server, int fd, int timeout)
+{
+    struct remote *remote = &server->remote_data;
 
     memset(remote, 0, sizeof(struct remote));
 
-    remote->buf = malloc(BUF_SIZE);
-    remote->recv_ctx = malloc(sizeof(struct remote_ctx));
-    remote->send_ctx = malloc(sizeof(struct remote_ctx));
-    remote->recv_ctx->connected = 0;
-    remote->send_ctx->connected = 0;
     remote->fd = fd;
-    ev_io_init(&remote->recv_ctx->io, remote_recv_cb, fd, EV_READ);
-    ev_io_init(&remote->send_ctx->io, remote_send_cb, fd, EV_WRITE);
-    ev_timer_init(&remote->send_ctx->watcher, remote_timeout_cb,
+    ev_io_init(&remote->recv_ctx.io, remote_recv_cb, fd, EV_READ);
+    ev_io_init(&remote->send_ctx.io, remote_send_cb, fd, EV_WRITE);
+    ev_timer_init(&remote->send_ctx.watcher, remote_timeout_cb,
                   min(MAX_CONNECT_TIMEOUT,
                       timeout),
                   0);
-    ev_timer_init(&remote->recv_ctx->watcher, remote_timeout_cb,
+    ev_timer_init(&remote->recv_ctx.watcher, remote_timeout_cb,
                   min(MAX_CONNECT_TIMEOUT,
                       timeout),
                   timeout);
-    remote->recv_ctx->remote = remote;
-    remote->send_ctx->remote = remote;
+    remote->recv_ctx.remote = remote;
+    remote->send_ctx.remote = remote;
     return remote;
 }
 
@@ -729,21 +907,16 @@ static void free_remote(struct remote *remote)
     if (remote->server != NULL) {
         remote->server->remote = NULL;
     }
-    if (remote->buf != NULL) {
-        free(remote->buf);
-    }
-    free(remote->recv_ctx);
-    free(remote->send_ctx);
-    free(remote);
+    buf_release(&buf_pool, &remote->buf);
 }
 
 static void close_and_free_remote(EV_P_ struct remote *remote)
 {
     if (remote != NULL) {
-        ev_timer_stop(EV_A_ & remote->send_ctx->watcher);
-        ev_timer_stop(EV_A_ & remote->recv_ctx->watcher);
-        ev_io_stop(EV_A_ & remote->send_ctx->io);
-        ev_io_stop(EV_A_ & remote->recv_ctx->io);
+        ev_timer_stop(EV_A_ & remote->send_ctx.watcher);
+        ev_timer_stop(EV_A_ & remote->recv_ctx.watcher);
+        ev_io_stop(EV_A_ & remote->send_ctx.io);
+        ev_io_stop(EV_A_ & remote->recv_ctx.io);
         close(remote->fd);
         free_remote(remote);
     }
@@ -756,19 +929,14 @@ static struct server * new_server(int fd, int method)
 
     memset(server, 0, sizeof(struct server));
 
-    server->buf = malloc(BUF_SIZE);
-    server->recv_ctx = malloc(sizeof(struct server_ctx));
-    server->send_ctx = malloc(sizeof(struct server_ctx));
-    server->recv_ctx->connected = 0;
-    server->send_ctx->connected = 0;
     server->fd = fd;
-    ev_io_init(&server->recv_ctx->io, server_recv_cb, fd, EV_READ);
-    ev_io_init(&server->send_ctx->io, server_send_cb, fd, EV_WRITE);
-    server->recv_ctx->server = server;
-    server->send_ctx->server = server;
+    ev_io_init(&server->recv_ctx.io, server_recv_cb, fd, EV_READ);
+    ev_io_init(&server->send_ctx.io, server_send_cb, fd, EV_WRITE);
+    server->recv_ctx.server = server;
+    server->send_ctx.server = server;
     if (method) {
-        server->e_ctx = malloc(sizeof(struct enc_ctx));
-        server->d_ctx = malloc(sizeof(struct enc_ctx));
+        server->e_ctx = &server->e_ctx_data;
+        server->d_ctx = &server->d_ctx_data;
         enc_ctx_init(method, server->e_ctx, 1);
         enc_ctx_init(method, server->d_ctx, 0);
     } else {
@@ -777,6 +945,7 @@ static struct server * new_server(int fd, int method)
     }
 
     cork_dllist_add(&connections, &server->entries);
+    metrics.sessions++;
 
     return server;
 }
@@ -784,44 +953,48 @@ static struct server * new_server(int fd, int method)
 static void free_server(struct server *server)
 {
     cork_dllist_remove(&server->entries);
+    metrics.sessions--;
 
     if (server->remote != NULL) {
         server->remote->server = NULL;
     }
     if (server->e_ctx != NULL) {
         cipher_context_release(&server->e_ctx->evp);
-        free(server->e_ctx);
     }
     if (server->d_ctx != NULL) {
         cipher_context_release(&server->d_ctx->evp);
-        free(server->d_ctx);
-    }
-    if (server->buf != NULL) {
-        free(server->buf);
     }
-    free(server->recv_ctx);
-    free(server->send_ctx);
+    buf_release(&buf_pool, &server->buf);
     free(server);
 }
 
 static void close_and_free_server(EV_P_ struct server *server)
 {
     if (server != NULL) {
-        ev_io_stop(EV_A_ & server->send_ctx->io);
-        ev_io_stop(EV_A_ & server->recv_ctx->io);
+        if (server->query != NULL) {
+            resolv_cancel(server->query);
+            server->query = NULL;
+        }
+        ev_io_stop(EV_A_ & server->send_ctx.io);
+        ev_io_stop(EV_A_ & server->recv_ctx.io);
         close(server->fd);
         free_server(server);
     }
 }
 
-static struct remote * create_remote(struct listen_ctx *listener,
-                                         struct sockaddr *addr)
+static struct remote * create_remote(struct server *server,
+                                     struct sockaddr *addr)
 {
+    struct listen_ctx *listener = server->listener;
     struct sockaddr *remote_addr;
 
-    int index = rand() % listener->remote_num;
     if (addr == NULL) {
-        remote_addr = listener->remote_addr[index];
+        remote_addr = pick_remote_addr(listener->remote_addr,
+                                       listener->remote_num);
+        if (remote_addr == NULL) {
+            LOGE("server name not resolved yet");
+            return NULL;
+        }
     } else {
         remote_addr = addr;
     }
@@ -838,6 +1011,7 @@ static struct remote * create_remote(struct listen_ctx *listener,
 #ifdef SO_NOSIGPIPE
     setsockopt(remotefd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+    set_sockopt_profile(remotefd, &remote_sockopt);
 
     // Setup
     setnonblocking(remotefd);
@@ -847,7 +1021,7 @@ static struct remote * create_remote(struct listen_ctx *listener,
     }
 #endif
 
-    struct remote *remote = new_remote(remotefd, listener->timeout);
+    struct remote *remote = new_remote(server, remotefd, listener->timeout);
     remote->addr_len = get_sockaddr_len(remote_addr);
     memcpy(&(remote->addr), remote_addr, remote->addr_len);
 
@@ -858,6 +1032,11 @@ static void signal_cb(EV_P_ ev_signal *w, int revents)
 {
     if (revents & EV_SIGNAL) {
         switch (w->signum) {
+#ifndef __MINGW32__
+        case SIGHUP:
+            reload_acl();
+            break;
+#endif
         case SIGINT:
         case SIGTERM:
             ev_unloop(EV_A_ EVUNLOOP_ALL);
@@ -868,25 +1047,75 @@ static void signal_cb(EV_P_ ev_signal *w, int revents)
 void accept_cb(EV_P_ ev_io *w, int revents)
 {
     struct listen_ctx *listener = (struct listen_ctx *)w;
-    int serverfd = accept(listener->fd, NULL, NULL);
-    if (serverfd == -1) {
-        ERROR("accept");
-        return;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int serverfd = accept_nonblock(listener->fd, NULL);
+        if (serverfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK
+                && errno != EINTR && errno != ECONNABORTED) {
+                ERROR("accept");
+            }
+            return;
+        }
+        metrics.accepted++;
+
+        struct server *server = new_server(serverfd, listener->method);
+        server->listener = listener;
+
+        ev_io_start(EV_A_ & server->recv_ctx.io);
+
+        if (listener->early_data) {
+            // the socks5 greeting is most likely queued already
+            server_recv_cb(EV_A_ & server->recv_ctx.io, EV_READ);
+        }
+    }
+}
+
+#ifndef LIB_ONLY
+/*
+ * Start connecting a tunnel for the multiplexer
+ */
+static int connect_tunnel(void *data)
+{
+    struct listen_ctx *listener = (struct listen_ctx *)data;
+    struct sockaddr *remote_addr = pick_remote_addr(listener->remote_addr,
+                                                    listener->remote_num);
+    if (remote_addr == NULL) {
+        LOGE("server name not resolved yet");
+        return -1;
     }
-    setnonblocking(serverfd);
+
+    int fd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        ERROR("socket");
+        return -1;
+    }
+
     int opt = 1;
-    setsockopt(serverfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
 #ifdef SO_NOSIGPIPE
-    setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+    set_sockopt_profile(fd, &remote_sockopt);
+    setnonblocking(fd);
+#ifdef SET_INTERFACE
+    if (listener->iface) {
+        setinterface(fd, listener->iface);
+    }
+#endif
+#ifdef ANDROID
+    if (vpn && protect_socket(fd) == -1) {
+        ERROR("protect_socket");
+        close(fd);
+        return -1;
+    }
 #endif
 
-    struct server *server = new_server(serverfd, listener->method);
-    server->listener = listener;
+    connect(fd, remote_addr, get_sockaddr_len(remote_addr));
 
-    ev_io_start(EV_A_ & server->recv_ctx->io);
+    return fd;
 }
 
-#ifndef LIB_ONLY
 int main(int argc, char **argv)
 {
 
@@ -901,6 +1130,7 @@ int main(int argc, char **argv)
     char *pid_path = NULL;
     char *conf_path = NULL;
     char *iface = NULL;
+    char *metrics_addr = NULL;
 
     srand(time(NULL));
 
@@ -911,9 +1141,16 @@ int main(int argc, char **argv)
     int option_index = 0;
     static struct option long_options[] =
     {
-        { "fast-open", no_argument,       0, 0 },
-        { "acl",       required_argument, 0, 0 },
-        { 0,           0,                 0, 0 }
+        { "fast-open",    no_argument,       0, 0 },
+        { "acl",          required_argument, 0, 0 },
+        { "metrics",      required_argument, 0, 0 },
+        { "mux",          required_argument, 0, 0 },
+        { "udp-over-tcp",    no_argument,       0, 0 },
+        { "fast-open-queue", required_argument, 0, 0 },
+        { "defer-accept",    required_argument, 0, 0 },
+        { "client-sockopt",  required_argument, 0, 0 },
+        { "remote-sockopt",  required_argument, 0, 0 },
+        { 0,                 0,                 0, 0 }
     };
 
     opterr = 0;
@@ -934,6 +1171,24 @@ int main(int argc, char **argv)
             } else if (option_index == 1) {
                 LOGI("initialize acl...");
                 acl = !init_acl(optarg);
+            } else if (option_index == 2) {
+                metrics_addr = optarg;
+            } else if (option_index == 3) {
+                mux = atoi(optarg);
+            } else if (option_index == 4) {
+                udp_over_tcp = 1;
+            } else if (option_index == 5) {
+                fast_open_queue = atoi(optarg);
+            } else if (option_index == 6) {
+                defer_accept = atoi(optarg);
+            } else if (option_index == 7) {
+                if (parse_sockopt_profile(optarg, &client_sockopt) == -1) {
+                    FATAL("invalid client socket options");
+                }
+            } else if (option_index == 8) {
+                if (parse_sockopt_profile(optarg, &remote_sockopt) == -1) {
+                    FATAL("invalid remote socket options");
+                }
             }
             break;
         case 's':
@@ -1084,44 +1339,50 @@ int main(int argc, char **argv)
     ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
     ev_signal_start(EV_DEFAULT, &sigint_watcher);
     ev_signal_start(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    // reload the acl on SIGHUP
+    struct ev_signal sighup_watcher;
+    ev_signal_init(&sighup_watcher, signal_cb, SIGHUP);
+    if (acl) {
+        ev_signal_start(EV_DEFAULT, &sighup_watcher);
+    }
+#endif
 
     // Setup keys
     LOGI("initialize ciphers... %s", method);
     int m = enc_init(password, method);
 
     // Setup proxy context
+    struct ev_loop *loop = EV_DEFAULT;
+
+    // Setup the resolver for server names and bypassed domains
+    resolv_init(loop, NULL, 0);
+
     struct listen_ctx listen_ctx;
     listen_ctx.remote_num = remote_num;
-    listen_ctx.remote_addr = malloc(sizeof(struct sockaddr *) * remote_num);
-    for (i = 0; i < remote_num; i++) {
-        char *host = remote_addr[i].host;
-        char *port = remote_addr[i].port == NULL ? remote_port :
-            remote_addr[i].port;
-        struct sockaddr_storage *storage = malloc(sizeof(struct sockaddr_storage));
-        memset(storage, 0, sizeof(struct sockaddr_storage));
-        if (get_sockaddr(host, port, storage, 1) == -1) {
-            FATAL("failed to resolve the provided hostname");
-        }
-        listen_ctx.remote_addr[i] = (struct sockaddr *)storage;
-    }
+    listen_ctx.remote_addr = resolve_remote_addrs(loop, remote_addr,
+                                                  remote_port, remote_num);
     listen_ctx.timeout = atoi(timeout);
     listen_ctx.iface = iface;
     listen_ctx.method = m;
 
-    struct ev_loop *loop = EV_DEFAULT;
-
     // Setup socket
     int listenfd;
     listenfd = create_and_bind(local_addr, local_port);
     if (listenfd < 0) {
         FATAL("bind() error");
     }
+    // inherited by accepted sockets, buffers must be set before listen()
+    set_sockopt_profile(listenfd, &client_sockopt);
     if (listen(listenfd, SOMAXCONN) == -1) {
         FATAL("listen() error");
     }
     setnonblocking(listenfd);
+    set_listen_sockopt(listenfd);
 
     listen_ctx.fd = listenfd;
+    listen_ctx.early_data = set_listen_early_data(listenfd, fast_open_queue,
+                                                  defer_accept);
 
     ev_io_init(&listen_ctx.io, accept_cb, listenfd, EV_READ);
     ev_io_start(loop, &listen_ctx.io);
@@ -1130,11 +1391,32 @@ int main(int argc, char **argv)
     if (mode != TCP_ONLY) {
         LOGI("udprelay enabled");
         init_udprelay(local_addr, local_port, listen_ctx.remote_addr[0],
-                      get_sockaddr_len(listen_ctx.remote_addr[0]), m, listen_ctx.timeout, iface);
+                      udp_over_tcp, m, listen_ctx.timeout, iface);
+        if (udp_over_tcp) {
+            LOGI("UDP relayed over TCP");
+        }
     }
 
     LOGI("listening at %s:%s", local_addr, local_port);
 
+    metrics.cipher = enc_get_method_name(m);
+    metrics.pool   = &buf_pool;
+    if (metrics_addr != NULL) {
+        metrics_listen(loop, metrics_addr);
+    }
+
+    if (mux > 0) {
+        struct mux_config config;
+        memset(&config, 0, sizeof(struct mux_config));
+        config.method  = m;
+        config.timeout = listen_ctx.timeout;
+        config.tunnels = mux;
+        config.connect = connect_tunnel;
+        config.data    = &listen_ctx;
+        mux_init(&config);
+        LOGI("multiplexing over %d tunnels", mux);
+    }
+
     // setuid
     if (user != NULL) {
         run_as(user);
@@ -1152,16 +1434,19 @@ int main(int argc, char **argv)
 
     // Clean up
     ev_io_stop(loop, &listen_ctx.io);
+    metrics_close(loop);
+    if (mux > 0) {
+        mux_close_all(loop);
+    }
     free_connections(loop);
+    buf_pool_done(&buf_pool);
 
     if (mode != TCP_ONLY) {
         free_udprelay();
     }
 
-    for (i = 0; i < remote_num; i++) {
-        free(listen_ctx.remote_addr[i]);
-    }
-    free(listen_ctx.remote_addr);
+    free_remote_addrs(loop, listen_ctx.remote_addr, remote_num);
+    resolv_shutdown(loop);
 
 #ifdef __MINGW32__
     winsock_cleanup();
@@ -1169,6 +1454,9 @@ int main(int argc, char **argv)
 
     ev_signal_stop(EV_DEFAULT, &sigint_watcher);
     ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    ev_signal_stop(EV_DEFAULT, &sighup_watcher);
+#endif
 
     return 0;
 }
@@ -1221,24 +1509,29 @@ int start_ss_local_server(profile_t profile)
     ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
     ev_signal_start(EV_DEFAULT, &sigint_watcher);
     ev_signal_start(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    // reload the acl on SIGHUP
+    struct ev_signal sighup_watcher;
+    ev_signal_init(&sighup_watcher, signal_cb, SIGHUP);
+    if (acl) {
+        ev_signal_start(EV_DEFAULT, &sighup_watcher);
+    }
+#endif
 
     // Setup keys
     LOGI("initialize ciphers... %s", method);
     int m = enc_init(password, method);
 
-    struct sockaddr_storage *storage = malloc(sizeof(struct sockaddr_storage));
-    memset(storage, 0, sizeof(struct sockaddr_storage));
-    if (get_sockaddr(remote_host, remote_port_str, storage, 1) == -1) {
-        return -1;
-    }
-
     // Setup proxy context
     struct ev_loop *loop = EV_DEFAULT;
     struct listen_ctx listen_ctx;
 
+    // Setup the resolver for server names and bypassed domains
+    resolv_init(loop, NULL, 0);
+
+    ss_addr_t remote_addr = { .host = remote_host, .port = remote_port_str };
     listen_ctx.remote_num = 1;
-    listen_ctx.remote_addr = malloc(sizeof(struct sockaddr *));
-    listen_ctx.remote_addr[0] = (struct sockaddr *)storage;
+    listen_ctx.remote_addr = resolve_remote_addrs(loop, &remote_addr, NULL, 1);
     listen_ctx.timeout = timeout;
     listen_ctx.method = m;
     listen_ctx.iface = NULL;
@@ -1255,8 +1548,10 @@ int start_ss_local_server(profile_t profile)
         return -1;
     }
     setnonblocking(listenfd);
+    set_listen_sockopt(listenfd);
 
     listen_ctx.fd = listenfd;
+    listen_ctx.early_data = 0;
 
     ev_io_init(&listen_ctx.io, accept_cb, listenfd, EV_READ);
     ev_io_start(loop, &listen_ctx.io);
@@ -1264,9 +1559,8 @@ int start_ss_local_server(profile_t profile)
     // Setup UDP
     if (mode != TCP_ONLY) {
         LOGI("udprelay enabled");
-        struct sockaddr *addr = (struct sockaddr *)storage;
-        init_udprelay(local_addr, local_port_str, addr,
-                      get_sockaddr_len(addr), m, timeout, NULL);
+        init_udprelay(local_addr, local_port_str, listen_ctx.remote_addr[0],
+                      udp_over_tcp, m, timeout, NULL);
     }
 
     LOGI("listening at %s:%s", local_addr, local_port_str);
@@ -1288,9 +1582,11 @@ int start_ss_local_server(profile_t profile)
 
     ev_io_stop(loop, &listen_ctx.io);
     free_connections(loop);
-    close(listen_ctx.fd);
+    buf_pool_done(&buf_pool);
 
-    free(listen_ctx.remote_addr);
+    free_remote_addrs(loop, listen_ctx.remote_addr, 1);
+    resolv_shutdown(loop);
+    close(listen_ctx.fd);
 
 #ifdef __MINGW32__
     winsock_cleanup();
@@ -1298,6 +1594,9 @@ int start_ss_local_server(profile_t profile)
 
     ev_signal_stop(EV_DEFAULT, &sigint_watcher);
     ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    ev_signal_stop(EV_DEFAULT, &sighup_watcher);
+#endif
 
     // cannot reach here
     return 0;
@@ -28,6 +28,7 @@
 
 #include "encrypt.h"
 #include "jconf.h"
+#include "resolv.h"
 
 #include "common.h"
 
@@ -38,6 +39,7 @@ struct listen_ctx {
     int method;
     int timeout;
     int fd;
+    int early_data;   /**<Accepted sockets are readable at once */
     struct sockaddr **remote_addr;
 };
 
@@ -47,22 +49,6 @@ struct server_ctx {
     struct server *server;
 };
 
-struct server {
-    int fd;
-    ssize_t buf_len;
-    ssize_t buf_idx;
-    char *buf; // server send from, remote recv into
-    char stage;
-    struct enc_ctx *e_ctx;
-    struct enc_ctx *d_ctx;
-    struct server_ctx *recv_ctx;
-    struct server_ctx *send_ctx;
-    struct listen_ctx *listener;
-    struct remote *remote;
-
-    struct cork_dllist_item entries;
-};
-
 struct remote_ctx {
     ev_io io;
     ev_timer watcher;
@@ -72,15 +58,44 @@ struct remote_ctx {
 
 struct remote {
     int fd;
+    int direct;
     ssize_t buf_len;
     ssize_t buf_idx;
-    int direct;
     char *buf; // remote send from, server recv into
-    struct remote_ctx *recv_ctx;
-    struct remote_ctx *send_ctx;
     struct server *server;
+    struct remote_ctx recv_ctx;
+    struct remote_ctx send_ctx;
     struct sockaddr_storage addr;
     int addr_len;
+    ev_tstamp connect_start;
+};
+
+/*
+ * A session is a single allocation: the watchers, the cipher states and
+ * the remote half are embedded, with the fields touched by every callback
+ * laid out first. Only the relay buffers are allocated separately, since
+ * ss_encrypt()/ss_decrypt() may grow or replace them.
+ */
+struct server {
+    int fd;
+    char stage;
+    ssize_t buf_len;
+    ssize_t buf_idx;
+    char *buf; // server send from, remote recv into
+    struct enc_ctx *e_ctx;
+    struct enc_ctx *d_ctx;
+    struct remote *remote;
+    struct server_ctx recv_ctx;
+    struct server_ctx send_ctx;
+    struct listen_ctx *listener;
+    struct ResolvQuery *query; // pending lookup of a bypassed domain
+    ev_tstamp resolve_start;
+
+    struct cork_dllist_item entries;
+
+    struct remote remote_data;
+    struct enc_ctx e_ctx_data;
+    struct enc_ctx d_ctx_data;
 };
 
 #endif // _LOCAL_H
@@ -0,0 +1,480 @@
+/*
+ * metrics.c - Serve counters of ss-server and ss-local in Prometheus format
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef __MINGW32__
+#include "win32.h"
+#endif
+
+#include "jconf.h"
+#include "netutils.h"
+#include "utils.h"
+#include "metrics.h"
+
+#define METRICS_REQUEST_SIZE 2048
+#define METRICS_TIMEOUT 5 // seconds
+
+struct metrics_client {
+    ev_io io;
+    ev_timer watcher;
+    int fd;
+    char req[METRICS_REQUEST_SIZE];
+    size_t req_len;
+    char *buf;
+    size_t len;
+    size_t idx;
+};
+
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct metrics metrics;
+
+// counted by the relays themselves
+extern uint64_t tx;
+extern uint64_t rx;
+extern int udp_associations;
+extern uint64_t udp_associations_total;
+
+static const double bucket_bounds[METRICS_BUCKETS] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+static int listen_fd = -1;
+static char *listen_path = NULL;
+static ev_io listen_io;
+
+void metrics_observe(struct metrics_histogram *hist, double seconds)
+{
+    int i = 0;
+
+    if (seconds < 0) {
+        return;
+    }
+
+    while (i < METRICS_BUCKETS && seconds > bucket_bounds[i]) {
+        i++;
+    }
+
+    hist->counts[i]++;
+    hist->count++;
+    hist->sum += seconds;
+}
+
+static void append(struct metrics_buf *out, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    for (;;) {
+        va_start(args, fmt);
+        n = vsnprintf(out->data + out->len, out->size - out->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if (out->len + n < out->size) {
+            out->len += n;
+            return;
+        }
+        out->size = out->size * 2 + n;
+        out->data = realloc(out->data, out->size);
+    }
+}
+
+static void append_metric(struct metrics_buf *out, const char *name,
+                          const char *type, const char *help)
+{
+    append(out, "# HELP shadowsocks_%s %s\n", name, help);
+    append(out, "# TYPE shadowsocks_%s %s\n", name, type);
+}
+
+static void append_histogram(struct metrics_buf *out, const char *name,
+                             const char *help,
+                             const struct metrics_histogram *hist)
+{
+    uint64_t cumulative = 0;
+
+    append_metric(out, name, "histogram", help);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += hist->counts[i];
+        append(out, "shadowsocks_%s_bucket{le=\"%g\"} %llu\n", name,
+               bucket_bounds[i], (unsigned long long)cumulative);
+    }
+    append(out, "shadowsocks_%s_bucket{le=\"+Inf\"} %llu\n", name,
+           (unsigned long long)hist->count);
+    append(out, "shadowsocks_%s_sum %f\n", name, hist->sum);
+    append(out, "shadowsocks_%s_count %llu\n", name,
+           (unsigned long long)hist->count);
+}
+
+static void render(struct metrics_buf *out)
+{
+    const char *cipher = metrics.cipher != NULL ? metrics.cipher : "table";
+
+    append_metric(out, "sessions", "gauge", "Sessions currently open.");
+    append(out, "shadowsocks_sessions %d\n", metrics.sessions);
+
+    append_metric(out, "accepted_total", "counter",
+                  "Connections accepted.");
+    append(out, "shadowsocks_accepted_total %llu\n",
+           (unsigned long long)metrics.accepted);
+
+    append_metric(out, "handshake_failures_total", "counter",
+                  "Sessions closed for a bad request header.");
+    append(out, "shadowsocks_handshake_failures_total %llu\n",
+           (unsigned long long)metrics.handshake_failures);
+
+    append_metric(out, "dns_queries_total", "counter",
+                  "Names resolved by the process.");
+    append(out, "shadowsocks_dns_queries_total %llu\n",
+           (unsigned long long)metrics.dns_queries);
+
+    append_metric(out, "dns_failures_total", "counter",
+                  "Names that could not be resolved.");
+    append(out, "shadowsocks_dns_failures_total %llu\n",
+           (unsigned long long)metrics.dns_failures);
+
+    append_histogram(out, "dns_latency_seconds",
+                     "Time spent resolving names.", &metrics.dns_latency);
+    append_histogram(out, "connect_latency_seconds",
+                     "Time spent connecting to remotes.",
+                     &metrics.connect_latency);
+
+    append_metric(out, "bytes_total", "counter",
+                  "Bytes read from clients (up) and remotes (down).");
+    append(out, "shadowsocks_bytes_total{cipher=\"%s\",direction=\"up\"} %llu\n",
+           cipher, (unsigned long long)tx);
+    append(out, "shadowsocks_bytes_total{cipher=\"%s\",direction=\"down\"} %llu\n",
+           cipher, (unsigned long long)rx);
+
+    append_metric(out, "udp_associations", "gauge",
+                  "UDP associations currently open.");
+    append(out, "shadowsocks_udp_associations %d\n", udp_associations);
+
+    append_metric(out, "udp_associations_total", "counter",
+                  "UDP associations opened.");
+    append(out, "shadowsocks_udp_associations_total %llu\n",
+           (unsigned long long)udp_associations_total);
+
+    append_metric(out, "buffer_bytes", "gauge",
+                  "Bytes held by relay buffers.");
+    append(out, "shadowsocks_buffer_bytes %zu\n", buf_used);
+
+    append_metric(out, "buffer_budget_bytes", "gauge",
+                  "Limit on relay buffers, 0 for none.");
+    append(out, "shadowsocks_buffer_budget_bytes %zu\n", buf_budget);
+
+    if (metrics.pool != NULL) {
+        append_metric(out, "buffer_pool_free", "gauge",
+                      "Buffers kept on the free list.");
+        append(out, "shadowsocks_buffer_pool_free %zu\n",
+               metrics.pool->free_num);
+    }
+}
+
+static void close_client(EV_P_ struct metrics_client *client)
+{
+    ev_io_stop(EV_A_ & client->io);
+    ev_timer_stop(EV_A_ & client->watcher);
+    close(client->fd);
+    free(client->buf);
+    free(client);
+}
+
+static void client_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct metrics_client *client = (struct metrics_client *)(((void *)watcher)
+                                                              - sizeof(ev_io));
+    close_client(EV_A_ client);
+}
+
+static void client_send_cb(EV_P_ ev_io *w, int revents)
+{
+    struct metrics_client *client = (struct metrics_client *)w;
+
+    while (client->idx < client->len) {
+        ssize_t s = send(client->fd, client->buf + client->idx,
+                         client->len - client->idx, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            break;
+        }
+        client->idx += s;
+    }
+
+    close_client(EV_A_ client);
+}
+
+static void client_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    struct metrics_client *client = (struct metrics_client *)w;
+    struct metrics_buf body = { NULL, 0, 0 };
+    struct metrics_buf out  = { NULL, 0, 0 };
+
+    ssize_t r = recv(client->fd, client->req + client->req_len,
+                     METRICS_REQUEST_SIZE - 1 - client->req_len, 0);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (r <= 0) {
+        close_client(EV_A_ client);
+        return;
+    }
+
+    client->req_len += r;
+    client->req[client->req_len] = '\0';
+    if (strstr(client->req, "\r\n\r\n") == NULL
+        && strstr(client->req, "\n\n") == NULL
+        && client->req_len < METRICS_REQUEST_SIZE - 1) {
+        return;
+    }
+
+    // the whole response is built at once, from one view of the counters
+    if (strncmp(client->req, "GET ", 4) == 0) {
+        render(&body);
+        append(&out, "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\n\r\n", body.len);
+        append(&out, "%.*s", (int)body.len, body.data);
+        free(body.data);
+    } else {
+        append(&out, "HTTP/1.0 405 Method Not Allowed\r\n"
+               "Content-Length: 0\r\n\r\n");
+    }
+
+    client->buf = out.data;
+    client->len = out.len;
+
+    ev_io_stop(EV_A_ & client->io);
+    ev_io_init(&client->io, client_send_cb, client->fd, EV_WRITE);
+    ev_io_start(EV_A_ & client->io);
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents)
+{
+    int fd = accept_nonblock(w->fd, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    struct metrics_client *client = malloc(sizeof(struct metrics_client));
+    memset(client, 0, sizeof(struct metrics_client));
+    client->fd = fd;
+
+    ev_io_init(&client->io, client_recv_cb, fd, EV_READ);
+    ev_timer_init(&client->watcher, client_timeout_cb, METRICS_TIMEOUT, 0);
+    ev_io_start(EV_A_ & client->io);
+    ev_timer_start(EV_A_ & client->watcher);
+}
+
+static int bind_tcp(const char *addr)
+{
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    ss_addr_t host;
+    int fd = -1;
+
+    parse_addr(addr, &host);
+    if (host.port == NULL) {
+        LOGE("metrics address needs a port: %s", addr);
+        free(host.host);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    int s = getaddrinfo(host.host, host.port, &hints, &result);
+    free(host.host);
+    free(host.port);
+    if (s != 0) {
+        LOGE("getaddrinfo: %s", gai_strerror(s));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+
+        ERROR("bind");
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return fd;
+}
+
+#ifndef __MINGW32__
+static int bind_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        LOGE("metrics path too long: %s", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        ERROR("socket");
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(struct sockaddr_un));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(struct sockaddr_un)) == -1) {
+        ERROR("bind");
+        close(fd);
+        return -1;
+    }
+
+    listen_path = strdup(path);
+    return fd;
+}
+#endif
+
+/*
+ * Serve the metrics on a TCP address, host:port, or on a UNIX socket when
+ * the address contains a slash.
+ */
+int metrics_listen(struct ev_loop *loop, const char *addr)
+{
+#ifndef __MINGW32__
+    if (strchr(addr, '/') != NULL) {
+        listen_fd = bind_unix(addr);
+    } else
+#endif
+    listen_fd = bind_tcp(addr);
+
+    if (listen_fd == -1) {
+        LOGE("failed to serve metrics on %s", addr);
+        return -1;
+    }
+
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        ERROR("listen");
+        metrics_close(loop);
+        return -1;
+    }
+
+    return metrics_serve(loop, addr, listen_fd);
+}
+
+/*
+ * Serve the metrics on a socket already listening on addr, such as one
+ * taken over from another process
+ */
+int metrics_serve(struct ev_loop *loop, const char *addr, int fd)
+{
+    listen_fd = fd;
+#ifndef __MINGW32__
+    if (strchr(addr, '/') != NULL && listen_path == NULL) {
+        listen_path = strdup(addr);
+    }
+#endif
+
+#ifdef __MINGW32__
+    setnonblocking(listen_fd);
+#else
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    ev_io_init(&listen_io, accept_cb, listen_fd, EV_READ);
+    ev_io_start(loop, &listen_io);
+
+    LOGI("serving metrics on %s", addr);
+
+    return 0;
+}
+
+int metrics_fd(void)
+{
+    return listen_fd;
+}
+
+/*
+ * Stop serving, but leave the UNIX socket to the process that took it over
+ */
+void metrics_release(struct ev_loop *loop)
+{
+    if (listen_path != NULL) {
+        free(listen_path);
+        listen_path = NULL;
+    }
+    metrics_close(loop);
+}
+
+void metrics_close(struct ev_loop *loop)
+{
+    if (listen_fd == -1) {
+        return;
+    }
+
+    ev_io_stop(loop, &listen_io);
+    close(listen_fd);
+    listen_fd = -1;
+
+    if (listen_path != NULL) {
+        unlink(listen_path);
+        free(listen_path);
+        listen_path = NULL;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * metrics.h - Define the metrics endpoint of ss-server and ss-local
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <ev.h>
+
+#include "bufpool.h"
+
+#define METRICS_BUCKETS 12
+
+/**
+ * Latencies in seconds, counted in fixed buckets from 1ms to 5s
+ */
+struct metrics_histogram {
+    uint64_t counts[METRICS_BUCKETS + 1]; /**<The last one is +Inf */
+    uint64_t count;
+    double sum;
+};
+
+/*
+ * Everything is updated from the event loop thread only, so the counters
+ * are plain integers, read back when the endpoint is scraped.
+ */
+struct metrics {
+    const char *cipher;
+    const struct buf_pool *pool;
+    int sessions;
+    uint64_t accepted;
+    uint64_t handshake_failures;
+    uint64_t dns_queries;
+    uint64_t dns_failures;
+    struct metrics_histogram dns_latency;
+    struct metrics_histogram connect_latency;
+};
+
+extern struct metrics metrics;
+
+void metrics_observe(struct metrics_histogram *hist, double seconds);
+int metrics_listen(struct ev_loop *loop, const char *addr);
+int metrics_serve(struct ev_loop *loop, const char *addr, int fd);
+int metrics_fd(void);
+void metrics_release(struct ev_loop *loop);
+void metrics_close(struct ev_loop *loop);
+
+#endif // _METRICS_H
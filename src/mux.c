@@ -0,0 +1,836 @@
+/*
+ * mux.c - Relay many streams over a few long-lived encrypted connections
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include <libcork/core.h>
+
+#ifdef __MINGW32__
+#include "win32.h"
+#endif
+
+#include "bufpool.h"
+#include "metrics.h"
+#include "utils.h"
+#include "mux.h"
+
+#ifndef EAGAIN
+#define EAGAIN EWOULDBLOCK
+#endif
+
+#ifndef EWOULDBLOCK
+#define EWOULDBLOCK EAGAIN
+#endif
+
+extern int verbose;
+extern uint64_t tx;
+extern uint64_t rx;
+
+static struct mux_config config;
+static struct cork_dllist tunnels;
+static int tunnel_num = 0;
+
+static void tunnel_recv_cb(EV_P_ ev_io *w, int revents);
+static void tunnel_send_cb(EV_P_ ev_io *w, int revents);
+static void tunnel_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+static void stream_recv_cb(EV_P_ ev_io *w, int revents);
+static void stream_send_cb(EV_P_ ev_io *w, int revents);
+static void stream_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+
+/*
+ * Tunnel and stream buffers are charged to the relay memory budget by
+ * their capacity, like the pooled buffers of plain sessions.
+ */
+static char *mux_buf_reserve(struct mux_buf *buf, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        size_t size = max(buf->size * 2, buf->len + len);
+        buf_used += size - buf->size;
+        buf->size = size;
+        buf->data = realloc(buf->data, buf->size);
+    }
+    return buf->data + buf->len;
+}
+
+static void mux_buf_append(struct mux_buf *buf, const char *data, size_t len)
+{
+    memcpy(mux_buf_reserve(buf, len), data, len);
+    buf->len += len;
+}
+
+static void mux_buf_free(struct mux_buf *buf)
+{
+    buf_used -= buf->size;
+    free(buf->data);
+    memset(buf, 0, sizeof(struct mux_buf));
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void store_header(char *p, int type, uint32_t id, int len)
+{
+    p[0] = type;
+    store32((uint8_t *)p + 1, id);
+    p[5] = len >> 8;
+    p[6] = len;
+}
+
+/*
+ * ss-server counts what arrives through tunnels as read from clients, and
+ * ss-local the other way around, like their plain relays do.
+ */
+static inline void count_tunnel_bytes(ssize_t len)
+{
+    if (config.open != NULL) {
+        tx += len;
+    } else {
+        rx += len;
+    }
+}
+
+static inline void count_stream_bytes(ssize_t len)
+{
+    if (config.open != NULL) {
+        rx += len;
+    } else {
+        tx += len;
+    }
+}
+
+static inline size_t tunnel_queued(struct mux_tunnel *tunnel)
+{
+    return tunnel->plain.len + tunnel->wire.len - tunnel->wire.idx;
+}
+
+/*
+ * Frames are gathered in plain text and encrypted together once the
+ * tunnel is writable, so whatever the streams queue within one loop
+ * iteration goes out in a single write.
+ */
+static void queue_frame(struct mux_tunnel *tunnel, int type, uint32_t id,
+                        const char *payload, int len)
+{
+    char *p = mux_buf_reserve(&tunnel->plain, MUX_HEADER_LEN + len);
+    store_header(p, type, id, len);
+    if (len > 0) {
+        memcpy(p + MUX_HEADER_LEN, payload, len);
+    }
+    tunnel->plain.len += MUX_HEADER_LEN + len;
+
+    if (tunnel->connected) {
+        ev_io_start(tunnel->loop, &tunnel->send_io);
+    }
+}
+
+static struct mux_stream *new_stream(EV_P_ struct mux_tunnel *tunnel,
+                                     uint32_t id, int fd)
+{
+    struct mux_stream *stream = malloc(sizeof(struct mux_stream));
+    memset(stream, 0, sizeof(struct mux_stream));
+
+    stream->id          = id;
+    stream->fd          = fd;
+    stream->tunnel      = tunnel;
+    stream->send_window = MUX_WINDOW;
+    stream->recv_window = MUX_WINDOW;
+    ev_io_init(&stream->recv_io, stream_recv_cb, fd, EV_READ);
+    ev_io_init(&stream->send_io, stream_send_cb, fd, EV_WRITE);
+    ev_timer_init(&stream->watcher, stream_timeout_cb, config.timeout,
+                  config.timeout);
+    ev_timer_start(EV_A_ & stream->watcher);
+
+    HASH_ADD(hh, tunnel->streams, id, sizeof(uint32_t), stream);
+    tunnel->stream_num++;
+    metrics.sessions++;
+
+    return stream;
+}
+
+static void free_stream(EV_P_ struct mux_stream *stream)
+{
+    struct mux_tunnel *tunnel = stream->tunnel;
+
+    ev_io_stop(EV_A_ & stream->recv_io);
+    ev_io_stop(EV_A_ & stream->send_io);
+    ev_timer_stop(EV_A_ & stream->watcher);
+    if (stream->query != NULL) {
+        resolv_cancel(stream->query);
+    }
+    if (stream->fd != -1) {
+        close(stream->fd);
+    }
+    if (stream->blocked) {
+        cork_dllist_remove(&stream->blocked_entries);
+    }
+
+    HASH_DEL(tunnel->streams, stream);
+    metrics.sessions--;
+    if (--tunnel->stream_num == 0) {
+        // idle tunnels are kept for a timeout before closing
+        ev_timer_again(EV_A_ & tunnel->watcher);
+    }
+
+    mux_buf_free(&stream->out);
+    free(stream);
+}
+
+void mux_stream_reset(EV_P_ struct mux_stream *stream)
+{
+    queue_frame(stream->tunnel, MUX_RST, stream->id, NULL, 0);
+    free_stream(EV_A_ stream);
+}
+
+static void start_reading(EV_P_ struct mux_stream *stream)
+{
+    if (stream->connected && !stream->eof && !stream->blocked
+        && stream->send_window > 0) {
+        ev_io_start(EV_A_ & stream->recv_io);
+    }
+}
+
+static void resume_streams(EV_P_ struct mux_tunnel *tunnel)
+{
+    if (tunnel_queued(tunnel) >= MUX_HIGH_WATER / 2) {
+        return;
+    }
+
+    while (!cork_dllist_is_empty(&tunnel->blocked)) {
+        struct cork_dllist_item *item = cork_dllist_start(&tunnel->blocked);
+        struct mux_stream *stream = cork_container_of(item, struct mux_stream,
+                                                      blocked_entries);
+        cork_dllist_remove(item);
+        stream->blocked = 0;
+        start_reading(EV_A_ stream);
+    }
+}
+
+/*
+ * Write what the peer sent to the socket of the stream, and give the
+ * peer more window once half of it has been delivered.
+ */
+static int stream_flush(EV_P_ struct mux_stream *stream)
+{
+    struct mux_buf *out = &stream->out;
+
+    while (out->idx < out->len) {
+        ssize_t s = send(stream->fd, out->data + out->idx,
+                         out->len - out->idx, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_io_start(EV_A_ & stream->send_io);
+                break;
+            }
+            ERROR("mux_stream_send");
+            return -1;
+        }
+        out->idx += s;
+        stream->consumed += s;
+    }
+
+    if (out->idx == out->len) {
+        // buffers are attached only while they hold data
+        mux_buf_free(out);
+        ev_io_stop(EV_A_ & stream->send_io);
+    }
+
+    if (stream->consumed >= MUX_WINDOW / 2) {
+        uint8_t inc[4];
+        store32(inc, stream->consumed);
+        queue_frame(stream->tunnel, MUX_WND, stream->id, (char *)inc, 4);
+        stream->recv_window += stream->consumed;
+        stream->consumed     = 0;
+    }
+
+    return 0;
+}
+
+static void stream_deliver(EV_P_ struct mux_stream *stream)
+{
+    if (stream_flush(EV_A_ stream) == -1) {
+        mux_stream_reset(EV_A_ stream);
+    } else if (stream->fin && stream->out.len == 0) {
+        if (stream->eof) {
+            free_stream(EV_A_ stream);
+        } else {
+            // pass the FIN on, the other direction may still carry data
+            shutdown(stream->fd, SHUT_WR);
+        }
+    }
+}
+
+static void stream_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    struct mux_stream *stream = cork_container_of(w, struct mux_stream,
+                                                  recv_io);
+    struct mux_tunnel *tunnel = stream->tunnel;
+
+    if (tunnel_queued(tunnel) >= MUX_HIGH_WATER) {
+        // read again once the tunnel drains
+        ev_io_stop(EV_A_ w);
+        stream->blocked = 1;
+        cork_dllist_add(&tunnel->blocked, &stream->blocked_entries);
+        return;
+    }
+
+    // read straight into the next frame
+    size_t len = min(MUX_CHUNK, stream->send_window);
+    char *frame = mux_buf_reserve(&tunnel->plain, MUX_HEADER_LEN + len);
+    ssize_t r = recv(stream->fd, frame + MUX_HEADER_LEN, len, 0);
+
+    if (r == 0) {
+        queue_frame(tunnel, MUX_FIN, stream->id, NULL, 0);
+        if (stream->fin && stream->out.len == 0) {
+            free_stream(EV_A_ stream);
+        } else {
+            // keep delivering until the peer is done as well
+            stream->eof = 1;
+            ev_io_stop(EV_A_ w);
+        }
+        return;
+    } else if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        ERROR("mux_stream_recv");
+        mux_stream_reset(EV_A_ stream);
+        return;
+    }
+
+    store_header(frame, MUX_DATA, stream->id, r);
+    tunnel->plain.len += MUX_HEADER_LEN + r;
+    count_stream_bytes(r);
+
+    stream->send_window -= r;
+    if (stream->send_window == 0) {
+        // wait for the peer to open the window again
+        ev_io_stop(EV_A_ w);
+    }
+
+    ev_timer_again(EV_A_ & stream->watcher);
+    if (tunnel->connected) {
+        ev_io_start(EV_A_ & tunnel->send_io);
+    }
+}
+
+static void stream_send_cb(EV_P_ ev_io *w, int revents)
+{
+    struct mux_stream *stream = cork_container_of(w, struct mux_stream,
+                                                  send_io);
+
+    if (!stream->connected) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof addr;
+        if (getpeername(stream->fd, (struct sockaddr *)&addr, &len) == -1) {
+            if (verbose) {
+                ERROR("getpeername");
+            }
+            mux_stream_reset(EV_A_ stream);
+            return;
+        }
+        stream->connected = 1;
+        metrics_observe(&metrics.connect_latency, ev_now(EV_A) - stream->start);
+        start_reading(EV_A_ stream);
+    }
+
+    ev_timer_again(EV_A_ & stream->watcher);
+    stream_deliver(EV_A_ stream);
+}
+
+static void stream_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct mux_stream *stream = cork_container_of(watcher, struct mux_stream,
+                                                  watcher);
+
+    if (verbose) {
+        LOGI("mux stream %u timeout", stream->id);
+    }
+
+    mux_stream_reset(EV_A_ stream);
+}
+
+/*
+ * Connect a stream opened by the peer once its target is known
+ */
+void mux_stream_connect(EV_P_ struct mux_stream *stream, int fd)
+{
+    stream->fd    = fd;
+    stream->start = ev_now(EV_A);
+    ev_io_set(&stream->recv_io, fd, EV_READ);
+    ev_io_set(&stream->send_io, fd, EV_WRITE);
+    ev_io_start(EV_A_ & stream->send_io);
+}
+
+static int handle_frame(EV_P_ struct mux_tunnel *tunnel, int type,
+                        uint32_t id, const char *payload, int len)
+{
+    struct mux_stream *stream = NULL;
+    HASH_FIND(hh, tunnel->streams, &id, sizeof(uint32_t), stream);
+
+    switch (type) {
+    case MUX_SYN:
+        if (stream != NULL || config.open == NULL) {
+            return -1;
+        }
+        if (buf_budget_exhausted()) {
+            if (verbose) {
+                LOGI("memory budget used up, mux stream %u refused", id);
+            }
+            queue_frame(tunnel, MUX_RST, id, NULL, 0);
+            break;
+        }
+        stream = new_stream(EV_A_ tunnel, id, -1);
+        config.open(EV_A_ stream, payload, len);
+        break;
+    case MUX_DATA:
+        if (stream == NULL) {
+            // already closed on this side
+            break;
+        }
+        if ((uint32_t)len > stream->recv_window) {
+            LOGE("mux stream %u overran its window", id);
+            mux_stream_reset(EV_A_ stream);
+            break;
+        }
+        stream->recv_window -= len;
+        mux_buf_append(&stream->out, payload, len);
+        if (stream->connected && !ev_is_active(&stream->send_io)) {
+            stream_deliver(EV_A_ stream);
+        }
+        break;
+    case MUX_FIN:
+        if (stream == NULL) {
+            break;
+        }
+        stream->fin = 1;
+        if (stream->connected && !ev_is_active(&stream->send_io)) {
+            stream_deliver(EV_A_ stream);
+        }
+        break;
+    case MUX_RST:
+        if (stream != NULL) {
+            free_stream(EV_A_ stream);
+        }
+        break;
+    case MUX_WND:
+        if (len != 4) {
+            return -1;
+        }
+        if (stream != NULL) {
+            stream->send_window += load32((const uint8_t *)payload);
+            if (!ev_is_active(&stream->recv_io)) {
+                start_reading(EV_A_ stream);
+            }
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_frames(EV_P_ struct mux_tunnel *tunnel)
+{
+    struct mux_buf *in = &tunnel->in;
+
+    while (in->len - in->idx >= MUX_HEADER_LEN) {
+        const uint8_t *p = (const uint8_t *)in->data + in->idx;
+        int len = (p[5] << 8) | p[6];
+        if (in->len - in->idx < MUX_HEADER_LEN + len) {
+            break;
+        }
+        if (handle_frame(EV_A_ tunnel, p[0], load32(p + 1),
+                         (const char *)p + MUX_HEADER_LEN, len) == -1) {
+            return -1;
+        }
+        in->idx += MUX_HEADER_LEN + len;
+    }
+
+    if (in->idx == in->len) {
+        // drained tunnels hold no buffers, they count against the budget
+        mux_buf_free(in);
+        return 0;
+    }
+
+    // keep the partial frame at the front
+    memmove(in->data, in->data + in->idx, in->len - in->idx);
+    in->len -= in->idx;
+    in->idx  = 0;
+
+    return 0;
+}
+
+static struct mux_tunnel *new_tunnel(EV_P_ int fd, struct enc_ctx *e_ctx,
+                                     struct enc_ctx *d_ctx, void *data)
+{
+    struct mux_tunnel *tunnel = malloc(sizeof(struct mux_tunnel));
+    memset(tunnel, 0, sizeof(struct mux_tunnel));
+
+    tunnel->loop    = EV_A;
+    tunnel->fd      = fd;
+    tunnel->e_ctx   = e_ctx;
+    tunnel->d_ctx   = d_ctx;
+    tunnel->data    = data;
+    tunnel->next_id = 1;
+    tunnel->rbuf    = malloc(MUX_CHUNK);
+    buf_used       += MUX_CHUNK;
+    ev_io_init(&tunnel->recv_io, tunnel_recv_cb, fd, EV_READ);
+    ev_io_init(&tunnel->send_io, tunnel_send_cb, fd, EV_WRITE);
+    ev_timer_init(&tunnel->watcher, tunnel_timeout_cb, config.timeout,
+                  config.timeout);
+    ev_timer_start(EV_A_ & tunnel->watcher);
+    cork_dllist_init(&tunnel->blocked);
+
+    cork_dllist_add(&tunnels, &tunnel->entries);
+    tunnel_num++;
+
+    return tunnel;
+}
+
+static void close_tunnel(EV_P_ struct mux_tunnel *tunnel)
+{
+    struct mux_stream *stream, *tmp;
+
+    if (verbose) {
+        LOGI("mux tunnel closed with %d streams", tunnel->stream_num);
+    }
+
+    HASH_ITER(hh, tunnel->streams, stream, tmp){
+        free_stream(EV_A_ stream);
+    }
+
+    ev_io_stop(EV_A_ & tunnel->recv_io);
+    ev_io_stop(EV_A_ & tunnel->send_io);
+    ev_timer_stop(EV_A_ & tunnel->watcher);
+    close(tunnel->fd);
+
+    if (tunnel->e_ctx != NULL) {
+        cipher_context_release(&tunnel->e_ctx->evp);
+        free(tunnel->e_ctx);
+    }
+    if (tunnel->d_ctx != NULL) {
+        cipher_context_release(&tunnel->d_ctx->evp);
+        free(tunnel->d_ctx);
+    }
+    free(tunnel->rbuf);
+    buf_used -= MUX_CHUNK;
+    mux_buf_free(&tunnel->in);
+    mux_buf_free(&tunnel->plain);
+    mux_buf_free(&tunnel->wire);
+
+    cork_dllist_remove(&tunnel->entries);
+    tunnel_num--;
+    free(tunnel);
+}
+
+static void tunnel_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    struct mux_tunnel *tunnel = cork_container_of(w, struct mux_tunnel,
+                                                  recv_io);
+
+    ssize_t r = recv(tunnel->fd, tunnel->rbuf + tunnel->rbuf_len,
+                     MUX_CHUNK - tunnel->rbuf_len, 0);
+
+    if (r == 0) {
+        close_tunnel(EV_A_ tunnel);
+        return;
+    } else if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        ERROR("mux_tunnel_recv");
+        close_tunnel(EV_A_ tunnel);
+        return;
+    }
+
+    count_tunnel_bytes(r);
+
+    // the IV has to arrive in one piece
+    r += tunnel->rbuf_len;
+    if (tunnel->d_ctx != NULL && !tunnel->d_ctx->init
+        && r <= enc_get_iv_len()) {
+        tunnel->rbuf_len = r;
+        return;
+    }
+    tunnel->rbuf_len = 0;
+
+    tunnel->rbuf = ss_decrypt(MUX_CHUNK, tunnel->rbuf, &r, tunnel->d_ctx);
+    if (tunnel->rbuf == NULL) {
+        LOGE("invalid password or cipher");
+        close_tunnel(EV_A_ tunnel);
+        return;
+    }
+
+    mux_buf_append(&tunnel->in, tunnel->rbuf, r);
+    if (parse_frames(EV_A_ tunnel) == -1) {
+        LOGE("invalid mux frame");
+        close_tunnel(EV_A_ tunnel);
+    }
+}
+
+static void tunnel_send_cb(EV_P_ ev_io *w, int revents)
+{
+    struct mux_tunnel *tunnel = cork_container_of(w, struct mux_tunnel,
+                                                  send_io);
+    struct mux_buf *wire = &tunnel->wire;
+
+    if (!tunnel->connected) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof addr;
+        if (getpeername(tunnel->fd, (struct sockaddr *)&addr, &len) == -1) {
+            ERROR("getpeername");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+        tunnel->connected = 1;
+        ev_io_start(EV_A_ & tunnel->recv_io);
+    }
+
+    if (tunnel->plain.len > 0) {
+        ssize_t len = tunnel->plain.len;
+        size_t size = tunnel->plain.size;
+        char *buf   = ss_encrypt(size, tunnel->plain.data, &len,
+                                 tunnel->e_ctx);
+        memset(&tunnel->plain, 0, sizeof(struct mux_buf));
+        buf_used -= size;
+        if (buf == NULL) {
+            LOGE("invalid password or cipher");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+
+        if (wire->idx == wire->len) {
+            // hand the buffer over instead of copying it
+            tunnel->plain.data = wire->data;
+            tunnel->plain.size = wire->size;
+            wire->data = buf;
+            wire->size = max(size, (size_t)len);
+            buf_used  += wire->size;
+            wire->len  = len;
+            wire->idx  = 0;
+        } else {
+            mux_buf_append(wire, buf, len);
+            free(buf);
+        }
+    }
+
+    while (wire->idx < wire->len) {
+        ssize_t s = send(tunnel->fd, wire->data + wire->idx,
+                         wire->len - wire->idx, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            ERROR("mux_tunnel_send");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+        wire->idx += s;
+    }
+
+    if (wire->idx == wire->len) {
+        // all frames went out, plain is empty as well
+        mux_buf_free(wire);
+        mux_buf_free(&tunnel->plain);
+        ev_io_stop(EV_A_ & tunnel->send_io);
+    }
+
+    resume_streams(EV_A_ tunnel);
+}
+
+static void tunnel_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct mux_tunnel *tunnel = cork_container_of(watcher, struct mux_tunnel,
+                                                  watcher);
+
+    if (tunnel->connected && tunnel->stream_num > 0) {
+        return;
+    }
+
+    close_tunnel(EV_A_ tunnel);
+}
+
+void mux_init(const struct mux_config *c)
+{
+    config = *c;
+    cork_dllist_init(&tunnels);
+}
+
+/*
+ * Take over a connection whose address header asked for a tunnel. The
+ * cipher contexts now belong to the tunnel, and frames holds what was
+ * decrypted after the header.
+ */
+void mux_accept(EV_P_ int fd, struct enc_ctx *e_ctx, struct enc_ctx *d_ctx,
+                const char *frames, int len, void *data)
+{
+    struct mux_tunnel *tunnel = new_tunnel(EV_A_ fd, e_ctx, d_ctx, data);
+    tunnel->connected = 1;
+    ev_io_start(EV_A_ & tunnel->recv_io);
+
+    if (verbose) {
+        LOGI("mux tunnel accepted");
+    }
+
+    if (len > 0) {
+        mux_buf_append(&tunnel->in, frames, len);
+        if (parse_frames(EV_A_ tunnel) == -1) {
+            LOGE("invalid mux frame");
+            close_tunnel(EV_A_ tunnel);
+        }
+    }
+}
+
+/*
+ * The least busy tunnel, opening another one while fewer than configured
+ * are open and all of them carry streams.
+ */
+static struct mux_tunnel *pick_tunnel(EV_P)
+{
+    struct mux_tunnel *best = NULL;
+    struct cork_dllist_item *curr;
+
+    for (curr = cork_dllist_start(&tunnels);
+         !cork_dllist_is_end(&tunnels, curr);
+         curr = curr->next) {
+        struct mux_tunnel *tunnel = cork_container_of(curr, struct mux_tunnel,
+                                                      entries);
+        if (best == NULL || tunnel->stream_num < best->stream_num) {
+            best = tunnel;
+        }
+    }
+
+    if (best != NULL
+        && (best->stream_num == 0 || tunnel_num >= config.tunnels)) {
+        return best;
+    }
+
+    int fd = config.connect(config.data);
+    if (fd == -1) {
+        return best;
+    }
+
+    struct enc_ctx *e_ctx = NULL;
+    struct enc_ctx *d_ctx = NULL;
+    if (config.method) {
+        e_ctx = malloc(sizeof(struct enc_ctx));
+        d_ctx = malloc(sizeof(struct enc_ctx));
+        enc_ctx_init(config.method, e_ctx, 1);
+        enc_ctx_init(config.method, d_ctx, 0);
+    }
+
+    best = new_tunnel(EV_A_ fd, e_ctx, d_ctx, config.data);
+
+    // the address header turning the connection into a tunnel
+    char atyp = MUX_ADDRTYPE;
+    mux_buf_append(&best->plain, &atyp, 1);
+
+    // fires once connected
+    ev_io_start(EV_A_ & best->send_io);
+
+    if (verbose) {
+        LOGI("mux tunnel opened, %d in total", tunnel_num);
+    }
+
+    return best;
+}
+
+/*
+ * Relay a SOCKS client as a new stream. The address header and the first
+ * payload are sent right away, without waiting for the server.
+ */
+int mux_open(EV_P_ int fd, const char *header, int header_len,
+             const char *payload, int payload_len)
+{
+    struct mux_tunnel *tunnel = pick_tunnel(EV_A);
+    struct mux_stream *stream;
+    uint32_t id;
+
+    if (tunnel == NULL) {
+        return -1;
+    }
+
+    do {
+        id = tunnel->next_id++;
+        HASH_FIND(hh, tunnel->streams, &id, sizeof(uint32_t), stream);
+    } while (stream != NULL || id == 0);
+
+    stream = new_stream(EV_A_ tunnel, id, fd);
+    stream->connected = 1;
+
+    queue_frame(tunnel, MUX_SYN, id, header, header_len);
+    if (payload_len > 0) {
+        queue_frame(tunnel, MUX_DATA, id, payload, payload_len);
+        stream->send_window -= payload_len;
+    }
+
+    start_reading(EV_A_ stream);
+
+    return 0;
+}
+
+/*
+ * Streams open on all tunnels
+ */
+int mux_stream_count(void)
+{
+    struct cork_dllist_item *curr;
+    int num = 0;
+
+    for (curr = cork_dllist_start(&tunnels);
+         !cork_dllist_is_end(&tunnels, curr); curr = curr->next) {
+        num += cork_container_of(curr, struct mux_tunnel, entries)->stream_num;
+    }
+
+    return num;
+}
+
+void mux_close_all(EV_P)
+{
+    while (!cork_dllist_is_empty(&tunnels)) {
+        struct cork_dllist_item *item = cork_dllist_start(&tunnels);
+        close_tunnel(EV_A_ cork_container_of(item, struct mux_tunnel, entries));
+    }
+}
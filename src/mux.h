@@ -0,0 +1,139 @@
+/*
+ * mux.h - Define the stream multiplexer of ss-local and ss-server
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MUX_H
+#define _MUX_H
+
+#include <stdint.h>
+#include <ev.h>
+#include <libcork/ds.h>
+
+#include "encrypt.h"
+#include "resolv.h"
+#include "uthash.h"
+
+/*
+ * A tunnel is an ordinary shadowsocks connection whose address header is
+ * the single byte MUX_ADDRTYPE. Everything after it is a sequence of frames:
+ *
+ *    +------+-----------+--------+---------+
+ *    | TYPE | STREAM ID | LENGTH | PAYLOAD |
+ *    +------+-----------+--------+---------+
+ *    |  1   |     4     |   2    | Variable|
+ *    +------+-----------+--------+---------+
+ *
+ * SYN carries the address header of the new stream, DATA its payload, WND
+ * a 4 byte increment of the sender's receive window. FIN ends one
+ * direction of a stream once its data is delivered, and the stream closes
+ * when both sides sent it. RST closes it at once.
+ */
+#define MUX_ADDRTYPE 0x7f
+
+#define MUX_SYN  0
+#define MUX_DATA 1
+#define MUX_FIN  2
+#define MUX_RST  3
+#define MUX_WND  4
+
+#define MUX_HEADER_LEN 7
+#define MUX_CHUNK (16 * 1024)
+#define MUX_WINDOW (256 * 1024)      // per stream and direction
+#define MUX_HIGH_WATER (512 * 1024)  // bytes queued on a tunnel
+
+struct mux_buf {
+    char *data;
+    size_t len;
+    size_t idx;
+    size_t size;
+};
+
+struct mux_tunnel;
+
+struct mux_stream {
+    ev_io recv_io;
+    ev_io send_io;
+    ev_timer watcher;
+    uint32_t id;
+    int fd;                   /**<-1 until connected on ss-server */
+    int connected;
+    int fin;                  /**<The peer is done, shut down fd once out is sent */
+    int eof;                  /**<fd is done, FIN sent */
+    int blocked;              /**<Waiting for the tunnel to drain */
+    uint32_t send_window;     /**<Bytes the peer still accepts */
+    uint32_t recv_window;     /**<Bytes the peer may still send */
+    uint32_t consumed;        /**<Bytes delivered since the last WND */
+    ev_tstamp start;          /**<When resolving or connecting began */
+    struct mux_buf out;       /**<From the peer, waiting for fd */
+    struct ResolvQuery *query;
+    struct mux_tunnel *tunnel;
+    struct cork_dllist_item blocked_entries;
+    UT_hash_handle hh;
+};
+
+struct mux_tunnel {
+    ev_io recv_io;
+    ev_io send_io;
+    ev_timer watcher;
+    struct ev_loop *loop;
+    int fd;
+    int connected;
+    struct enc_ctx *e_ctx;
+    struct enc_ctx *d_ctx;
+    char *rbuf;               /**<Ciphertext being received */
+    ssize_t rbuf_len;
+    struct mux_buf in;        /**<Decrypted, not yet parsed */
+    struct mux_buf plain;     /**<Frames not yet encrypted */
+    struct mux_buf wire;      /**<Encrypted, not yet sent */
+    uint32_t next_id;
+    int stream_num;
+    struct mux_stream *streams;
+    struct cork_dllist blocked;
+    struct cork_dllist_item entries;
+    void *data;               /**<Listener the tunnel came from */
+};
+
+struct mux_config {
+    int method;
+    int timeout;
+    int tunnels;  /**<Tunnels opened by ss-local, 0 on ss-server */
+
+    /* ss-local: start connecting a socket to the server */
+    int (*connect)(void *data);
+
+    /* ss-server: the peer opened a stream to the given address header */
+    void (*open)(EV_P_ struct mux_stream *stream, const char *header,
+                 int header_len);
+
+    void *data;
+};
+
+void mux_init(const struct mux_config *config);
+int mux_open(EV_P_ int fd, const char *header, int header_len,
+             const char *payload, int payload_len);
+void mux_accept(EV_P_ int fd, struct enc_ctx *e_ctx, struct enc_ctx *d_ctx,
+                const char *frames, int len, void *data);
+void mux_stream_connect(EV_P_ struct mux_stream *stream, int fd);
+void mux_stream_reset(EV_P_ struct mux_stream *stream);
+int mux_stream_count(void);
+void mux_close_all(EV_P);
+
+#endif // _MUX_H
@@ -20,8 +20,17 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4()
+#endif
+
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <ev.h>
 #include <libcork/core.h>
 #include <udns.h>
 
@@ -34,14 +43,45 @@
 #define sleep(n) Sleep(1000 * (n))
 #else
 #include <sys/socket.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #endif
 
 #include "netutils.h"
+#include "resolv.h"
 #include "utils.h"
 
+#define REFRESH_MIN_INTERVAL 60
+#define REFRESH_MAX_INTERVAL 86400
+#define RETRY_MAX_INTERVAL 64
+#define STARTUP_WAIT 5.0
+
+extern int verbose;
+
+/*
+ * A server given by hostname, resolved through the event loop and
+ * resolved again when the TTL of its address runs out.
+ */
+struct remote_refresh {
+    ev_timer watcher;
+    struct ev_loop *loop;
+    char *host;
+    uint16_t port; // network order
+    struct sockaddr_storage *addr;
+    struct ResolvQuery *query;
+    int retry;
+    int initial;
+};
+
+static struct remote_refresh *refresh_list = NULL;
+static int refresh_num = 0;
+static int startup_pending = 0;
+
+static void refresh_query(struct remote_refresh *refresh);
+
 size_t get_sockaddr_len(struct sockaddr *addr)
 {
     if (addr->sa_family == AF_INET) {
@@ -52,6 +92,276 @@ size_t get_sockaddr_len(struct sockaddr *addr)
     return 0;
 }
 
+/*
+ * Set the options of accepted sockets on the listening one. Linux copies
+ * them to every accepted socket, elsewhere accept_nonblock() sets them.
+ */
+void set_listen_sockopt(int listenfd)
+{
+    int opt = 1;
+    setsockopt(listenfd, SOL_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+}
+
+/*
+ * Let the kernel complete the first round trip of new connections before
+ * accept() returns them: take the data in the SYN of TCP Fast Open clients,
+ * with at most qlen such connections waiting, and hold other connections
+ * back until their first data arrives or defer_accept seconds pass. Either
+ * is left unset when 0. Returns 1 if accepted sockets are likely readable
+ * at once, so the caller may read them without waiting for the loop.
+ */
+int set_listen_early_data(int listenfd, int qlen, int defer_accept)
+{
+    int early = 0;
+
+#if defined(__linux__) && defined(TCP_FASTOPEN)
+    if (qlen > 0) {
+        if (setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+                       sizeof(qlen)) == -1) {
+            if (errno == EPROTONOSUPPORT || errno == ENOPROTOOPT) {
+                LOGE("fast open is not supported on this platform");
+            } else {
+                ERROR("setsockopt");
+            }
+        } else {
+            early = 1;
+        }
+    }
+#else
+    if (qlen > 0) {
+        LOGE("fast open is not supported on this platform");
+    }
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+    if (defer_accept > 0) {
+        if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                       sizeof(defer_accept)) == -1) {
+            ERROR("setsockopt");
+        } else {
+            early = 1;
+        }
+    }
+#else
+    if (defer_accept > 0) {
+        LOGE("deferred accept is not supported on this platform");
+    }
+#endif
+
+    return early;
+}
+
+/*
+ * Accept a pending connection as a non-blocking, close-on-exec socket
+ * with the options of set_listen_sockopt(), and fill in the peer address
+ * when addr is not NULL. Returns -1 with errno set to EAGAIN once the
+ * backlog is drained.
+ */
+int accept_nonblock(int listenfd, struct sockaddr_storage *addr)
+{
+    socklen_t len = sizeof(struct sockaddr_storage);
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+    return accept4(listenfd, (struct sockaddr *)addr, addr ? &len : NULL,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(listenfd, (struct sockaddr *)addr, addr ? &len : NULL);
+    if (fd == -1) {
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+#ifdef __MINGW32__
+    setnonblocking(fd);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return fd;
+#endif
+}
+
+static int set_profile_opt(int fd, int level, int name, const void *value,
+                           socklen_t len, const char *desc, int report)
+{
+    if (setsockopt(fd, level, name, value, len) == -1) {
+        if (report) {
+            LOGE("cannot set socket option %s: %s", desc, strerror(errno));
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void apply_profile(int fd, const struct sockopt_profile *profile,
+                          int report)
+{
+    if (profile->sndbuf > 0) {
+        set_profile_opt(fd, SOL_SOCKET, SO_SNDBUF, &profile->sndbuf,
+                        sizeof(int), "sndbuf", report);
+    }
+    if (profile->rcvbuf > 0) {
+        set_profile_opt(fd, SOL_SOCKET, SO_RCVBUF, &profile->rcvbuf,
+                        sizeof(int), "rcvbuf", report);
+    }
+    if (profile->notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+        set_profile_opt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                        &profile->notsent_lowat, sizeof(int),
+                        "notsent_lowat", report);
+#else
+        if (report) {
+            LOGE("notsent_lowat is not supported on this platform");
+        }
+#endif
+    }
+    if (profile->keepidle > 0 || profile->keepintvl > 0) {
+        int opt = 1;
+        set_profile_opt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt),
+                        "keepalive", report);
+#ifdef TCP_KEEPIDLE
+        if (profile->keepidle > 0) {
+            set_profile_opt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &profile->keepidle,
+                            sizeof(int), "keepidle", report);
+        }
+#endif
+#ifdef TCP_KEEPINTVL
+        if (profile->keepintvl > 0) {
+            set_profile_opt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                            &profile->keepintvl, sizeof(int), "keepintvl",
+                            report);
+        }
+#endif
+    }
+    if (profile->mark > 0) {
+#ifdef SO_MARK
+        set_profile_opt(fd, SOL_SOCKET, SO_MARK, &profile->mark, sizeof(int),
+                        "mark", report);
+#else
+        if (report) {
+            LOGE("mark is not supported on this platform");
+        }
+#endif
+    }
+    if (profile->tos > 0) {
+        int level = IPPROTO_IP, name = IP_TOS;
+#ifdef IPV6_TCLASS
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        memset(&addr, 0, len);
+        getsockname(fd, (struct sockaddr *)&addr, &len);
+        if (addr.ss_family == AF_INET6) {
+            level = IPPROTO_IPV6;
+            name = IPV6_TCLASS;
+        }
+#endif
+        set_profile_opt(fd, level, name, &profile->tos, sizeof(int), "tos",
+                        report);
+    }
+    if (profile->congestion[0] != '\0') {
+#ifdef TCP_CONGESTION
+        set_profile_opt(fd, IPPROTO_TCP, TCP_CONGESTION, profile->congestion,
+                        strlen(profile->congestion), "congestion", report);
+#else
+        if (report) {
+            LOGE("congestion is not supported on this platform");
+        }
+#endif
+    }
+}
+
+/*
+ * Parse a comma separated list of socket options, such as
+ * "sndbuf=262144,notsent_lowat=16384,congestion=bbr". The profile is tried
+ * on a scratch socket, so that options the system refuses are reported
+ * once at startup rather than for every connection. Returns -1 if the list
+ * is malformed.
+ */
+int parse_sockopt_profile(const char *spec, struct sockopt_profile *profile)
+{
+    char *list = strdup(spec);
+    char *item = list;
+    int ret = 0;
+
+    memset(profile, 0, sizeof(struct sockopt_profile));
+
+    while (item != NULL && ret == 0) {
+        char *next = strchr(item, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        char *value = strchr(item, '=');
+        if (value == NULL || value[1] == '\0') {
+            LOGE("invalid socket option: %s", item);
+            ret = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "congestion") == 0) {
+            if (strlen(value) >= sizeof(profile->congestion)) {
+                LOGE("invalid congestion control: %s", value);
+                ret = -1;
+            } else {
+                strcpy(profile->congestion, value);
+            }
+            item = next;
+            continue;
+        }
+
+        char *end;
+        long n = strtol(value, &end, 0);
+        if (*end != '\0' || n < 0 || n > INT_MAX) {
+            LOGE("invalid value of socket option %s: %s", item, value);
+            ret = -1;
+        } else if (strcmp(item, "sndbuf") == 0) {
+            profile->sndbuf = n;
+        } else if (strcmp(item, "rcvbuf") == 0) {
+            profile->rcvbuf = n;
+        } else if (strcmp(item, "notsent_lowat") == 0) {
+            profile->notsent_lowat = n;
+        } else if (strcmp(item, "keepidle") == 0) {
+            profile->keepidle = n;
+        } else if (strcmp(item, "keepintvl") == 0) {
+            profile->keepintvl = n;
+        } else if (strcmp(item, "mark") == 0) {
+            profile->mark = n;
+        } else if (strcmp(item, "tos") == 0) {
+            profile->tos = n;
+        } else {
+            LOGE("unknown socket option: %s", item);
+            ret = -1;
+        }
+        item = next;
+    }
+
+    free(list);
+
+    if (ret == 0) {
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd != -1) {
+            apply_profile(fd, profile, 1);
+            close(fd);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Apply a profile to a socket. Failures were reported by
+ * parse_sockopt_profile() already and are ignored here.
+ */
+void set_sockopt_profile(int fd, const struct sockopt_profile *profile)
+{
+    apply_profile(fd, profile, 0);
+}
+
 size_t get_sockaddr(char *host, char *port, struct sockaddr_storage *storage, int block)
 {
     struct cork_ip ip;
@@ -124,3 +434,182 @@ size_t get_sockaddr(char *host, char *port, struct sockaddr_storage *storage, in
 
     return -1;
 }
+
+static void update_remote_addr(struct remote_refresh *refresh,
+                               const struct sockaddr *addr)
+{
+    struct sockaddr_storage *storage = refresh->addr;
+    char host[INET6_ADDRSTRLEN];
+    int changed;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        struct sockaddr_in *out      = (struct sockaddr_in *)storage;
+        changed = out->sin_family != AF_INET
+                  || out->sin_addr.s_addr != in->sin_addr.s_addr;
+        if (changed) {
+            memset(storage, 0, sizeof(struct sockaddr_storage));
+            out->sin_family = AF_INET;
+            out->sin_port   = refresh->port;
+            out->sin_addr   = in->sin_addr;
+            dns_ntop(AF_INET, &in->sin_addr, host, INET_ADDRSTRLEN);
+        }
+    } else {
+        const struct sockaddr_in6 *in = (const struct sockaddr_in6 *)addr;
+        struct sockaddr_in6 *out      = (struct sockaddr_in6 *)storage;
+        changed = out->sin6_family != AF_INET6
+                  || memcmp(&out->sin6_addr, &in->sin6_addr,
+                            sizeof(struct in6_addr)) != 0;
+        if (changed) {
+            memset(storage, 0, sizeof(struct sockaddr_storage));
+            out->sin6_family = AF_INET6;
+            out->sin6_port   = refresh->port;
+            out->sin6_addr   = in->sin6_addr;
+            dns_ntop(AF_INET6, &in->sin6_addr, host, INET6_ADDRSTRLEN);
+        }
+    }
+
+    if (changed) {
+        LOGI("server %s resolved to %s", refresh->host, host);
+    }
+}
+
+static void refresh_resolve_cb(struct sockaddr *addr, uint32_t ttl, void *data)
+{
+    struct remote_refresh *refresh = (struct remote_refresh *)data;
+    double after;
+
+    refresh->query = NULL;
+
+    if (addr == NULL) {
+        // keep the last known address and retry with a backoff
+        if (refresh->retry == 0) {
+            refresh->retry = 2;
+        } else if (refresh->retry < RETRY_MAX_INTERVAL) {
+            refresh->retry *= 2;
+        }
+        after = refresh->retry;
+        LOGE("failed to resolve server name %s, retry in %d seconds",
+             refresh->host, refresh->retry);
+    } else {
+        refresh->retry = 0;
+        update_remote_addr(refresh, addr);
+        if (ttl < REFRESH_MIN_INTERVAL) {
+            ttl = REFRESH_MIN_INTERVAL;
+        } else if (ttl > REFRESH_MAX_INTERVAL) {
+            ttl = REFRESH_MAX_INTERVAL;
+        }
+        after = ttl;
+    }
+
+    if (refresh->initial) {
+        refresh->initial = 0;
+        startup_pending--;
+    }
+
+    ev_timer_set(&refresh->watcher, after, 0.0);
+    ev_timer_start(refresh->loop, &refresh->watcher);
+}
+
+static void refresh_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    refresh_query((struct remote_refresh *)watcher);
+}
+
+static void refresh_query(struct remote_refresh *refresh)
+{
+    refresh->query = resolv_query_ttl(refresh->host, refresh_resolve_cb, NULL,
+                                      refresh, refresh->port);
+    if (refresh->query == NULL) {
+        refresh_resolve_cb(NULL, 0, refresh);
+    }
+}
+
+/*
+ * Build the server address list. Literal addresses are filled in at once,
+ * hostnames are looked up in parallel through the resolver, which must be
+ * initialized on the loop. This waits a few seconds at most, then carries
+ * on with whatever has been resolved; the rest keep retrying, and every
+ * hostname is resolved again when its TTL runs out. Addresses are updated
+ * in place and stay zeroed (AF_UNSPEC) until first resolved.
+ */
+struct sockaddr **resolve_remote_addrs(struct ev_loop *loop,
+                                       const ss_addr_t *remotes,
+                                       char *default_port, int num)
+{
+    struct sockaddr **addrs = malloc(sizeof(struct sockaddr *) * num);
+    struct cork_ip ip;
+
+    refresh_list = malloc(sizeof(struct remote_refresh) * num);
+    refresh_num  = 0;
+
+    for (int i = 0; i < num; i++) {
+        char *host = remotes[i].host;
+        char *port = remotes[i].port == NULL ? default_port : remotes[i].port;
+        struct sockaddr_storage *storage = malloc(sizeof(struct sockaddr_storage));
+        memset(storage, 0, sizeof(struct sockaddr_storage));
+        addrs[i] = (struct sockaddr *)storage;
+
+        if (cork_ip_init(&ip, host) != -1) {
+            get_sockaddr(host, port, storage, 0);
+            continue;
+        }
+
+        struct remote_refresh *refresh = &refresh_list[refresh_num++];
+        memset(refresh, 0, sizeof(struct remote_refresh));
+        ev_timer_init(&refresh->watcher, refresh_cb, 0.0, 0.0);
+        refresh->loop    = loop;
+        refresh->host    = host;
+        refresh->port    = htons(atoi(port));
+        refresh->addr    = storage;
+        refresh->initial = 1;
+        startup_pending++;
+        refresh_query(refresh);
+    }
+
+    ev_tstamp deadline = ev_time() + STARTUP_WAIT;
+    while (startup_pending > 0 && ev_time() < deadline) {
+        ev_run(loop, EVRUN_ONCE);
+    }
+
+    if (pick_remote_addr(addrs, num) == NULL) {
+        LOGE("no server resolved yet, connections are refused until one is");
+    }
+
+    return addrs;
+}
+
+void free_remote_addrs(struct ev_loop *loop, struct sockaddr **addrs, int num)
+{
+    for (int i = 0; i < refresh_num; i++) {
+        ev_timer_stop(loop, &refresh_list[i].watcher);
+        if (refresh_list[i].query != NULL) {
+            resolv_cancel(refresh_list[i].query);
+        }
+    }
+    free(refresh_list);
+    refresh_list = NULL;
+    refresh_num  = 0;
+
+    for (int i = 0; i < num; i++) {
+        free(addrs[i]);
+    }
+    free(addrs);
+}
+
+/*
+ * Pick a random server among those resolved, or NULL if there's none yet
+ */
+struct sockaddr *pick_remote_addr(struct sockaddr **addrs, int num)
+{
+    int index = rand() % num;
+
+    for (int i = 0; i < num; i++) {
+        struct sockaddr *addr = addrs[(index + i) % num];
+        if (addr->sa_family == AF_INET || addr->sa_family == AF_INET6) {
+            return addr;
+        }
+    }
+
+    return NULL;
+}
@@ -20,5 +20,40 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _NETUTILS_H
+#define _NETUTILS_H
+
+#include "jconf.h"
+
+struct ev_loop;
+
 size_t get_sockaddr_len(struct sockaddr *addr);
 size_t get_sockaddr(char *host, char *port, struct sockaddr_storage *storage, int block);
+
+/**
+ * Options of the sockets on one side of the relay, 0 when left unset
+ */
+struct sockopt_profile {
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    int keepidle;
+    int keepintvl;
+    int mark;
+    int tos;
+    char congestion[16];
+};
+
+void set_listen_sockopt(int listenfd);
+int set_listen_early_data(int listenfd, int qlen, int defer_accept);
+int accept_nonblock(int listenfd, struct sockaddr_storage *addr);
+int parse_sockopt_profile(const char *spec, struct sockopt_profile *profile);
+void set_sockopt_profile(int fd, const struct sockopt_profile *profile);
+
+struct sockaddr **resolve_remote_addrs(struct ev_loop *loop,
+                                       const ss_addr_t *remotes,
+                                       char *default_port, int num);
+void free_remote_addrs(struct ev_loop *loop, struct sockaddr **addrs, int num);
+struct sockaddr *pick_remote_addr(struct sockaddr **addrs, int num);
+
+#endif // _NETUTILS_H
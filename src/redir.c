@@ -36,6 +36,7 @@
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <limits.h>
 #include <linux/if.h>
 #include <linux/netfilter_ipv4.h>
@@ -46,6 +47,7 @@
 #endif
 
 #include "netutils.h"
+#include "resolv.h"
 #include "utils.h"
 #include "common.h"
 #include "redir.h"
@@ -83,6 +85,9 @@ static void close_and_free_server(EV_P_ struct server *server);
 int verbose = 0;
 
 static int mode = TCP_ONLY;
+static int udp_over_tcp = 0;
+static int fast_open_queue = 0;
+static int defer_accept = 0;
 
 int getdestaddr(int fd, struct sockaddr_storage *destaddr)
 {
@@ -565,8 +570,13 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
     setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
 
-    int index = rand() % listener->remote_num;
-    struct sockaddr *remote_addr = listener->remote_addr[index];
+    struct sockaddr *remote_addr = pick_remote_addr(listener->remote_addr,
+                                                    listener->remote_num);
+    if (remote_addr == NULL) {
+        LOGE("server name not resolved yet");
+        close(serverfd);
+        return;
+    }
 
     int remotefd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
     if (remotefd < 0) {
@@ -612,10 +622,29 @@ int main(int argc, char **argv)
     ss_addr_t remote_addr[MAX_REMOTE_NUM];
     char *remote_port = NULL;
 
+    int option_index = 0;
+    static struct option long_options[] =
+    {
+        { "udp-over-tcp",    no_argument,       0, 0 },
+        { "fast-open-queue", required_argument, 0, 0 },
+        { "defer-accept",    required_argument, 0, 0 },
+        { 0,                 0,                 0, 0 }
+    };
+
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "f:s:p:l:k:t:m:c:b:a:uUv")) != -1) {
+    while ((c = getopt_long(argc, argv, "f:s:p:l:k:t:m:c:b:a:uUv",
+                            long_options, &option_index)) != -1) {
         switch (c) {
+        case 0:
+            if (option_index == 0) {
+                udp_over_tcp = 1;
+            } else if (option_index == 1) {
+                fast_open_queue = atoi(optarg);
+            } else if (option_index == 2) {
+                defer_accept = atoi(optarg);
+            }
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 remote_addr[remote_num].host = optarg;
@@ -728,26 +757,19 @@ int main(int argc, char **argv)
     LOGI("initialize ciphers... %s", method);
     int m = enc_init(password, method);
 
+    struct ev_loop *loop = EV_DEFAULT;
+
+    // Setup the resolver for server names
+    resolv_init(loop, NULL, 0);
+
     // Setup proxy context
     struct listen_ctx listen_ctx;
     listen_ctx.remote_num = remote_num;
-    listen_ctx.remote_addr = malloc(sizeof(struct sockaddr *) * remote_num);
-    for (int i = 0; i < remote_num; i++) {
-        char *host = remote_addr[i].host;
-        char *port = remote_addr[i].port == NULL ? remote_port :
-                     remote_addr[i].port;
-        struct sockaddr_storage *storage = malloc(sizeof(struct sockaddr_storage));
-        memset(storage, 0, sizeof(struct sockaddr_storage));
-        if (get_sockaddr(host, port, storage, 1) == -1) {
-            FATAL("failed to resolve the provided hostname");
-        }
-        listen_ctx.remote_addr[i] = (struct sockaddr *)storage;
-    }
+    listen_ctx.remote_addr = resolve_remote_addrs(loop, remote_addr,
+                                                  remote_port, remote_num);
     listen_ctx.timeout = atoi(timeout);
     listen_ctx.method = m;
 
-    struct ev_loop *loop = EV_DEFAULT;
-
     if (mode != UDP_ONLY) {
         // Setup socket
         int listenfd;
@@ -759,6 +781,7 @@ int main(int argc, char **argv)
             FATAL("listen() error");
         }
         setnonblocking(listenfd);
+        set_listen_early_data(listenfd, fast_open_queue, defer_accept);
 
         listen_ctx.fd = listenfd;
 
@@ -770,7 +793,10 @@ int main(int argc, char **argv)
     if (mode != TCP_ONLY) {
         LOGI("UDP relay enabled");
         init_udprelay(local_addr, local_port, listen_ctx.remote_addr[0],
-                      get_sockaddr_len(listen_ctx.remote_addr[0]), m, listen_ctx.timeout, NULL);
+                      udp_over_tcp, m, listen_ctx.timeout, NULL);
+        if (udp_over_tcp) {
+            LOGI("UDP relayed over TCP");
+        }
     }
 
     if (mode == UDP_ONLY) {
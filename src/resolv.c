@@ -55,11 +55,13 @@
 
 struct ResolvQuery {
     void (*client_cb)(struct sockaddr *, void *);
+    void (*client_ttl_cb)(struct sockaddr *, uint32_t, void *);
     void (*client_free_cb)(void *);
     void *client_cb_data;
     struct dns_query *queries[2];
     size_t response_count;
     struct sockaddr **responses;
+    uint32_t ttl; // lowest TTL of the answers
     uint16_t port;
 };
 
@@ -128,11 +130,47 @@ resolv_init(struct ev_loop *loop, char **nameservers, int nameserver_num)
     return sockfd;
 }
 
+/*
+ * Send each query to the given number of best ranked nameservers at once
+ */
+int
+resolv_set_parallel(int num)
+{
+    struct dns_ctx *ctx = (struct dns_ctx *)resolv_io_watcher.data;
+
+    return dns_set_opt(ctx, DNS_OPT_PARALLEL, num) < 0 ? -1 : 0;
+}
+
+static void
+resolv_log_stats(struct dns_ctx *ctx)
+{
+    struct dns_serv_stat st;
+    const struct sockaddr *sa;
+    char host[INET6_ADDRSTRLEN];
+
+    for (unsigned i = 0; (sa = dns_serv_stat(ctx, i, &st)) != NULL; i++) {
+        if (sa->sa_family == AF_INET6) {
+            dns_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr,
+                     host, INET6_ADDRSTRLEN);
+        } else {
+            dns_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr,
+                     host, INET_ADDRSTRLEN);
+        }
+        LOGI("nameserver %s: %u queries, %u replies, %u failures, "
+             "srtt %u ms", host, st.dnss_queries, st.dnss_replies,
+             st.dnss_failures, st.dnss_srtt);
+    }
+}
+
 void
 resolv_shutdown(struct ev_loop * loop)
 {
     struct dns_ctx *ctx = (struct dns_ctx *)resolv_io_watcher.data;
 
+    if (verbose) {
+        resolv_log_stats(ctx);
+    }
+
     ev_io_stop(loop, &resolv_io_watcher);
 
     if (ev_is_active(&resolv_timeout_watcher)) {
@@ -142,8 +180,9 @@ resolv_shutdown(struct ev_loop * loop)
     dns_close(ctx);
 }
 
-struct ResolvQuery *
-resolv_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
+static struct ResolvQuery *
+submit_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
+             void (*client_ttl_cb)(struct sockaddr *, uint32_t, void *),
              void (*client_free_cb)(void *), void *client_cb_data,
              uint16_t port)
 {
@@ -158,11 +197,13 @@ resolv_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
         return NULL;
     }
     cb_data->client_cb = client_cb;
+    cb_data->client_ttl_cb = client_ttl_cb;
     cb_data->client_free_cb = client_free_cb;
     cb_data->client_cb_data = client_cb_data;
     memset(cb_data->queries, 0, sizeof(cb_data->queries));
     cb_data->response_count = 0;
     cb_data->responses = NULL;
+    cb_data->ttl = UINT32_MAX;
     cb_data->port = port;
 
     /* Submit A and AAAA queries */
@@ -198,6 +239,29 @@ resolv_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
     return cb_data;
 }
 
+struct ResolvQuery *
+resolv_query(const char *hostname, void (*client_cb)(struct sockaddr *, void *),
+             void (*client_free_cb)(void *), void *client_cb_data,
+             uint16_t port)
+{
+    return submit_query(hostname, client_cb, NULL, client_free_cb,
+                        client_cb_data, port);
+}
+
+/*
+ * Same as resolv_query(), but also hand the lowest TTL of the answers
+ * to the callback
+ */
+struct ResolvQuery *
+resolv_query_ttl(const char *hostname,
+                 void (*client_cb)(struct sockaddr *, uint32_t, void *),
+                 void (*client_free_cb)(void *), void *client_cb_data,
+                 uint16_t port)
+{
+    return submit_query(hostname, NULL, client_cb, client_free_cb,
+                        client_cb_data, port);
+}
+
 void
 resolv_cancel(struct ResolvQuery *query_handle)
 {
@@ -254,6 +318,9 @@ dns_query_v4_cb(struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data)
             LOGE("Failed to allocate memory for additional DNS responses");
         } else {
             cb_data->responses = new_responses;
+            if (result->dnsa4_ttl < cb_data->ttl) {
+                cb_data->ttl = result->dnsa4_ttl;
+            }
 
             for (int i = 0; i < result->dnsa4_nrr; i++) {
                 struct sockaddr_in *sa =
@@ -301,6 +368,9 @@ dns_query_v6_cb(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data)
             LOGE("Failed to allocate memory for additional DNS responses");
         } else {
             cb_data->responses = new_responses;
+            if (result->dnsa6_ttl < cb_data->ttl) {
+                cb_data->ttl = result->dnsa6_ttl;
+            }
 
             for (int i = 0; i < result->dnsa6_nrr; i++) {
                 struct sockaddr_in6 *sa =
@@ -346,7 +416,12 @@ process_client_callback(struct ResolvQuery *cb_data)
         best_address = choose_any(cb_data);
     }
 
-    cb_data->client_cb(best_address, cb_data->client_cb_data);
+    if (cb_data->client_ttl_cb != NULL) {
+        cb_data->client_ttl_cb(best_address, cb_data->ttl,
+                               cb_data->client_cb_data);
+    } else {
+        cb_data->client_cb(best_address, cb_data->client_cb_data);
+    }
 
     for (int i = 0; i < cb_data->response_count; i++) {
         free(cb_data->responses[i]);
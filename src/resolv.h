@@ -44,7 +44,11 @@ int resolv_init(struct ev_loop *, char **, int);
 struct ResolvQuery *resolv_query(const char *, void (*)(struct sockaddr *,
                                                         void *), void (*)(
                                      void *), void *, uint16_t);
+struct ResolvQuery *resolv_query_ttl(const char *, void (*)(struct sockaddr *,
+                                                            uint32_t, void *),
+                                     void (*)(void *), void *, uint16_t);
 void resolv_cancel(struct ResolvQuery *);
+int resolv_set_parallel(int);
 void resolv_shutdown(struct ev_loop *);
 
 #endif
@@ -44,6 +44,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #endif
 
@@ -63,6 +64,12 @@
 #include "netutils.h"
 #include "utils.h"
 #include "acl.h"
+#include "accesslog.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "mux.h"
+#include "uring.h"
+#include "handoff.h"
 #include "server.h"
 
 #ifndef EAGAIN
@@ -85,16 +92,48 @@
 #define UPDATE_INTERVAL 30
 #endif
 
+#ifndef MAX_PENDING
+#define MAX_PENDING 4
+#endif
+
+#ifndef MAX_PENDING_LIMIT
+#define MAX_PENDING_LIMIT 64
+#endif
+
+#ifndef ACCEPT_BATCH
+#define ACCEPT_BATCH 16
+#endif
+
+// seconds sessions may take to close after a handoff
+#ifndef DRAIN_TIMEOUT
+#define DRAIN_TIMEOUT 60
+#endif
+
+// TCP Fast Open queue of the listeners with --fast-open
+#ifndef FAST_OPEN_QUEUE
+#define FAST_OPEN_QUEUE 5
+#endif
+
+#define PAUSED_CLIENT 1
+#define PAUSED_REMOTE 2
+
 static void signal_cb(EV_P_ ev_signal *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
+static void accept_resume_cb(EV_P_ ev_timer *watcher, int revents);
 static void server_send_cb(EV_P_ ev_io *w, int revents);
 static void server_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_send_cb(EV_P_ ev_io *w, int revents);
 static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+static void uring_accept_cb(EV_P_ int fd, void *data);
+static void handoff_cb(EV_P);
+static void drain_cb(EV_P_ ev_timer *watcher, int revents);
+static void uring_close_cb(EV_P_ void *data, const char *reason,
+                           uint64_t up, uint64_t down);
 
 static struct remote * new_remote(int fd);
-static struct server * new_server(int fd, struct listen_ctx *listener);
+static struct server * new_server(int fd, struct listen_ctx *listener,
+                                  const struct sockaddr_storage *peer);
 static struct remote *connect_to_remote(struct addrinfo *res,
                                         struct server *server);
 
@@ -102,6 +141,8 @@ static void free_remote(struct remote *remote);
 static void close_and_free_remote(EV_P_ struct remote *remote);
 static void free_server(struct server *server);
 static void close_and_free_server(EV_P_ struct server *server);
+static void resume_accept(EV_P);
+static void log_session(EV_P_ struct server *server);
 
 static void server_resolve_cb(struct sockaddr *addr, void *data);
 
@@ -111,11 +152,36 @@ static int acl = 0;
 static int mode = TCP_ONLY;
 
 static int fast_open = 0;
+static int fast_open_queue = 0;
+static int defer_accept = 0;
+static struct sockopt_profile client_sockopt;
+static struct sockopt_profile remote_sockopt;
+static int mux = 0;
+static int io_uring = 0;
+static int max_pending = MAX_PENDING;
 #ifdef HAVE_SETRLIMIT
 static int nofile = 0;
 #endif
 static int remote_conn = 0;
-static int server_conn = 0;
+
+static struct buf_pool buf_pool = BUF_POOL_INIT(BUF_SIZE);
+
+// admission control, 0 for no limit
+static int max_sessions = 0;
+static double max_accept_rate = 0;
+static double accept_tokens = 0;
+static ev_tstamp accept_refill = 0;
+static int accept_paused = 0;
+static ev_timer accept_resume_watcher;
+
+// graceful restart, see handoff.h
+static char *handoff_path = NULL;
+static int drain_timeout = DRAIN_TIMEOUT;
+static int draining = 0;
+static ev_tstamp drain_deadline = 0;
+static ev_timer drain_watcher;
+static struct listen_ctx *listeners = NULL;
+static int listener_num = 0;
 
 static char *server_port = NULL;
 static char *manager_address = NULL;
@@ -124,6 +190,8 @@ uint64_t rx = 0;
 ev_timer stat_update_watcher;
 
 static struct cork_dllist connections;
+static struct cork_dllist paused_sessions;
+static ev_check budget_watcher;
 
 static void stat_update_cb(EV_P_ ev_timer *watcher, int revents)
 {
@@ -204,11 +272,14 @@ static void stat_update_cb(EV_P_ ev_timer *watcher, int revents)
 static void free_connections(struct ev_loop *loop)
 {
     struct cork_dllist_item *curr;
+    struct cork_dllist_item *next;
     for (curr = cork_dllist_start(&connections);
          !cork_dllist_is_end(&connections, curr);
-         curr = curr->next) {
+         curr = next) {
         struct server *server = cork_container_of(curr, struct server, entries);
         struct remote *remote = server->remote;
+        next = curr->next;
+        server->close_reason = "shutdown";
         close_and_free_server(loop, server);
         close_and_free_remote(loop, remote);
     }
@@ -219,6 +290,7 @@ static void report_addr(int fd)
     struct sockaddr_storage addr;
     socklen_t len = sizeof addr;
     memset(&addr, 0, len);
+    metrics.handshake_failures++;
     int err = getpeername(fd, (struct sockaddr *)&addr, &len);
     if (err == 0) {
         char peer_name[INET6_ADDRSTRLEN] = { 0 };
@@ -320,20 +392,6 @@ int create_and_bind(const char *host, const char *port)
 #ifdef SO_NOSIGPIPE
         setsockopt(listen_sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
-#ifdef TCP_FASTOPEN
-        if (fast_open) {
-            opt = 5;
-            int r = setsockopt(listen_sock, IPPROTO_TCP, TCP_FASTOPEN, &opt,
-                               sizeof(opt));
-            if (r == -1) {
-                if (errno == EPROTONOSUPPORT || errno == ENOPROTOOPT) {
-                    LOGE("fast open is not supported on this platform");
-                } else {
-                    ERROR("setsockopt");
-                }
-            }
-        }
-#endif
 
         s = bind(listen_sock, rp->ai_addr, rp->ai_addrlen);
         if (s == 0) {
@@ -356,6 +414,218 @@ int create_and_bind(const char *host, const char *port)
     return listen_sock;
 }
 
+/*
+ * Hand the len bytes at idx of *buf over to the pending queue. The
+ * receiving side attaches a fresh buffer on its next read, so that it can
+ * keep reading while the queue drains.
+ */
+static void relay_queue(struct cork_ring_buffer *pending, char **buf,
+                        ssize_t idx, ssize_t len)
+{
+    struct relay_chunk *chunk = malloc(sizeof(struct relay_chunk));
+    chunk->buf = *buf;
+    chunk->idx = idx;
+    chunk->len = len;
+    cork_ring_buffer_add(pending, chunk);
+    *buf = NULL;
+}
+
+/*
+ * Send the len bytes just received into *buf, or queue them behind the data
+ * still pending for this socket. Either way *buf is left detached. Returns
+ * -1 on a fatal send error.
+ */
+static int relay_send(int fd, struct cork_ring_buffer *pending, char **buf,
+                      ssize_t len)
+{
+    ssize_t s = 0;
+
+    if (cork_ring_buffer_is_empty(pending)) {
+        s = send(fd, *buf, len, 0);
+        if (s == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            s = 0;
+        }
+    }
+
+    if (s < len) {
+        relay_queue(pending, buf, s, len - s);
+    } else {
+        buf_release(&buf_pool, buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Write out as much of the pending queue as the socket takes with a single
+ * writev(). Returns -1 on a fatal send error.
+ */
+static int relay_flush(int fd, struct cork_ring_buffer *pending)
+{
+    size_t i, n = pending->size;
+    struct iovec iov[n];
+
+    for (i = 0; i < n; i++) {
+        size_t index = (pending->read_index + i) % pending->allocated_size;
+        struct relay_chunk *chunk = pending->elements[index];
+        iov[i].iov_base = chunk->buf + chunk->idx;
+        iov[i].iov_len = chunk->len;
+    }
+
+    ssize_t s = writev(fd, iov, n);
+    if (s == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+
+    while (s > 0) {
+        struct relay_chunk *chunk = cork_ring_buffer_peek(pending);
+        if (s < chunk->len) {
+            // partly sent, wait for the next time to send
+            chunk->idx += s;
+            chunk->len -= s;
+            break;
+        }
+        s -= chunk->len;
+        cork_ring_buffer_pop(pending);
+        buf_pool_put(&buf_pool, chunk->buf);
+        free(chunk);
+    }
+
+    return 0;
+}
+
+/*
+ * Stop reading on one side of a session while the memory budget is used
+ * up. Queued data keeps draining, and budget_cb resumes reading once
+ * enough of it is gone. Returns 1 if the side was paused.
+ */
+static int relay_throttled(EV_P_ struct server *server, ev_io *watcher,
+                           int side)
+{
+    if (!buf_budget_exhausted()) {
+        return 0;
+    }
+
+    ev_io_stop(EV_A_ watcher);
+    if (!server->paused) {
+        cork_dllist_add(&paused_sessions, &server->paused_entries);
+    }
+    server->paused |= side;
+
+    if (!ev_is_active(&budget_watcher)) {
+        LOGE("memory budget used up, %zu bytes in use, pausing reads",
+             buf_used);
+        ev_check_start(EV_A_ & budget_watcher);
+    }
+
+    return 1;
+}
+
+static void budget_cb(EV_P_ ev_check *watcher, int revents)
+{
+    struct cork_dllist_item *curr, *next;
+
+    if (!buf_budget_relieved()) {
+        return;
+    }
+
+    for (curr = cork_dllist_start(&paused_sessions);
+         !cork_dllist_is_end(&paused_sessions, curr);
+         curr = next) {
+        struct server *server = cork_container_of(curr, struct server,
+                                                  paused_entries);
+        struct remote *remote = server->remote;
+        next = curr->next;
+
+        // unless the relay itself stopped reading meanwhile
+        if ((server->paused & PAUSED_CLIENT)
+            && (server->stage == 0
+                || (server->stage == 5 && remote != NULL && !server->eof
+                    && !cork_ring_buffer_is_full(&remote->pending)))) {
+            ev_io_start(EV_A_ & server->recv_ctx->io);
+        }
+        if ((server->paused & PAUSED_REMOTE) && remote != NULL
+            && !remote->eof && !cork_ring_buffer_is_full(&server->pending)) {
+            ev_io_start(EV_A_ & remote->recv_ctx->io);
+        }
+        server->paused = 0;
+        cork_dllist_remove(curr);
+    }
+
+    ev_check_stop(EV_A_ watcher);
+    LOGI("memory budget relieved, %zu bytes in use, resuming reads",
+         buf_used);
+}
+
+/*
+ * Hand an established session over to the io_uring engine once nothing is
+ * queued on either side, its watchers stay stopped from then on. Returns 1
+ * if the engine took it.
+ */
+static int relay_to_uring(EV_P_ struct server *server)
+{
+    struct remote *remote = server->remote;
+
+    if (!io_uring || server->eof || remote->eof
+        || !cork_ring_buffer_is_empty(&server->pending)
+        || !cork_ring_buffer_is_empty(&remote->pending)) {
+        return 0;
+    }
+
+    server->relay = uring_relay(EV_A_ server->fd, remote->fd,
+                                server->e_ctx, server->d_ctx,
+                                remote->pending.allocated_size,
+                                server->pending.allocated_size,
+                                server->listen_ctx->timeout, server);
+    if (server->relay == NULL) {
+        return 0;
+    }
+
+    ev_io_stop(EV_A_ & server->recv_ctx->io);
+    ev_io_stop(EV_A_ & server->send_ctx->io);
+    ev_io_stop(EV_A_ & remote->recv_ctx->io);
+    ev_io_stop(EV_A_ & remote->send_ctx->io);
+    ev_timer_stop(EV_A_ & server->recv_ctx->watcher);
+    buf_release(&buf_pool, &server->buf);
+    buf_release(&buf_pool, &remote->buf);
+    if (server->paused) {
+        cork_dllist_remove(&server->paused_entries);
+        server->paused = 0;
+    }
+
+    return 1;
+}
+
+static void uring_close_cb(EV_P_ void *data, const char *reason,
+                           uint64_t up, uint64_t down)
+{
+    struct server *server = data;
+    struct remote *remote = server->remote;
+
+    server->relay         = NULL;
+    server->up           += up;
+    server->down         += down;
+    server->close_reason  = reason;
+    close_and_free_remote(EV_A_ remote);
+    close_and_free_server(EV_A_ server);
+}
+
+static void relay_free(struct cork_ring_buffer *pending)
+{
+    struct relay_chunk *chunk;
+    while ((chunk = cork_ring_buffer_pop(pending)) != NULL) {
+        buf_pool_put(&buf_pool, chunk->buf);
+        free(chunk);
+    }
+    cork_ring_buffer_done(pending);
+}
+
 static struct remote *connect_to_remote(struct addrinfo *res,
                                         struct server *server)
 {
@@ -377,8 +647,10 @@ static struct remote *connect_to_remote(struct addrinfo *res,
 #ifdef SO_NOSIGPIPE
     setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+    set_sockopt_profile(sockfd, &remote_sockopt);
 
     struct remote *remote = new_remote(sockfd);
+    server->connect_start = ev_now(server->listen_ctx->loop);
 
     // setup remote socks
     setnonblocking(sockfd);
@@ -438,13 +710,27 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         len = 0;
     }
 
-    ssize_t r = recv(server->fd, *buf + len, BUF_SIZE - len, 0);
+    if (*buf == NULL
+        && relay_throttled(EV_A_ server, &server_recv_ctx->io, PAUSED_CLIENT)) {
+        return;
+    }
+
+    ssize_t r = recv(server->fd, buf_attach(&buf_pool, buf) + len,
+                     BUF_SIZE - len, 0);
 
     if (r == 0) {
         // connection closed
+        if (remote != NULL && !cork_ring_buffer_is_empty(&remote->pending)) {
+            // deliver what is still queued for the remote first
+            server->eof = 1;
+            buf_release(&buf_pool, buf);
+            ev_io_stop(EV_A_ & server_recv_ctx->io);
+            return;
+        }
         if (verbose) {
             LOGI("server_recv close the connection");
         }
+        server->close_reason = "client_closed";
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -452,9 +738,13 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            if (len == 0) {
+                buf_release(&buf_pool, buf);
+            }
             return;
         } else {
             ERROR("server recv");
+            server->close_reason = "client_error";
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -462,6 +752,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     tx += r;
+    server->up += r;
 
     // handle incomplete header
     if (server->stage == 0) {
@@ -485,8 +776,10 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     *buf = ss_decrypt(BUF_SIZE, *buf, &r, server->d_ctx);
 
     if (*buf == NULL) {
+        buf_pool_drop(&buf_pool);
         LOGE("invalid password or cipher");
         report_addr(server->fd);
+        server->close_reason = "bad_cipher";
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -494,24 +787,19 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 
     // handshake and transmit data
     if (server->stage == 5) {
-        int s = send(remote->fd, remote->buf, r, 0);
-        if (s == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // no data, wait for send
-                remote->buf_len = r;
-                remote->buf_idx = 0;
+        if (relay_send(remote->fd, &remote->pending, &remote->buf, r) == -1) {
+            ERROR("server_recv_send");
+            server->close_reason = "remote_error";
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+            return;
+        }
+        if (!cork_ring_buffer_is_empty(&remote->pending)) {
+            // keep reading ahead until the high-water mark is reached
+            ev_io_start(EV_A_ & remote->send_ctx->io);
+            if (cork_ring_buffer_is_full(&remote->pending)) {
                 ev_io_stop(EV_A_ & server_recv_ctx->io);
-                ev_io_start(EV_A_ & remote->send_ctx->io);
-            } else {
-                ERROR("server_recv_send");
-                close_and_free_remote(EV_A_ remote);
-                close_and_free_server(EV_A_ server);
             }
-        } else if (s < r) {
-            remote->buf_len = r - s;
-            remote->buf_idx = s;
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
         }
         return;
 
@@ -530,6 +818,31 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         int offset = 0;
         int need_query = 0;
         char atyp = server->buf[offset++];
+
+        if (mux && atyp == MUX_ADDRTYPE) {
+            // the connection carries a tunnel of streams from now on
+            mux_accept(EV_A_ server->fd, server->e_ctx, server->d_ctx,
+                       server->buf + offset, r - offset, server->listen_ctx);
+            server->e_ctx  = NULL;
+            server->d_ctx  = NULL;
+            server->fd     = -1;
+            server->logged = 0;
+            close_and_free_server(EV_A_ server);
+            return;
+        }
+
+        if (mode == TCP_AND_UDP && atyp == UOT_ADDRTYPE) {
+            // the connection carries UDP datagrams from now on
+            udprelay_accept(EV_A_ server->fd, server->e_ctx, server->d_ctx,
+                            server->buf + offset, r - offset);
+            server->e_ctx  = NULL;
+            server->d_ctx  = NULL;
+            server->fd     = -1;
+            server->logged = 0;
+            close_and_free_server(EV_A_ server);
+            return;
+        }
+
         char host[256] = { 0 };
         uint16_t port = 0;
         struct addrinfo info;
@@ -551,6 +864,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             } else {
                 LOGE("invalid header with addr type %d", atyp);
                 report_addr(server->fd);
+                server->close_reason = "bad_header";
                 close_and_free_server(EV_A_ server);
                 return;
             }
@@ -569,6 +883,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             } else {
                 LOGE("invalid name length: %d", name_len);
                 report_addr(server->fd);
+                server->close_reason = "bad_header";
                 close_and_free_server(EV_A_ server);
                 return;
             }
@@ -594,6 +909,14 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                     info.ai_addr = (struct sockaddr *)addr;
                 }
             } else {
+                if (acl && acl_contains_domain(host, name_len)) {
+                    if (verbose) {
+                        LOGI("Access denied to %s", host);
+                    }
+                    server->close_reason = "acl";
+                    close_and_free_server(EV_A_ server);
+                    return;
+                }
                 need_query = 1;
             }
         } else if (atyp == 4) {
@@ -609,6 +932,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             } else {
                 LOGE("invalid header with addr type %d", atyp);
                 report_addr(server->fd);
+                server->close_reason = "bad_header";
                 close_and_free_server(EV_A_ server);
                 return;
             }
@@ -623,6 +947,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         if (offset == 1) {
             LOGE("invalid header with addr type %d", atyp);
             report_addr(server->fd);
+            server->close_reason = "bad_header";
             close_and_free_server(EV_A_ server);
             return;
         }
@@ -631,6 +956,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             if (verbose) {
                 LOGI("Access denied to %s", host);
             }
+            server->close_reason = "acl";
             close_and_free_server(EV_A_ server);
             return;
         }
@@ -643,10 +969,17 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             LOGI("connect to: %s:%d", host, ntohs(port));
         }
 
+        if (server->logged) {
+            server->target      = strdup(host);
+            server->target_port = ntohs(port);
+        }
+
         // XXX: should handle buffer carefully
         if (r > offset) {
             server->buf_len = r - offset;
             server->buf_idx = offset;
+        } else {
+            buf_release(&buf_pool, &server->buf);
         }
 
         if (!need_query) {
@@ -654,18 +987,17 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 
             if (remote == NULL) {
                 LOGE("connect error");
+                server->close_reason = "connect_failed";
                 close_and_free_server(EV_A_ server);
                 return;
             } else {
                 server->remote = remote;
                 remote->server = server;
 
-                // XXX: should handle buffer carefully
+                // hand the header buffer over as is, payload follows the header
                 if (server->buf_len > 0) {
-                    memcpy(remote->buf, server->buf + server->buf_idx,
-                           server->buf_len);
-                    remote->buf_len = server->buf_len;
-                    remote->buf_idx = 0;
+                    relay_queue(&remote->pending, &server->buf, server->buf_idx,
+                                server->buf_len);
                     server->buf_len = 0;
                     server->buf_idx = 0;
                 }
@@ -678,6 +1010,8 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             }
         } else {
             server->stage = 4;
+            server->resolve_start = ev_now(EV_A);
+            metrics.dns_queries++;
             server->query = resolv_query(host, server_resolve_cb, NULL, server,
                                          port);
 
@@ -702,45 +1036,38 @@ static void server_send_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
-    if (server->buf_len == 0) {
+    if (cork_ring_buffer_is_empty(&server->pending)) {
         // close and free
         if (verbose) {
             LOGI("server_send close the connection");
         }
+        server->close_reason = "remote_closed";
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
     } else {
         // has data to send
-        ssize_t s = send(server->fd, server->buf + server->buf_idx,
-                         server->buf_len, 0);
-        if (s < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                ERROR("server_send_send");
-                close_and_free_remote(EV_A_ remote);
-                close_and_free_server(EV_A_ server);
-            }
-            return;
-        } else if (s < server->buf_len) {
-            // partly sent, move memory, wait for the next time to send
-            server->buf_len -= s;
-            server->buf_idx += s;
+        if (relay_flush(server->fd, &server->pending) == -1) {
+            ERROR("server_send_send");
+            server->close_reason = "client_error";
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
             return;
-        } else {
+        }
+        if (cork_ring_buffer_is_empty(&server->pending)) {
             // all sent out, wait for reading
-            server->buf_len = 0;
-            server->buf_idx = 0;
             ev_io_stop(EV_A_ & server_send_ctx->io);
-            if (remote != NULL) {
-                ev_io_start(EV_A_ & remote->recv_ctx->io);
-                return;
-            } else {
-                LOGE("invalid remote");
+            if (remote->eof) {
+                server->close_reason = "remote_closed";
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
                 return;
             }
         }
+        if (!remote->eof && !cork_ring_buffer_is_full(&server->pending)) {
+            // below the high-water mark, resume reading
+            ev_io_start(EV_A_ & remote->recv_ctx->io);
+        }
     }
 }
 
@@ -755,6 +1082,7 @@ static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents)
         LOGI("TCP connection timeout");
     }
 
+    server->close_reason = "timeout";
     close_and_free_remote(EV_A_ remote);
     close_and_free_server(EV_A_ server);
 }
@@ -765,9 +1093,13 @@ static void server_resolve_cb(struct sockaddr *addr, void *data)
     struct ev_loop *loop = server->listen_ctx->loop;
 
     server->query = NULL;
+    server->resolve_time = ev_now(EV_A) - server->resolve_start;
+    metrics_observe(&metrics.dns_latency, server->resolve_time);
 
     if (addr == NULL) {
         LOGE("unable to resolve");
+        metrics.dns_failures++;
+        server->close_reason = "resolve_failed";
         close_and_free_server(EV_A_ server);
     } else {
         if (verbose) {
@@ -788,6 +1120,7 @@ static void server_resolve_cb(struct sockaddr *addr, void *data)
                 if (verbose) {
                     LOGI("Access denied to %s", host);
                 }
+                server->close_reason = "acl";
                 close_and_free_server(EV_A_ server);
                 return;
             }
@@ -811,17 +1144,16 @@ static void server_resolve_cb(struct sockaddr *addr, void *data)
 
         if (remote == NULL) {
             LOGE("connect error");
+            server->close_reason = "connect_failed";
             close_and_free_server(EV_A_ server);
         } else {
             server->remote = remote;
             remote->server = server;
 
-            // XXX: should handle buffer carefully
+            // hand the header buffer over as is, payload follows the header
             if (server->buf_len > 0) {
-                memcpy(remote->buf, server->buf + server->buf_idx,
-                       server->buf_len);
-                remote->buf_len = server->buf_len;
-                remote->buf_idx = 0;
+                relay_queue(&remote->pending, &server->buf, server->buf_idx,
+                            server->buf_len);
                 server->buf_len = 0;
                 server->buf_idx = 0;
             }
@@ -832,6 +1164,155 @@ static void server_resolve_cb(struct sockaddr *addr, void *data)
     }
 }
 
+/*
+ * Streams of a tunnel reach their targets like sessions do, with the same
+ * access control, but without a session of their own.
+ */
+static void mux_connect_remote(EV_P_ struct mux_stream *stream,
+                               struct sockaddr *addr)
+{
+    if (acl) {
+        const void *ip = NULL;
+        int denied     = 0;
+        if (addr->sa_family == AF_INET) {
+            struct sockaddr_in *s = (struct sockaddr_in *)addr;
+            ip     = &s->sin_addr;
+            denied = acl_contains_ipv4(&s->sin_addr);
+        } else if (addr->sa_family == AF_INET6) {
+            struct sockaddr_in6 *s = (struct sockaddr_in6 *)addr;
+            ip     = &s->sin6_addr;
+            denied = acl_contains_ipv6(&s->sin6_addr);
+        }
+
+        if (denied) {
+            if (verbose) {
+                char host[INET6_ADDRSTRLEN];
+                dns_ntop(addr->sa_family, ip, host, INET6_ADDRSTRLEN);
+                LOGI("Access denied to %s", host);
+            }
+            mux_stream_reset(EV_A_ stream);
+            return;
+        }
+    }
+
+    int fd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        ERROR("socket");
+        mux_stream_reset(EV_A_ stream);
+        return;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+    set_sockopt_profile(fd, &remote_sockopt);
+    setnonblocking(fd);
+#ifdef SET_INTERFACE
+    struct listen_ctx *listener = (struct listen_ctx *)stream->tunnel->data;
+    if (listener->iface) {
+        setinterface(fd, listener->iface);
+    }
+#endif
+
+    connect(fd, addr, get_sockaddr_len(addr));
+    mux_stream_connect(EV_A_ stream, fd);
+}
+
+static void mux_resolve_cb(struct sockaddr *addr, void *data)
+{
+    struct mux_stream *stream = (struct mux_stream *)data;
+    struct ev_loop *loop = stream->tunnel->loop;
+
+    stream->query = NULL;
+    metrics_observe(&metrics.dns_latency, ev_now(EV_A) - stream->start);
+
+    if (addr == NULL) {
+        LOGE("unable to resolve");
+        metrics.dns_failures++;
+        mux_stream_reset(EV_A_ stream);
+        return;
+    }
+
+    mux_connect_remote(EV_A_ stream, addr);
+}
+
+/*
+ * A stream was opened through a tunnel, header is its address header
+ */
+static void mux_open_cb(EV_P_ struct mux_stream *stream, const char *header,
+                        int len)
+{
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(struct sockaddr_storage));
+
+    char atyp = len > 0 ? header[0] : 0;
+
+    if (atyp == 1 && len >= 1 + 4 + 2) {
+        // IP V4
+        struct sockaddr_in *addr = (struct sockaddr_in *)&storage;
+        addr->sin_family = AF_INET;
+        memcpy(&addr->sin_addr, header + 1, 4);
+        memcpy(&addr->sin_port, header + 1 + 4, 2);
+    } else if (atyp == 4 && len >= 1 + 16 + 2) {
+        // IP V6
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&storage;
+        addr->sin6_family = AF_INET6;
+        memcpy(&addr->sin6_addr, header + 1, 16);
+        memcpy(&addr->sin6_port, header + 1 + 16, 2);
+    } else if (atyp == 3 && len >= 2 && header[1] != 0
+               && len >= 2 + (uint8_t)header[1] + 2) {
+        // Domain name
+        uint8_t name_len = header[1];
+        char host[256];
+        uint16_t port;
+        memcpy(host, header + 2, name_len);
+        host[name_len] = '\0';
+        memcpy(&port, header + 2 + name_len, 2);
+
+        struct cork_ip ip;
+        if (cork_ip_init(&ip, host) != -1) {
+            if (ip.version == 4) {
+                struct sockaddr_in *addr = (struct sockaddr_in *)&storage;
+                dns_pton(AF_INET, host, &(addr->sin_addr));
+                addr->sin_port = port;
+                addr->sin_family = AF_INET;
+            } else {
+                struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&storage;
+                dns_pton(AF_INET6, host, &(addr->sin6_addr));
+                addr->sin6_port = port;
+                addr->sin6_family = AF_INET6;
+            }
+        } else {
+            if (acl && acl_contains_domain(host, name_len)) {
+                if (verbose) {
+                    LOGI("Access denied to %s", host);
+                }
+                mux_stream_reset(EV_A_ stream);
+                return;
+            }
+
+            if (verbose) {
+                LOGI("connect to: %s:%d", host, ntohs(port));
+            }
+
+            stream->start = ev_now(EV_A);
+            metrics.dns_queries++;
+            stream->query = resolv_query(host, mux_resolve_cb, NULL, stream,
+                                         port);
+            return;
+        }
+    } else {
+        LOGE("invalid header with addr type %d", atyp);
+        metrics.handshake_failures++;
+        mux_stream_reset(EV_A_ stream);
+        return;
+    }
+
+    mux_connect_remote(EV_A_ stream, (struct sockaddr *)&storage);
+}
+
 static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 {
     struct remote_ctx *remote_recv_ctx = (struct remote_ctx *)w;
@@ -846,13 +1327,27 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-    ssize_t r = recv(remote->fd, server->buf, BUF_SIZE, 0);
+    if (server->buf == NULL
+        && relay_throttled(EV_A_ server, &remote_recv_ctx->io, PAUSED_REMOTE)) {
+        return;
+    }
+
+    ssize_t r = recv(remote->fd, buf_attach(&buf_pool, &server->buf),
+                     BUF_SIZE, 0);
 
     if (r == 0) {
         // connection closed
+        if (!cork_ring_buffer_is_empty(&server->pending)) {
+            // deliver what is still queued for the client first
+            remote->eof = 1;
+            buf_release(&buf_pool, &server->buf);
+            ev_io_stop(EV_A_ & remote_recv_ctx->io);
+            return;
+        }
         if (verbose) {
             LOGI("remote_recv close the connection");
         }
+        server->close_reason = "remote_closed";
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -860,9 +1355,11 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            buf_release(&buf_pool, &server->buf);
             return;
         } else {
             ERROR("remote recv");
+            server->close_reason = "remote_error";
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -870,37 +1367,32 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     rx += r;
+    server->down += r;
 
     server->buf = ss_encrypt(BUF_SIZE, server->buf, &r, server->e_ctx);
 
     if (server->buf == NULL) {
+        buf_pool_drop(&buf_pool);
         LOGE("invalid password or cipher");
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
     }
 
-    int s = send(server->fd, server->buf, r, 0);
+    if (relay_send(server->fd, &server->pending, &server->buf, r) == -1) {
+        ERROR("remote_recv_send");
+        server->close_reason = "client_error";
+        close_and_free_remote(EV_A_ remote);
+        close_and_free_server(EV_A_ server);
+        return;
+    }
 
-    if (s == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // no data, wait for send
-            server->buf_len = r;
-            server->buf_idx = 0;
+    if (!cork_ring_buffer_is_empty(&server->pending)) {
+        // keep reading ahead until the high-water mark is reached
+        ev_io_start(EV_A_ & server->send_ctx->io);
+        if (cork_ring_buffer_is_full(&server->pending)) {
             ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
-        } else {
-            ERROR("remote_recv_send");
-            close_and_free_remote(EV_A_ remote);
-            close_and_free_server(EV_A_ server);
         }
-        return;
-    } else if (s < r) {
-        server->buf_len = r - s;
-        server->buf_idx = s;
-        ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
-        return;
     }
 }
 
@@ -927,9 +1419,14 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
                 LOGI("remote connected");
             }
             remote_send_ctx->connected = 1;
+            server->connect_time = ev_now(EV_A) - server->connect_start;
+            metrics_observe(&metrics.connect_latency, server->connect_time);
 
-            if (remote->buf_len == 0) {
+            if (cork_ring_buffer_is_empty(&remote->pending)) {
                 server->stage = 5;
+                if (relay_to_uring(EV_A_ server)) {
+                    return;
+                }
                 ev_io_stop(EV_A_ & remote_send_ctx->io);
                 ev_io_start(EV_A_ & server->recv_ctx->io);
                 ev_io_start(EV_A_ & remote->recv_ctx->io);
@@ -939,13 +1436,14 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
         } else {
             ERROR("getpeername");
             // not connected
+            server->close_reason = "connect_failed";
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
         }
     }
 
-    if (remote->buf_len == 0) {
+    if (cork_ring_buffer_is_empty(&remote->pending)) {
         // close and free
         if (verbose) {
             LOGI("remote_send close the connection");
@@ -955,38 +1453,35 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
         return;
     } else {
         // has data to send
-        ssize_t s = send(remote->fd, remote->buf + remote->buf_idx,
-                         remote->buf_len, 0);
-        if (s == -1) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                ERROR("remote_send_send");
-                // close and free
-                close_and_free_remote(EV_A_ remote);
-                close_and_free_server(EV_A_ server);
-            }
-            return;
-        } else if (s < remote->buf_len) {
-            // partly sent, move memory, wait for the next time to send
-            remote->buf_len -= s;
-            remote->buf_idx += s;
+        if (relay_flush(remote->fd, &remote->pending) == -1) {
+            ERROR("remote_send_send");
+            server->close_reason = "remote_error";
+            // close and free
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
             return;
-        } else {
+        }
+        if (cork_ring_buffer_is_empty(&remote->pending)) {
             // all sent out, wait for reading
-            remote->buf_len = 0;
-            remote->buf_idx = 0;
             ev_io_stop(EV_A_ & remote_send_ctx->io);
-            if (server != NULL) {
-                ev_io_start(EV_A_ & server->recv_ctx->io);
-                if (server->stage == 4) {
-                    server->stage = 5;
-                    ev_io_start(EV_A_ & remote->recv_ctx->io);
-                }
-            } else {
-                LOGE("invalid server");
+            if (server->eof) {
+                server->close_reason = "client_closed";
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+                return;
             }
-            return;
+            if (server->stage == 4) {
+                server->stage = 5;
+                if (relay_to_uring(EV_A_ server)) {
+                    return;
+                }
+                ev_io_start(EV_A_ & remote->recv_ctx->io);
+            }
+        }
+        if (server->stage == 5 && !server->eof
+            && !cork_ring_buffer_is_full(&remote->pending)) {
+            // below the high-water mark, resume reading
+            ev_io_start(EV_A_ & server->recv_ctx->io);
         }
     }
 }
@@ -999,7 +1494,7 @@ static struct remote * new_remote(int fd)
 
     struct remote *remote;
     remote = malloc(sizeof(struct remote));
-    remote->buf = malloc(BUF_SIZE);
+    remote->buf = NULL;
     remote->recv_ctx = malloc(sizeof(struct remote_ctx));
     remote->send_ctx = malloc(sizeof(struct remote_ctx));
     remote->fd = fd;
@@ -1009,9 +1504,11 @@ static struct remote * new_remote(int fd)
     remote->recv_ctx->connected = 0;
     remote->send_ctx->remote = remote;
     remote->send_ctx->connected = 0;
-    remote->buf_len = 0;
-    remote->buf_idx = 0;
+    remote->eof = 0;
     remote->server = NULL;
+    // with notsent_lowat, leave what the remote cannot take yet unread
+    cork_ring_buffer_init(&remote->pending,
+                          remote_sockopt.notsent_lowat > 0 ? 1 : max_pending);
     return remote;
 }
 
@@ -1020,9 +1517,8 @@ static void free_remote(struct remote *remote)
     if (remote->server != NULL) {
         remote->server->remote = NULL;
     }
-    if (remote->buf != NULL) {
-        free(remote->buf);
-    }
+    buf_release(&buf_pool, &remote->buf);
+    relay_free(&remote->pending);
     free(remote->recv_ctx);
     free(remote->send_ctx);
     free(remote);
@@ -1042,15 +1538,14 @@ static void close_and_free_remote(EV_P_ struct remote *remote)
     }
 }
 
-static struct server * new_server(int fd, struct listen_ctx *listener)
+static struct server * new_server(int fd, struct listen_ctx *listener,
+                                  const struct sockaddr_storage *peer)
 {
-    if (verbose) {
-        server_conn++;
-    }
+    metrics.sessions++;
 
     struct server *server;
     server = malloc(sizeof(struct server));
-    server->buf = malloc(BUF_SIZE);
+    server->buf = NULL;
     server->recv_ctx = malloc(sizeof(struct server_ctx));
     server->send_ctx = malloc(sizeof(struct server_ctx));
     server->fd = fd;
@@ -1076,7 +1571,25 @@ static struct server * new_server(int fd, struct listen_ctx *listener)
     }
     server->buf_len = 0;
     server->buf_idx = 0;
+    server->eof = 0;
     server->remote = NULL;
+    cork_ring_buffer_init(&server->pending,
+                          client_sockopt.notsent_lowat > 0 ? 1 : max_pending);
+
+    server->logged = access_log_sampled();
+    if (server->logged) {
+        memcpy(&server->peer, peer, sizeof(struct sockaddr_storage));
+    }
+    server->target = NULL;
+    server->target_port = 0;
+    server->start = ev_now(listener->loop);
+    server->resolve_time = -1;
+    server->connect_time = -1;
+    server->up = 0;
+    server->down = 0;
+    server->close_reason = "closed";
+    server->paused = 0;
+    server->relay = NULL;
 
     cork_dllist_add(&connections, &server->entries);
 
@@ -1086,6 +1599,9 @@ static struct server * new_server(int fd, struct listen_ctx *listener)
 static void free_server(struct server *server)
 {
     cork_dllist_remove(&server->entries);
+    if (server->paused) {
+        cork_dllist_remove(&server->paused_entries);
+    }
 
     if (server->remote != NULL) {
         server->remote->server = NULL;
@@ -1098,9 +1614,11 @@ static void free_server(struct server *server)
         cipher_context_release(&server->d_ctx->evp);
         free(server->d_ctx);
     }
-    if (server->buf != NULL) {
-        free(server->buf);
+    buf_release(&buf_pool, &server->buf);
+    if (server->target != NULL) {
+        free(server->target);
     }
+    relay_free(&server->pending);
     free(server->recv_ctx);
     free(server->send_ctx);
     free(server);
@@ -1113,22 +1631,56 @@ static void close_and_free_server(EV_P_ struct server *server)
             resolv_cancel(server->query);
             server->query = NULL;
         }
+        if (server->relay != NULL) {
+            uring_relay_abort(EV_A_ server->relay);
+            server->relay = NULL;
+        }
         ev_io_stop(EV_A_ & server->send_ctx->io);
         ev_io_stop(EV_A_ & server->recv_ctx->io);
         ev_timer_stop(EV_A_ & server->recv_ctx->watcher);
-        close(server->fd);
+        if (server->logged) {
+            log_session(EV_A_ server);
+        }
+        if (server->fd != -1) {
+            close(server->fd);
+        }
         free_server(server);
+        metrics.sessions--;
         if (verbose) {
-            server_conn--;
-            LOGI("current server connection: %d", server_conn);
+            LOGI("current server connection: %d", metrics.sessions);
+        }
+        if (accept_paused && !ev_is_active(&accept_resume_watcher)
+            && metrics.sessions < max_sessions) {
+            resume_accept(EV_A);
         }
     }
 }
 
+static void log_session(EV_P_ struct server *server)
+{
+    struct access_record record;
+    record.time     = ev_now(EV_A);
+    record.peer     = (struct sockaddr *)&server->peer;
+    record.host     = server->target;
+    record.port     = server->target_port;
+    record.resolve  = server->resolve_time;
+    record.connect  = server->connect_time;
+    record.duration = ev_now(EV_A) - server->start;
+    record.up       = server->up;
+    record.down     = server->down;
+    record.reason   = server->close_reason;
+    access_log_write(&record);
+}
+
 static void signal_cb(EV_P_ ev_signal *w, int revents)
 {
     if (revents & EV_SIGNAL) {
         switch (w->signum) {
+#ifndef __MINGW32__
+        case SIGHUP:
+            reload_acl();
+            break;
+#endif
         case SIGINT:
         case SIGTERM:
             ev_unloop(EV_A_ EVUNLOOP_ALL);
@@ -1136,29 +1688,186 @@ static void signal_cb(EV_P_ ev_signal *w, int revents)
     }
 }
 
-static void accept_cb(EV_P_ ev_io *w, int revents)
+/*
+ * Stop accepting on every listener. Pending connections wait in the
+ * backlog, and the kernel drops new ones once it is full, which costs us
+ * nothing. With a delay, accepting resumes after it; otherwise once a
+ * session closes.
+ */
+static void pause_accept(EV_P_ const char *reason, ev_tstamp delay)
 {
-    struct listen_ctx *listener = (struct listen_ctx *)w;
-    int serverfd = accept(listener->fd, NULL, NULL);
-    if (serverfd == -1) {
-        ERROR("accept");
+    if (!accept_paused) {
+        for (int i = 0; i < listener_num; i++) {
+            ev_io_stop(EV_A_ & listeners[i].io);
+        }
+        accept_paused = 1;
+        if (verbose) {
+            LOGI("stop accepting: %s", reason);
+        }
+    }
+
+    if (delay > 0 && !ev_is_active(&accept_resume_watcher)) {
+        ev_timer_set(&accept_resume_watcher, delay, 0);
+        ev_timer_start(EV_A_ & accept_resume_watcher);
+    }
+}
+
+static void resume_accept(EV_P)
+{
+    if (draining) {
         return;
     }
-    setnonblocking(serverfd);
 
-    int opt = 1;
-    setsockopt(serverfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
-#ifdef SO_NOSIGPIPE
-    setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
-#endif
+    for (int i = 0; i < listener_num; i++) {
+        ev_io_start(EV_A_ & listeners[i].io);
+    }
+    accept_paused = 0;
+    if (verbose) {
+        LOGI("resume accepting");
+    }
+}
+
+static void accept_resume_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    if (max_sessions > 0 && metrics.sessions >= max_sessions) {
+        // close_and_free_server() resumes once below the limit
+        return;
+    }
+    resume_accept(EV_A);
+}
 
+/*
+ * A restarted ss-server serves the listening sockets now. Stop accepting,
+ * and exit once the open sessions are done or the drain timeout passes.
+ */
+static void handoff_cb(EV_P)
+{
+    draining = 1;
+    ev_timer_stop(EV_A_ & accept_resume_watcher);
+
+    for (int i = 0; i < listener_num; i++) {
+        ev_io_stop(EV_A_ & listeners[i].io);
+        if (io_uring) {
+            uring_unlisten(EV_A_ listeners[i].fd);
+        }
+        close(listeners[i].fd);
+        listeners[i].fd = -1;
+    }
+    if (mode != TCP_ONLY) {
+        drain_udprelay();
+    }
+    metrics_release(EV_A);
+
+    LOGI("draining %d sessions", metrics.sessions);
+    drain_deadline = ev_now(EV_A) + drain_timeout;
+    ev_timer_start(EV_A_ & drain_watcher);
+}
+
+static void drain_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    int streams = mux ? mux_stream_count() : 0;
+
+    if (metrics.sessions > 0 || streams > 0) {
+        if (ev_now(EV_A) < drain_deadline) {
+            return;
+        }
+        LOGI("drain timeout, closing %d sessions and %d streams",
+             metrics.sessions, streams);
+    }
+
+    ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+/*
+ * Whether one more session may be accepted now. The accept rate is a
+ * token bucket holding up to one second worth of connections.
+ */
+static int admit_session(EV_P)
+{
+    if (max_sessions > 0 && metrics.sessions >= max_sessions) {
+        pause_accept(EV_A_ "session limit reached", 0);
+        return 0;
+    }
+
+    if (max_accept_rate > 0) {
+        ev_tstamp now = ev_now(EV_A);
+        double burst  = max_accept_rate > 1 ? max_accept_rate : 1;
+        accept_tokens += (now - accept_refill) * max_accept_rate;
+        if (accept_tokens > burst) {
+            accept_tokens = burst;
+        }
+        accept_refill = now;
+
+        if (accept_tokens < 1) {
+            pause_accept(EV_A_ "accept rate limit reached",
+                         (1 - accept_tokens) / max_accept_rate);
+            return 0;
+        }
+        accept_tokens -= 1;
+    }
+
+    return 1;
+}
+
+static void accept_session(EV_P_ struct listen_ctx *listener, int serverfd,
+                           const struct sockaddr_storage *peer)
+{
     if (verbose) {
         LOGI("accept a connection");
     }
+    metrics.accepted++;
 
-    struct server *server = new_server(serverfd, listener);
+    struct server *server = new_server(serverfd, listener, peer);
     ev_io_start(EV_A_ & server->recv_ctx->io);
     ev_timer_start(EV_A_ & server->recv_ctx->watcher);
+
+    if (listener->early_data) {
+        // the IV and address header are most likely queued already
+        server_recv_cb(EV_A_ & server->recv_ctx->io, EV_READ);
+    }
+}
+
+static void uring_accept_cb(EV_P_ int fd, void *data)
+{
+    // multishot accepts carry no address, and it is gone after a reset
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    memset(&peer, 0, len);
+    getpeername(fd, (struct sockaddr *)&peer, &len);
+
+    accept_session(EV_A_ data, fd, &peer);
+}
+
+static void accept_cb(EV_P_ ev_io *w, int revents)
+{
+    struct listen_ctx *listener = (struct listen_ctx *)w;
+
+    // drain the backlog in batches, leaving room for established sessions
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        if (!admit_session(EV_A)) {
+            return;
+        }
+
+        struct sockaddr_storage peer;
+        memset(&peer, 0, sizeof(peer));
+        int serverfd = accept_nonblock(listener->fd, &peer);
+        if (serverfd == -1) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // wait for sessions to close instead of spinning
+                ERROR("accept");
+                pause_accept(EV_A_ "out of file descriptors", 1);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK
+                       && errno != EINTR && errno != ECONNABORTED) {
+                ERROR("accept");
+            }
+            if (max_accept_rate > 0) {
+                accept_tokens += 1;
+            }
+            return;
+        }
+
+        accept_session(EV_A_ listener, serverfd, &peer);
+    }
 }
 
 int main(int argc, char **argv)
@@ -1179,6 +1888,10 @@ int main(int argc, char **argv)
 
     char * nameservers[MAX_DNS_NUM + 1];
     int nameserver_num = 0;
+    int dns_parallel = 1;
+    char *access_log_path = NULL;
+    int access_log_sample = 1;
+    char *metrics_addr = NULL;
 
     int option_index = 0;
     static struct option long_options[] =
@@ -1186,6 +1899,22 @@ int main(int argc, char **argv)
         { "fast-open",          no_argument,       0, 0 },
         { "acl",                required_argument, 0, 0 },
         { "manager-address",    required_argument, 0, 0 },
+        { "max-pending",        required_argument, 0, 0 },
+        { "dns-parallel",       required_argument, 0, 0 },
+        { "access-log",         required_argument, 0, 0 },
+        { "access-log-sample",  required_argument, 0, 0 },
+        { "max-sessions",       required_argument, 0, 0 },
+        { "max-accept-rate",    required_argument, 0, 0 },
+        { "max-memory",         required_argument, 0, 0 },
+        { "metrics",            required_argument, 0, 0 },
+        { "mux",                no_argument,       0, 0 },
+        { "fast-open-queue",    required_argument, 0, 0 },
+        { "defer-accept",       required_argument, 0, 0 },
+        { "client-sockopt",     required_argument, 0, 0 },
+        { "remote-sockopt",     required_argument, 0, 0 },
+        { "io-uring",           no_argument,       0, 0 },
+        { "handoff",            required_argument, 0, 0 },
+        { "drain-timeout",      required_argument, 0, 0 },
         { 0,                    0,                 0, 0 }
     };
 
@@ -1204,6 +1933,42 @@ int main(int argc, char **argv)
                 acl = !init_acl(optarg);
             } else if (option_index == 2) {
                 manager_address = optarg;
+            } else if (option_index == 3) {
+                max_pending = atoi(optarg);
+            } else if (option_index == 4) {
+                dns_parallel = atoi(optarg);
+            } else if (option_index == 5) {
+                access_log_path = optarg;
+            } else if (option_index == 6) {
+                access_log_sample = atoi(optarg);
+            } else if (option_index == 7) {
+                max_sessions = atoi(optarg);
+            } else if (option_index == 8) {
+                max_accept_rate = atof(optarg);
+            } else if (option_index == 9) {
+                buf_budget = (size_t)atoi(optarg) * 1024 * 1024;
+            } else if (option_index == 10) {
+                metrics_addr = optarg;
+            } else if (option_index == 11) {
+                mux = 1;
+            } else if (option_index == 12) {
+                fast_open_queue = atoi(optarg);
+            } else if (option_index == 13) {
+                defer_accept = atoi(optarg);
+            } else if (option_index == 14) {
+                if (parse_sockopt_profile(optarg, &client_sockopt) == -1) {
+                    FATAL("invalid client socket options");
+                }
+            } else if (option_index == 15) {
+                if (parse_sockopt_profile(optarg, &remote_sockopt) == -1) {
+                    FATAL("invalid remote socket options");
+                }
+            } else if (option_index == 16) {
+                io_uring = 1;
+            } else if (option_index == 17) {
+                handoff_path = optarg;
+            } else if (option_index == 18) {
+                drain_timeout = atoi(optarg);
             }
             break;
         case 's':
@@ -1326,6 +2091,24 @@ int main(int argc, char **argv)
         timeout = "60";
     }
 
+#ifndef HANDOFF_SUPPORTED
+    if (handoff_path != NULL) {
+        FATAL("socket handoff is not supported on this platform");
+    }
+#endif
+
+    if (max_pending < 1 || max_pending > MAX_PENDING_LIMIT) {
+        LOGE("max pending buffers must be between 1 and %d", MAX_PENDING_LIMIT);
+        max_pending = MAX_PENDING;
+    }
+
+    // opened before daemonizing, which changes the working directory
+    if (access_log_path != NULL
+        && access_log_open(access_log_path, access_log_sample) == 0) {
+        LOGI("access log enabled, 1 in %d sessions",
+             max(access_log_sample, 1));
+    }
+
     if (pid_flags) {
         USE_SYSLOG(argv[0]);
         daemonize(pid_path);
@@ -1337,6 +2120,9 @@ int main(int argc, char **argv)
 #else
         LOGE("tcp fast open is not supported by this environment");
 #endif
+        if (fast_open_queue == 0) {
+            fast_open_queue = FAST_OPEN_QUEUE;
+        }
     }
 
 #ifdef __MINGW32__
@@ -1354,6 +2140,14 @@ int main(int argc, char **argv)
     ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
     ev_signal_start(EV_DEFAULT, &sigint_watcher);
     ev_signal_start(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    // reload the acl on SIGHUP
+    struct ev_signal sighup_watcher;
+    ev_signal_init(&sighup_watcher, signal_cb, SIGHUP);
+    if (acl) {
+        ev_signal_start(EV_DEFAULT, &sighup_watcher);
+    }
+#endif
 
     // setup keys
     LOGI("initialize ciphers... %s", method);
@@ -1378,8 +2172,45 @@ int main(int argc, char **argv)
         LOGI("using nameserver: %s", nameservers[i]);
     }
 
+    if (dns_parallel > 1) {
+        if (resolv_set_parallel(dns_parallel)) {
+            LOGE("invalid dns-parallel value, query one nameserver at a time");
+        } else {
+            LOGI("querying %d nameservers at once", dns_parallel);
+        }
+    }
+
     // inilitialize listen context
     struct listen_ctx listen_ctx_list[server_num];
+    listeners = listen_ctx_list;
+    ev_timer_init(&accept_resume_watcher, accept_resume_cb, 0, 0);
+    ev_timer_init(&drain_watcher, drain_cb, 1, 1);
+
+    if (handoff_path != NULL) {
+        handoff_connect(handoff_path);
+    }
+
+    if (max_sessions > 0) {
+        LOGI("accepting at most %d sessions", max_sessions);
+    }
+    if (max_accept_rate > 0) {
+        LOGI("accepting at most %g sessions per second", max_accept_rate);
+        accept_tokens = max_accept_rate > 1 ? max_accept_rate : 1;
+        accept_refill = ev_now(loop);
+    }
+
+    if (io_uring && mode != UDP_ONLY) {
+        struct uring_config config;
+        memset(&config, 0, sizeof(struct uring_config));
+        config.accept = uring_accept_cb;
+        config.close  = uring_close_cb;
+        if (uring_init(loop, &config) == -1) {
+            LOGE("falling back to libev for relaying");
+            io_uring = 0;
+        } else {
+            LOGI("relaying with io_uring");
+        }
+    }
 
     // bind to each interface
     while (server_num > 0) {
@@ -1387,17 +2218,26 @@ int main(int argc, char **argv)
         const char * host = server_host[index];
 
         if (mode != UDP_ONLY) {
-            // Bind to port
-            int listenfd;
-            listenfd = create_and_bind(host, server_port);
+            // Bind to port, unless the previous ss-server handed it over
+            int listenfd = handoff_take(HANDOFF_TCP, host, server_port);
+            if (listenfd == -1) {
+                listenfd = create_and_bind(host, server_port);
+            }
             if (listenfd < 0) {
                 FATAL("bind() error");
             }
+            // inherited by accepted sockets, buffers must be set before listen()
+            set_sockopt_profile(listenfd, &client_sockopt);
             if (listen(listenfd, SSMAXCONN) == -1) {
                 FATAL("listen() error");
             }
             setnonblocking(listenfd);
+            set_listen_sockopt(listenfd);
             struct listen_ctx *listen_ctx = &listen_ctx_list[index];
+            listen_ctx->early_data = set_listen_early_data(listenfd,
+                                                           fast_open_queue,
+                                                           defer_accept);
+            handoff_register(HANDOFF_TCP, host, server_port, listenfd);
 
             // Setup proxy context
             listen_ctx->timeout = atoi(timeout);
@@ -1407,7 +2247,13 @@ int main(int argc, char **argv)
             listen_ctx->loop = loop;
 
             ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
-            ev_io_start(loop, &listen_ctx->io);
+            if (io_uring && max_sessions == 0 && max_accept_rate == 0) {
+                // admission control pauses the libev listeners instead
+                uring_listen(loop, listenfd, listen_ctx);
+            } else {
+                ev_io_start(loop, &listen_ctx->io);
+            }
+            listener_num++;
         }
 
         // Setup UDP
@@ -1425,6 +2271,31 @@ int main(int argc, char **argv)
         ev_timer_start(EV_DEFAULT, &stat_update_watcher);
     }
 
+    metrics.cipher = enc_get_method_name(m);
+    metrics.pool   = &buf_pool;
+    if (metrics_addr != NULL) {
+        int fd = handoff_take(HANDOFF_METRICS, metrics_addr, NULL);
+        if (fd != -1) {
+            metrics_serve(loop, metrics_addr, fd);
+        } else {
+            metrics_listen(loop, metrics_addr);
+        }
+        if (metrics_fd() != -1) {
+            handoff_register(HANDOFF_METRICS, metrics_addr, NULL,
+                             metrics_fd());
+        }
+    }
+
+    if (mux && mode != UDP_ONLY) {
+        struct mux_config config;
+        memset(&config, 0, sizeof(struct mux_config));
+        config.method  = m;
+        config.timeout = atoi(timeout);
+        config.open    = mux_open_cb;
+        mux_init(&config);
+        LOGI("multiplexed tunnels enabled");
+    }
+
     if (mode != TCP_ONLY) {
         LOGI("UDP relay enabled");
     }
@@ -1433,6 +2304,12 @@ int main(int argc, char **argv)
         LOGI("TCP relay disabled");
     }
 
+    if (handoff_path != NULL) {
+        // the previous process, if any, stops accepting from here on
+        handoff_listen(loop, handoff_path, handoff_cb);
+        handoff_ready();
+    }
+
     // setuid
     if (user != NULL) {
         run_as(user);
@@ -1440,6 +2317,11 @@ int main(int argc, char **argv)
 
     // Init connections
     cork_dllist_init(&connections);
+    cork_dllist_init(&paused_sessions);
+    ev_check_init(&budget_watcher, budget_cb);
+    if (buf_budget > 0) {
+        LOGI("relay buffers limited to %zu bytes", buf_budget);
+    }
 
     // start ev loop
     ev_run(loop, 0);
@@ -1451,20 +2333,34 @@ int main(int argc, char **argv)
     if (manager_address != NULL) {
         ev_timer_stop(EV_DEFAULT, &stat_update_watcher);
     }
+    ev_timer_stop(loop, &accept_resume_watcher);
+    ev_timer_stop(loop, &drain_watcher);
+    ev_check_stop(loop, &budget_watcher);
+    metrics_close(loop);
+    handoff_close(loop);
 
     // Clean up
     for (int i = 0; i <= server_num; i++) {
         struct listen_ctx *listen_ctx = &listen_ctx_list[i];
-        if (mode != UDP_ONLY) {
+        if (mode != UDP_ONLY && listen_ctx->fd != -1) {
             ev_io_stop(loop, &listen_ctx->io);
             close(listen_ctx->fd);
         }
     }
 
     if (mode != UDP_ONLY) {
+        if (mux) {
+            mux_close_all(loop);
+        }
         free_connections(loop);
+        if (io_uring) {
+            uring_free(loop);
+        }
     }
 
+    access_log_close();
+    buf_pool_done(&buf_pool);
+
     if (mode != TCP_ONLY) {
         free_udprelay();
     }
@@ -1477,6 +2373,9 @@ int main(int argc, char **argv)
 
     ev_signal_stop(EV_DEFAULT, &sigint_watcher);
     ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+#ifndef __MINGW32__
+    ev_signal_stop(EV_DEFAULT, &sighup_watcher);
+#endif
 
     return 0;
 }
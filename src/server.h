@@ -39,6 +39,7 @@ struct listen_ctx {
     int timeout;
     int method;
     char *iface;
+    int early_data;   /**<Accepted sockets are readable at once */
     struct ev_loop *loop;
 };
 
@@ -49,21 +50,47 @@ struct server_ctx {
     struct server *server;
 };
 
+struct relay_chunk {
+    ssize_t len;
+    ssize_t idx;
+    char *buf;
+};
+
 struct server {
     int fd;
     int stage;
+    int eof;
     ssize_t buf_len;
     ssize_t buf_idx;
-    char *buf; // server send from, remote recv into
+    char *buf; // remote recv into, header buffer during handshake
+    struct cork_ring_buffer pending; // chunks waiting to be sent to the client
     struct enc_ctx *e_ctx;
     struct enc_ctx *d_ctx;
     struct server_ctx *recv_ctx;
     struct server_ctx *send_ctx;
     struct listen_ctx *listen_ctx;
     struct remote *remote;
+    struct uring_relay *relay; // once the io_uring engine relays it
 
     struct ResolvQuery *query;
 
+    // access log, filled in when the session is sampled
+    int logged;
+    struct sockaddr_storage peer; // the client, taken at accept time
+    char *target;
+    uint16_t target_port;
+    ev_tstamp start;
+    ev_tstamp resolve_start;
+    ev_tstamp connect_start;
+    ev_tstamp resolve_time;  // -1 if never resolved
+    ev_tstamp connect_time;  // -1 if never connected
+    uint64_t up;             // bytes from the client
+    uint64_t down;           // bytes from the remote
+    const char *close_reason;
+
+    int paused; // sides not read from while the memory budget is used up
+    struct cork_dllist_item paused_entries;
+
     struct cork_dllist_item entries;
 };
 
@@ -75,9 +102,9 @@ struct remote_ctx {
 
 struct remote {
     int fd;
-    ssize_t buf_len;
-    ssize_t buf_idx;
-    char *buf; // remote send from, server recv into
+    int eof;
+    char *buf; // server recv into
+    struct cork_ring_buffer pending; // chunks waiting to be sent to the remote
     struct remote_ctx *recv_ctx;
     struct remote_ctx *send_ctx;
     struct server *server;
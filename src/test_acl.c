@@ -0,0 +1,265 @@
+/*
+ * test_acl.c - Check the ACL range tables against the libipset BDD
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ipset/ipset.h>
+
+#include "utils.h"
+#include "acl.h"
+
+#define V4_CIDRS 4000
+#define V6_CIDRS 1000
+#define RANDOM_QUERIES 200000
+
+struct cidr4 {
+    struct cork_ipv4 addr;
+    int prefix;
+};
+
+struct cidr6 {
+    struct cork_ipv6 addr;
+    int prefix;
+};
+
+static struct cidr4 v4[V4_CIDRS];
+static struct cidr6 v6[V6_CIDRS];
+
+static struct ip_set set4;
+static struct ip_set set6;
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t next_random(void)
+{
+    // xorshift64*, a fixed seed keeps failures reproducible
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void random_bytes(uint8_t *p, int len)
+{
+    for (int i = 0; i < len; i++) {
+        p[i] = next_random();
+    }
+}
+
+/*
+ * Write the list in the ACL file format. Networks keep random host bits,
+ * which both implementations must ignore, and some are single addresses.
+ */
+static int write_list(const char *path)
+{
+    char host[INET6_ADDRSTRLEN];
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    fprintf(f, "# random networks\n");
+    for (int i = 0; i < V4_CIDRS; i++) {
+        inet_ntop(AF_INET, &v4[i].addr, host, sizeof(host));
+        if (v4[i].prefix == 32 && i % 2) {
+            fprintf(f, "%s\n", host);
+        } else {
+            fprintf(f, "%s/%d\n", host, v4[i].prefix);
+        }
+    }
+    for (int i = 0; i < V6_CIDRS; i++) {
+        inet_ntop(AF_INET6, &v6[i].addr, host, sizeof(host));
+        if (v6[i].prefix == 128 && i % 2) {
+            fprintf(f, "%s\n", host);
+        } else {
+            fprintf(f, "%s/%d\n", host, v6[i].prefix);
+        }
+    }
+
+    return fclose(f);
+}
+
+static void build_lists(void)
+{
+    ipset_init_library();
+    ipset_init(&set4);
+    ipset_init(&set6);
+
+    for (int i = 0; i < V4_CIDRS; i++) {
+        random_bytes(v4[i].addr._.u8, 4);
+        // mostly long prefixes, as in real lists, some very short ones
+        v4[i].prefix = i % 16 == 0 ? 1 + next_random() % 32
+                       : 8 + next_random() % 25;
+        ipset_ipv4_add_network(&set4, &v4[i].addr, v4[i].prefix);
+    }
+    for (int i = 0; i < V6_CIDRS; i++) {
+        random_bytes(v6[i].addr._.u8, 16);
+        v6[i].prefix = i % 16 == 0 ? 1 + next_random() % 128
+                       : 16 + next_random() % 113;
+        ipset_ipv6_add_network(&set6, &v6[i].addr, v6[i].prefix);
+    }
+}
+
+static int check4(struct cork_ipv4 *addr)
+{
+    struct in_addr in;
+    memcpy(&in, addr, sizeof(in));
+
+    int expected = ipset_contains_ipv4(&set4, addr);
+    if (acl_contains_ipv4(&in) != expected) {
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in, host, sizeof(host));
+        printf("%s: expected %d\n", host, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static int check6(struct cork_ipv6 *addr)
+{
+    struct in6_addr in6;
+    memcpy(&in6, addr, sizeof(in6));
+
+    int expected = ipset_contains_ipv6(&set6, addr);
+    if (acl_contains_ipv6(&in6) != expected) {
+        char host[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &in6, host, sizeof(host));
+        printf("%s: expected %d\n", host, expected);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Step a big-endian address by delta, carrying across bytes
+ */
+static void step(uint8_t *addr, int len, int delta)
+{
+    for (int i = len - 1; i >= 0; i--) {
+        int v = addr[i] + delta;
+        addr[i] = v;
+        if (v >= 0 && v <= 255) {
+            break;
+        }
+    }
+}
+
+/*
+ * The first and last address of every network and their neighbours, then
+ * random addresses
+ */
+static int check_lookups(void)
+{
+    int failed = 0;
+
+    for (int i = 0; i < V4_CIDRS; i++) {
+        for (int last = 0; last <= 1; last++) {
+            struct cork_ipv4 addr = v4[i].addr;
+            for (int b = v4[i].prefix; b < 32; b++) {
+                uint8_t bit = 0x80 >> (b % 8);
+                addr._.u8[b / 8] = last ? addr._.u8[b / 8] | bit
+                                   : addr._.u8[b / 8] & ~bit;
+            }
+            failed |= check4(&addr);
+            step(addr._.u8, 4, last ? 1 : -1);
+            failed |= check4(&addr);
+        }
+    }
+
+    for (int i = 0; i < V6_CIDRS; i++) {
+        for (int last = 0; last <= 1; last++) {
+            struct cork_ipv6 addr = v6[i].addr;
+            for (int b = v6[i].prefix; b < 128; b++) {
+                uint8_t bit = 0x80 >> (b % 8);
+                addr._.u8[b / 8] = last ? addr._.u8[b / 8] | bit
+                                   : addr._.u8[b / 8] & ~bit;
+            }
+            failed |= check6(&addr);
+            step(addr._.u8, 16, last ? 1 : -1);
+            failed |= check6(&addr);
+        }
+    }
+
+    for (int i = 0; i < RANDOM_QUERIES; i++) {
+        struct cork_ipv4 addr4;
+        struct cork_ipv6 addr6;
+        random_bytes(addr4._.u8, 4);
+        failed |= check4(&addr4);
+        // near a listed network, where random IPv6 addresses never land
+        addr6 = v6[i % V6_CIDRS].addr;
+        random_bytes(addr6._.u8 + 8, 8);
+        failed |= check6(&addr6);
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    char list[] = "/tmp/test_acl.XXXXXX";
+    char image[sizeof(list) + 4];
+    int failed = 0;
+
+    int fd = mkstemp(list);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    snprintf(image, sizeof(image), "%s.img", list);
+
+    build_lists();
+    if (write_list(list) || init_acl(list)) {
+        unlink(list);
+        return 1;
+    }
+
+    failed |= check_lookups();
+
+    // the compiled image must answer the same
+    if (save_acl(image) || (free_acl(), init_acl(image))) {
+        failed = 1;
+    } else {
+        failed |= check_lookups();
+    }
+
+    free_acl();
+    ipset_done(&set4);
+    ipset_done(&set6);
+    unlink(list);
+    unlink(image);
+
+    return failed;
+}
@@ -0,0 +1,118 @@
+/*
+ * test_table.c - Check the vectorized table substitution against the scalar loop
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+// the substitution routines are static
+#include "encrypt.c"
+
+#define TABLE_TRIALS 64
+#define MAX_OFFSET 4
+
+static const size_t lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 4096 + 3 };
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t next_random(void)
+{
+    // xorshift64*, a fixed seed keeps failures reproducible
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void random_table(uint8_t *table)
+{
+    int i;
+    for (i = 0; i < 256; i++) {
+        table[i] = i;
+    }
+    for (i = 255; i > 0; i--) {
+        int j     = next_random() % (i + 1);
+        uint8_t t = table[i];
+        table[i]  = table[j];
+        table[j]  = t;
+    }
+}
+
+typedef void (*substitute_fn)(uint8_t *buf, size_t len,
+                              const uint8_t *table, const uint8_t *rows);
+
+static int check(const char *name, substitute_fn substitute)
+{
+    static uint8_t input[4096 + 3 + MAX_OFFSET];
+    static uint8_t expected[4096 + 3 + MAX_OFFSET];
+    static uint8_t actual[4096 + 3 + MAX_OFFSET];
+    uint8_t table[256], rows[256];
+    int failed = 0;
+
+    for (int trial = 0; trial < TABLE_TRIALS; trial++) {
+        random_table(table);
+        table_rows_init(rows, table);
+
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            for (int off = 0; off < MAX_OFFSET; off++) {
+                size_t len = lengths[l];
+                for (size_t i = 0; i < len + off; i++) {
+                    input[i] = next_random();
+                }
+                memcpy(expected, input, len + off);
+                memcpy(actual, input, len + off);
+
+                table_substitute_scalar(expected + off, len, table, rows);
+                substitute(actual + off, len, table, rows);
+
+                if (memcmp(expected, actual, len + off) != 0) {
+                    printf("%s: trial %d, length %zu, offset %d differs\n",
+                           name, trial, len, off);
+                    failed = 1;
+                }
+            }
+        }
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    int tested = 0;
+
+#ifdef TABLE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        failed |= check("ssse3", table_substitute_ssse3);
+        tested++;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        failed |= check("avx2", table_substitute_avx2);
+        tested++;
+    }
+#endif
+
+    if (tested == 0) {
+        printf("no vectorized substitution on this CPU\n");
+        return 77;
+    }
+
+    return failed;
+}
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #ifndef __MINGW32__
 #include <errno.h>
@@ -56,6 +57,7 @@
 #include <udns.h>
 
 #include "netutils.h"
+#include "resolv.h"
 #include "utils.h"
 #include "tunnel.h"
 
@@ -91,6 +93,10 @@ int vpn = 0;
 int verbose = 0;
 
 static int mode = TCP_ONLY;
+static int udp_over_tcp = 0;
+static int dns_cache = 0;
+static int fast_open_queue = 0;
+static int defer_accept = 0;
 
 #ifndef __MINGW32__
 static int setnonblocking(int fd)
@@ -597,8 +603,13 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
     setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
 
-    int index = rand() % listener->remote_num;
-    struct sockaddr *remote_addr = listener->remote_addr[index];
+    struct sockaddr *remote_addr = pick_remote_addr(listener->remote_addr,
+                                                    listener->remote_num);
+    if (remote_addr == NULL) {
+        LOGE("server name not resolved yet");
+        close(serverfd);
+        return;
+    }
 
     int remotefd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
     if (remotefd < 0) {
@@ -663,16 +674,39 @@ int main(int argc, char **argv)
     ss_addr_t tunnel_addr = { .host = NULL, .port = NULL };
     char *tunnel_addr_str = NULL;
 
+    int option_index = 0;
+    static struct option long_options[] =
+    {
+        { "udp-over-tcp",    no_argument,       0, 0 },
+        { "fast-open-queue", required_argument, 0, 0 },
+        { "defer-accept",    required_argument, 0, 0 },
+        { "dns-cache",       no_argument,       0, 0 },
+        { 0,                 0,                 0, 0 }
+    };
+
     opterr = 0;
 
     USE_TTY();
 
 #ifdef ANDROID
-    while ((c = getopt(argc, argv, "f:s:p:l:k:t:m:i:c:b:L:a:uUvV")) != -1) {
+    while ((c = getopt_long(argc, argv, "f:s:p:l:k:t:m:i:c:b:L:a:uUvV",
+                            long_options, &option_index)) != -1) {
 #else
-    while ((c = getopt(argc, argv, "f:s:p:l:k:t:m:i:c:b:L:a:uUv")) != -1) {
+    while ((c = getopt_long(argc, argv, "f:s:p:l:k:t:m:i:c:b:L:a:uUv",
+                            long_options, &option_index)) != -1) {
 #endif
         switch (c) {
+        case 0:
+            if (option_index == 0) {
+                udp_over_tcp = 1;
+            } else if (option_index == 1) {
+                fast_open_queue = atoi(optarg);
+            } else if (option_index == 2) {
+                defer_accept = atoi(optarg);
+            } else if (option_index == 3) {
+                dns_cache = 1;
+            }
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 remote_addr[remote_num].host = optarg;
@@ -807,28 +841,21 @@ int main(int argc, char **argv)
     LOGI("initialize ciphers... %s", method);
     int m = enc_init(password, method);
 
+    struct ev_loop *loop = EV_DEFAULT;
+
+    // Setup the resolver for server names
+    resolv_init(loop, NULL, 0);
+
     // Setup proxy context
     struct listen_ctx listen_ctx;
     listen_ctx.tunnel_addr = tunnel_addr;
     listen_ctx.remote_num = remote_num;
-    listen_ctx.remote_addr = malloc(sizeof(struct sockaddr *) * remote_num);
-    for (i = 0; i < remote_num; i++) {
-        char *host = remote_addr[i].host;
-        char *port = remote_addr[i].port == NULL ? remote_port :
-                     remote_addr[i].port;
-        struct sockaddr_storage *storage = malloc(sizeof(struct sockaddr_storage));
-        memset(storage, 0, sizeof(struct sockaddr_storage));
-        if (get_sockaddr(host, port, storage, 1) == -1) {
-            FATAL("failed to resolve the provided hostname");
-        }
-        listen_ctx.remote_addr[i] = (struct sockaddr *)storage;
-    }
+    listen_ctx.remote_addr = resolve_remote_addrs(loop, remote_addr,
+                                                  remote_port, remote_num);
     listen_ctx.timeout = atoi(timeout);
     listen_ctx.iface = iface;
     listen_ctx.method = m;
 
-    struct ev_loop *loop = EV_DEFAULT;
-
     if (mode != UDP_ONLY) {
         // Setup socket
         int listenfd;
@@ -840,6 +867,7 @@ int main(int argc, char **argv)
             FATAL("listen() error:");
         }
         setnonblocking(listenfd);
+        set_listen_early_data(listenfd, fast_open_queue, defer_accept);
 
         listen_ctx.fd = listenfd;
 
@@ -851,8 +879,12 @@ int main(int argc, char **argv)
     if (mode != TCP_ONLY) {
         LOGI("UDP relay enabled");
         init_udprelay(local_addr, local_port, listen_ctx.remote_addr[0],
-                      get_sockaddr_len(listen_ctx.remote_addr[0]),
-                      tunnel_addr, m, listen_ctx.timeout, iface);
+                      udp_over_tcp, tunnel_addr, dns_cache, m,
+                      listen_ctx.timeout,
+                      iface);
+        if (udp_over_tcp) {
+            LOGI("UDP relayed over TCP");
+        }
     }
 
     if (mode == UDP_ONLY) {
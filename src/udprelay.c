@@ -61,6 +61,11 @@
 #include "cache.h"
 #include "udprelay.h"
 
+#ifdef UDPRELAY_REMOTE
+#include "bufpool.h"
+#include "handoff.h"
+#endif
+
 #ifdef UDPRELAY_REMOTE
 #define MAX_UDP_CONN_NUM 1024
 #else
@@ -93,6 +98,28 @@ static void query_resolve_cb(struct sockaddr *addr, void *data);
 #endif
 static void close_and_free_remote(EV_P_ struct remote_ctx *ctx);
 static struct remote_ctx * new_remote(int fd, struct server_ctx * server_ctx);
+static void send_to_client(EV_P_ struct remote_ctx *remote_ctx, char *buf,
+                           ssize_t buf_len, struct sockaddr_storage *src_addr);
+static void handle_packet(EV_P_ struct server_ctx *server_ctx,
+                          struct sockaddr_storage *src_addr,
+#ifdef UDPRELAY_REDIR
+                          struct sockaddr_storage *dst_addr,
+#endif
+                          char *buf, ssize_t buf_len);
+
+static void uot_recv_cb(EV_P_ ev_io *w, int revents);
+static void uot_send_cb(EV_P_ ev_io *w, int revents);
+static void uot_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+static void uot_send(EV_P_ struct uot_tunnel *tunnel, uint32_t id,
+                     const char *buf, ssize_t len);
+static void attach_remote(struct uot_tunnel *tunnel,
+                          struct remote_ctx *remote_ctx);
+#ifdef UDPRELAY_LOCAL
+static struct uot_tunnel *open_tunnel(EV_P_ struct server_ctx *server_ctx);
+#else
+static struct uot_tunnel *find_tunnel(const struct sockaddr_storage *addr,
+                                      uint32_t *id);
+#endif
 
 extern int verbose;
 extern int vpn;
@@ -102,8 +129,18 @@ extern uint64_t rx;
 #endif
 
 static int server_num = 0;
+
+// read by the metrics endpoint
+int udp_associations = 0;
+uint64_t udp_associations_total = 0;
 static struct server_ctx *server_ctx_list[MAX_REMOTE_NUM] = { NULL };
 
+#ifdef UDPRELAY_REMOTE
+// tunnels by serial, their associations refer to them through src_addr
+static struct uot_tunnel *tunnels = NULL;
+static uint32_t tunnel_serial = 0;
+#endif
+
 #ifndef __MINGW32__
 static int setnonblocking(int fd)
 {
@@ -469,6 +506,10 @@ struct remote_ctx *new_remote(int fd, struct server_ctx *server_ctx)
     ev_io_init(&ctx->io, remote_recv_cb, fd, EV_READ);
     ev_timer_init(&ctx->watcher, remote_timeout_cb, server_ctx->timeout,
                   server_ctx->timeout);
+
+    udp_associations++;
+    udp_associations_total++;
+
     return ctx;
 }
 
@@ -489,6 +530,8 @@ struct query_ctx *new_query_ctx(const char *buf, const int buf_len)
     ctx->buf = malloc(buf_len);
     ctx->buf_len = buf_len;
     memcpy(ctx->buf, buf, buf_len);
+    // held until resolved, charged to the relay memory budget
+    buf_used += buf_len;
     return ctx;
 }
 
@@ -500,6 +543,7 @@ void close_and_free_query(EV_P_ struct query_ctx *ctx)
             ctx->query = NULL;
         }
         if (ctx->buf != NULL) {
+            buf_used -= ctx->buf_len;
             free(ctx->buf);
         }
         free(ctx);
@@ -511,10 +555,17 @@ void close_and_free_query(EV_P_ struct query_ctx *ctx)
 void close_and_free_remote(EV_P_ struct remote_ctx *ctx)
 {
     if (ctx != NULL) {
+        if (ctx->tunnel != NULL) {
+            HASH_DEL(ctx->tunnel->assocs, ctx);
+            ctx->tunnel->assoc_num--;
+        }
         ev_timer_stop(EV_A_ & ctx->watcher);
         ev_io_stop(EV_A_ & ctx->io);
-        close(ctx->fd);
+        if (ctx->fd != -1) {
+            close(ctx->fd);
+        }
         free(ctx);
+        udp_associations--;
     }
 }
 
@@ -543,8 +594,13 @@ static void query_resolve_cb(struct sockaddr *addr, void *data)
 
     query_ctx->query = NULL;
 
+    uint32_t id = 0;
+    struct uot_tunnel *tunnel = find_tunnel(&query_ctx->src_addr, &id);
+
     if (addr == NULL) {
         LOGE("[udp] udns returned an error");
+    } else if (query_ctx->src_addr.ss_family == AF_UNSPEC && tunnel == NULL) {
+        // the tunnel the packet came through is closed
     } else {
         struct remote_ctx *remote_ctx = query_ctx->remote_ctx;
         int cache_hit = 0;
@@ -573,6 +629,10 @@ static void query_resolve_cb(struct sockaddr *addr, void *data)
                 remote_ctx = new_remote(remotefd, query_ctx->server_ctx);
                 remote_ctx->src_addr = query_ctx->src_addr;
                 remote_ctx->server_ctx = query_ctx->server_ctx;
+                if (tunnel != NULL) {
+                    remote_ctx->id = id;
+                    attach_remote(tunnel, remote_ctx);
+                }
                 remote_ctx->addr_header_len = query_ctx->addr_header_len;
                 memcpy(remote_ctx->addr_header, query_ctx->addr_header,
                         query_ctx->addr_header_len);
@@ -654,7 +714,28 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
         ERROR("[udp] server_ss_decrypt_all");
         goto CLEAN_UP;
     }
+#endif
 
+    send_to_client(EV_A_ remote_ctx, buf, buf_len, &src_addr);
+    return;
+
+ CLEAN_UP:
+
+    free(buf);
+}
+
+/*
+ * Relay a packet from the remote side to the client, taking over buf.
+ * src_addr is where the packet came from on ss-server.
+ */
+static void send_to_client(EV_P_ struct remote_ctx *remote_ctx, char *buf,
+                           ssize_t buf_len, struct sockaddr_storage *src_addr)
+{
+#ifndef UDPRELAY_REDIR
+    struct server_ctx *server_ctx = remote_ctx->server_ctx;
+#endif
+
+#ifdef UDPRELAY_LOCAL
 #ifdef UDPRELAY_REDIR
     struct sockaddr_storage dst_addr;
     memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
@@ -681,6 +762,11 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
     // Construct packet
     buf_len -= len;
     memmove(buf, buf + len, buf_len);
+#ifdef UDPRELAY_TUNNEL
+    if (server_ctx->dns_cache != NULL) {
+        dns_cache_insert(server_ctx->dns_cache, buf, buf_len, ev_now(EV_A));
+    }
+#endif
 #else
     // Construct packet
     buf = realloc(buf, buf_len + 3);
@@ -699,7 +785,7 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
     int addr_header_len = remote_ctx->addr_header_len;
 
     if (remote_ctx->af == AF_INET || remote_ctx->af == AF_INET6) {
-        addr_header_len = construct_udprealy_header(&src_addr, addr_header_buf);
+        addr_header_len = construct_udprealy_header(src_addr, addr_header_buf);
         addr_header = addr_header_buf;
     }
 
@@ -709,6 +795,15 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
     memcpy(buf, addr_header, addr_header_len);
     buf_len += addr_header_len;
 
+    if (remote_ctx->src_addr.ss_family == AF_UNSPEC) {
+        // the association came through a tunnel
+        if (remote_ctx->tunnel != NULL) {
+            uot_send(EV_A_ remote_ctx->tunnel, remote_ctx->id, buf, buf_len);
+            ev_timer_again(EV_A_ & remote_ctx->watcher);
+        }
+        goto CLEAN_UP;
+    }
+
     buf = ss_encrypt_all(BUF_SIZE, buf, &buf_len, server_ctx->method);
 #endif
 
@@ -775,7 +870,6 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     char *buf = malloc(BUF_SIZE);
 
     socklen_t src_addr_len = sizeof(struct sockaddr_storage);
-    unsigned int offset = 0;
 
 #ifdef UDPRELAY_REDIR
     char control_buffer[64] = { 0 };
@@ -834,6 +928,30 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 #endif
 
+#ifdef UDPRELAY_REDIR
+    handle_packet(EV_A_ server_ctx, &src_addr, &dst_addr, buf, buf_len);
+#else
+    handle_packet(EV_A_ server_ctx, &src_addr, buf, buf_len);
+#endif
+    return;
+
+ CLEAN_UP:
+    free(buf);
+}
+
+/*
+ * Relay a packet from a client, taking over buf. On ss-server, packets from
+ * tunnels come through here as well.
+ */
+static void handle_packet(EV_P_ struct server_ctx *server_ctx,
+                          struct sockaddr_storage *src_addr,
+#ifdef UDPRELAY_REDIR
+                          struct sockaddr_storage *dst_addr,
+#endif
+                          char *buf, ssize_t buf_len)
+{
+    unsigned int offset = 0;
+
 #ifdef UDPRELAY_LOCAL
 #if !defined(UDPRELAY_TUNNEL) && !defined(UDPRELAY_REDIR)
     uint8_t frag = *(uint8_t *)(buf + 2);
@@ -887,7 +1005,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 
 #ifdef UDPRELAY_REDIR
     char addr_header[256] = { 0 };
-    int addr_header_len = construct_udprealy_header(&dst_addr, addr_header);
+    int addr_header_len = construct_udprealy_header(dst_addr, addr_header);
 
     if (addr_header_len == 0) {
         LOGE("[udp] failed to parse tproxy addr");
@@ -900,10 +1018,28 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     memcpy(buf, addr_header, addr_header_len);
     buf_len += addr_header_len;
 
-    char *key = hash_key(dst_addr.ss_family, &src_addr);
+    char *key = hash_key(dst_addr->ss_family, src_addr);
 
 #elif UDPRELAY_TUNNEL
 
+    // answer repeated DNS queries without a round trip to the server
+    if (server_ctx->dns_cache != NULL) {
+        int len = dns_cache_lookup(server_ctx->dns_cache, buf, buf_len,
+                                   BUF_SIZE, ev_now(EV_A));
+        if (len > 0) {
+            if (verbose) {
+                LOGI("[udp] dns cache hit: %s",
+                     get_addr_str((struct sockaddr *)src_addr));
+            }
+            if (sendto(server_ctx->fd, buf, len, 0,
+                       (struct sockaddr *)src_addr,
+                       get_sockaddr_len((struct sockaddr *)src_addr)) == -1) {
+                ERROR("[udp] dns_cache_sendto");
+            }
+            goto CLEAN_UP;
+        }
+    }
+
     char addr_header[256] = { 0 };
     char *host = server_ctx->tunnel_addr.host;
     char *port = server_ctx->tunnel_addr.port;
@@ -956,7 +1092,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     memcpy(buf, addr_header, addr_header_len);
     buf_len += addr_header_len;
 
-    char *key = hash_key(ip.version == 4 ? AF_INET : AF_INET6, &src_addr);
+    char *key = hash_key(ip.version == 4 ? AF_INET : AF_INET6, src_addr);
 
 #else
 
@@ -974,7 +1110,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     }
     char *addr_header = buf + offset;
 
-    char *key = hash_key(dst_addr.ss_family, &src_addr);
+    char *key = hash_key(dst_addr.ss_family, src_addr);
 #endif
 
     struct cache *conn_cache = server_ctx->conn_cache;
@@ -983,7 +1119,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     cache_lookup(conn_cache, key, (void *)&remote_ctx);
 
     if (remote_ctx != NULL) {
-        if (memcmp(&src_addr, &remote_ctx->src_addr, sizeof(src_addr))) {
+        if (memcmp(src_addr, &remote_ctx->src_addr, sizeof(struct sockaddr_storage))) {
             remote_ctx = NULL;
         }
     }
@@ -998,12 +1134,12 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 #ifdef UDPRELAY_REDIR
             char src[SS_ADDRSTRLEN];
             char dst[SS_ADDRSTRLEN];
-            strcpy(src, get_addr_str((struct sockaddr *)&src_addr));
-            strcpy(dst, get_addr_str((struct sockaddr *)&dst_addr));
+            strcpy(src, get_addr_str((struct sockaddr *)src_addr));
+            strcpy(dst, get_addr_str((struct sockaddr *)dst_addr));
             LOGI("[udp] cache miss: %s <-> %s", dst, src);
 #else
             LOGI("[udp] cache miss: %s:%s <-> %s", host, port,
-                 get_addr_str((struct sockaddr *)&src_addr));
+                 get_addr_str((struct sockaddr *)src_addr));
 #endif
         }
     } else {
@@ -1011,12 +1147,12 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 #ifdef UDPRELAY_REDIR
             char src[SS_ADDRSTRLEN];
             char dst[SS_ADDRSTRLEN];
-            strcpy(src, get_addr_str((struct sockaddr *)&src_addr));
-            strcpy(dst, get_addr_str((struct sockaddr *)&dst_addr));
+            strcpy(src, get_addr_str((struct sockaddr *)src_addr));
+            strcpy(dst, get_addr_str((struct sockaddr *)dst_addr));
             LOGI("[udp] cache hit: %s <-> %s", dst, src);
 #else
             LOGI("[udp] cache hit: %s:%s <-> %s", host, port,
-                 get_addr_str((struct sockaddr *)&src_addr));
+                 get_addr_str((struct sockaddr *)src_addr));
 #endif
         }
     }
@@ -1030,49 +1166,81 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 #endif
 
+    // updated in place when the server name is resolved again
     const struct sockaddr *remote_addr = server_ctx->remote_addr;
-    const int remote_addr_len = server_ctx->remote_addr_len;
+    const int remote_addr_len =
+        get_sockaddr_len((struct sockaddr *)remote_addr);
 
-    if (remote_ctx == NULL) {
-        // Bind to any port
-        int remotefd = create_remote_socket(remote_addr->sa_family == AF_INET6);
-        if (remotefd < 0) {
-            ERROR("[udp] udprelay bind() error");
+    if (remote_addr_len == 0) {
+        LOGE("[udp] drop a message since the server name is not resolved yet");
+        goto CLEAN_UP;
+    }
+
+    if (remote_ctx != NULL && server_ctx->over_tcp
+        && remote_ctx->tunnel == NULL) {
+        // its tunnel was closed, go on over a new one
+        struct uot_tunnel *tunnel = open_tunnel(EV_A_ server_ctx);
+        if (tunnel == NULL) {
             goto CLEAN_UP;
         }
-        setnonblocking(remotefd);
+        attach_remote(tunnel, remote_ctx);
+    }
+
+    if (remote_ctx == NULL) {
+        struct uot_tunnel *tunnel = NULL;
+        int remotefd = -1;
+
+        if (server_ctx->over_tcp) {
+            tunnel = open_tunnel(EV_A_ server_ctx);
+            if (tunnel == NULL) {
+                goto CLEAN_UP;
+            }
+        } else {
+            // Bind to any port
+            remotefd = create_remote_socket(remote_addr->sa_family == AF_INET6);
+            if (remotefd < 0) {
+                ERROR("[udp] udprelay bind() error");
+                goto CLEAN_UP;
+            }
+            setnonblocking(remotefd);
 
 #ifdef SO_NOSIGPIPE
-        set_nosigpipe(remotefd);
+            set_nosigpipe(remotefd);
 #endif
 #ifdef SET_INTERFACE
-        if (server_ctx->iface) {
-            setinterface(remotefd, server_ctx->iface);
-        }
+            if (server_ctx->iface) {
+                setinterface(remotefd, server_ctx->iface);
+            }
 #endif
 
 #ifdef ANDROID
-        if (vpn) {
-            if (protect_socket(remotefd) == -1) {
-                ERROR("protect_socket");
-                close(remotefd);
-                goto CLEAN_UP;
+            if (vpn) {
+                if (protect_socket(remotefd) == -1) {
+                    ERROR("protect_socket");
+                    close(remotefd);
+                    goto CLEAN_UP;
+                }
             }
-        }
 #endif
+        }
 
         // Init remote_ctx
         remote_ctx = new_remote(remotefd, server_ctx);
-        remote_ctx->src_addr = src_addr;
+        remote_ctx->src_addr = *src_addr;
         remote_ctx->af = remote_addr->sa_family;
         remote_ctx->addr_header_len = addr_header_len;
         memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
+        if (tunnel != NULL) {
+            attach_remote(tunnel, remote_ctx);
+        }
 
         // Add to conn cache
         cache_insert(conn_cache, key, (void *)remote_ctx);
 
         // Start remote io
-        ev_io_start(EV_A_ & remote_ctx->io);
+        if (remotefd != -1) {
+            ev_io_start(EV_A_ & remote_ctx->io);
+        }
         ev_timer_start(EV_A_ & remote_ctx->watcher);
 
     }
@@ -1082,6 +1250,11 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
         memmove(buf, buf + offset, buf_len);
     }
 
+    if (remote_ctx->tunnel != NULL) {
+        uot_send(EV_A_ remote_ctx->tunnel, remote_ctx->id, buf, buf_len);
+        goto CLEAN_UP;
+    }
+
     buf = ss_encrypt_all(BUF_SIZE, buf, &buf_len, server_ctx->method);
 
     int s = sendto(remote_ctx->fd, buf, buf_len, 0, remote_addr, remote_addr_len);
@@ -1095,6 +1268,13 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     int cache_hit = 0;
     int need_query = 0;
 
+    if (remote_ctx == NULL && buf_budget_exhausted()) {
+        if (verbose) {
+            LOGI("[udp] memory budget used up, new association refused");
+        }
+        goto CLEAN_UP;
+    }
+
     if (remote_ctx != NULL) {
         cache_hit = 1;
         // detect destination mismatch
@@ -1121,8 +1301,13 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 }
 #endif
                 remote_ctx = new_remote(remotefd, server_ctx);
-                remote_ctx->src_addr = src_addr;
+                remote_ctx->src_addr = *src_addr;
                 remote_ctx->server_ctx = server_ctx;
+                struct uot_tunnel *tunnel = find_tunnel(src_addr,
+                                                        &remote_ctx->id);
+                if (tunnel != NULL) {
+                    attach_remote(tunnel, remote_ctx);
+                }
                 remote_ctx->addr_header_len = addr_header_len;
                 memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
             } else {
@@ -1156,6 +1341,11 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
             }
         }
     } else {
+        if (buf_budget_exhausted()) {
+            // no room to hold the packet while resolving
+            goto CLEAN_UP;
+        }
+
         struct addrinfo hints;
         memset(&hints, 0, sizeof(hints));
         hints.ai_family = AF_UNSPEC;
@@ -1167,7 +1357,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
                 addr_header_len);
         query_ctx->server_ctx = server_ctx;
         query_ctx->addr_header_len = addr_header_len;
-        query_ctx->src_addr = src_addr;
+        query_ctx->src_addr = *src_addr;
         memcpy(query_ctx->addr_header, addr_header, addr_header_len);
 
         if (need_query) {
@@ -1189,6 +1379,456 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
     free(buf);
 }
 
+/*
+ * UDP over TCP
+ */
+
+static char *uot_buf_reserve(struct uot_buf *buf, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        buf->size = max(buf->size * 2, buf->len + len);
+        buf->data = realloc(buf->data, buf->size);
+    }
+    return buf->data + buf->len;
+}
+
+static void uot_buf_free(struct uot_buf *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(struct uot_buf));
+}
+
+#ifdef UDPRELAY_REMOTE
+/*
+ * Packets from a tunnel get a made-up source address naming the tunnel and
+ * the association, which keys them in the association table like any other
+ * source.
+ */
+struct uot_addr {
+    sa_family_t family;
+    uint32_t serial;
+    uint32_t id;
+};
+
+static void tunnel_src_addr(struct uot_tunnel *tunnel, uint32_t id,
+                            struct sockaddr_storage *addr)
+{
+    struct uot_addr uot_addr;
+    memset(&uot_addr, 0, sizeof(struct uot_addr));
+    uot_addr.family = AF_UNSPEC;
+    uot_addr.serial = tunnel->serial;
+    uot_addr.id     = id;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    memcpy(addr, &uot_addr, sizeof(struct uot_addr));
+}
+
+static struct uot_tunnel *find_tunnel(const struct sockaddr_storage *addr,
+                                      uint32_t *id)
+{
+    struct uot_addr uot_addr;
+    struct uot_tunnel *tunnel = NULL;
+
+    if (addr->ss_family != AF_UNSPEC) {
+        return NULL;
+    }
+
+    memcpy(&uot_addr, addr, sizeof(struct uot_addr));
+    HASH_FIND(hh, tunnels, &uot_addr.serial, sizeof(uint32_t), tunnel);
+    *id = uot_addr.id;
+
+    return tunnel;
+}
+#endif
+
+static void attach_remote(struct uot_tunnel *tunnel,
+                          struct remote_ctx *remote_ctx)
+{
+#ifdef UDPRELAY_LOCAL
+    struct remote_ctx *used;
+    do {
+        remote_ctx->id = tunnel->next_id++;
+        HASH_FIND(hh, tunnel->assocs, &remote_ctx->id, sizeof(uint32_t), used);
+    } while (used != NULL || remote_ctx->id == 0);
+#endif
+
+    remote_ctx->tunnel = tunnel;
+    HASH_ADD(hh, tunnel->assocs, id, sizeof(uint32_t), remote_ctx);
+    tunnel->assoc_num++;
+}
+
+static struct uot_tunnel *new_tunnel(EV_P_ int fd, struct enc_ctx *e_ctx,
+                                     struct enc_ctx *d_ctx,
+                                     struct server_ctx *server_ctx)
+{
+    struct uot_tunnel *tunnel = malloc(sizeof(struct uot_tunnel));
+    memset(tunnel, 0, sizeof(struct uot_tunnel));
+
+    tunnel->fd         = fd;
+    tunnel->e_ctx      = e_ctx;
+    tunnel->d_ctx      = d_ctx;
+    tunnel->server_ctx = server_ctx;
+    tunnel->next_id    = 1;
+    tunnel->rbuf       = malloc(BUF_SIZE);
+    ev_io_init(&tunnel->recv_io, uot_recv_cb, fd, EV_READ);
+    ev_io_init(&tunnel->send_io, uot_send_cb, fd, EV_WRITE);
+    ev_timer_init(&tunnel->watcher, uot_timeout_cb, server_ctx->timeout,
+                  server_ctx->timeout);
+    ev_timer_start(EV_A_ & tunnel->watcher);
+
+    return tunnel;
+}
+
+static void close_tunnel(EV_P_ struct uot_tunnel *tunnel)
+{
+    struct remote_ctx *remote_ctx, *tmp;
+
+    if (verbose) {
+        LOGI("[udp] tunnel closed with %d associations", tunnel->assoc_num);
+    }
+
+    // associations stay until they time out, ss-local moves them over to
+    // a new tunnel with their next packet
+    HASH_ITER(hh, tunnel->assocs, remote_ctx, tmp){
+        HASH_DEL(tunnel->assocs, remote_ctx);
+        remote_ctx->tunnel = NULL;
+    }
+
+#ifdef UDPRELAY_LOCAL
+    tunnel->server_ctx->tunnel = NULL;
+#else
+    HASH_DEL(tunnels, tunnel);
+#endif
+
+    ev_io_stop(EV_A_ & tunnel->recv_io);
+    ev_io_stop(EV_A_ & tunnel->send_io);
+    ev_timer_stop(EV_A_ & tunnel->watcher);
+    close(tunnel->fd);
+
+    if (tunnel->e_ctx != NULL) {
+        cipher_context_release(&tunnel->e_ctx->evp);
+        free(tunnel->e_ctx);
+    }
+    if (tunnel->d_ctx != NULL) {
+        cipher_context_release(&tunnel->d_ctx->evp);
+        free(tunnel->d_ctx);
+    }
+    free(tunnel->rbuf);
+    uot_buf_free(&tunnel->in);
+    uot_buf_free(&tunnel->plain);
+    uot_buf_free(&tunnel->wire);
+    free(tunnel);
+}
+
+/*
+ * Frames are gathered in plain text and encrypted together once the tunnel
+ * is writable, so the datagrams relayed within one loop iteration go out in
+ * a single write.
+ */
+static void uot_send(EV_P_ struct uot_tunnel *tunnel, uint32_t id,
+                     const char *buf, ssize_t len)
+{
+    size_t queued = tunnel->plain.len + tunnel->wire.len - tunnel->wire.idx;
+
+    if (len > 0xffff) {
+        LOGE("[udp] drop a message too large for the tunnel");
+        return;
+    }
+    if (queued > UOT_HIGH_WATER) {
+        if (verbose) {
+            LOGI("[udp] drop a message since the tunnel is congested");
+        }
+        return;
+    }
+
+    uint8_t *p = (uint8_t *)uot_buf_reserve(&tunnel->plain,
+                                            UOT_HEADER_LEN + len);
+    p[0] = len >> 8;
+    p[1] = len;
+    p[2] = id >> 24;
+    p[3] = id >> 16;
+    p[4] = id >> 8;
+    p[5] = id;
+    memcpy(p + UOT_HEADER_LEN, buf, len);
+    tunnel->plain.len += UOT_HEADER_LEN + len;
+
+    if (tunnel->connected) {
+        ev_io_start(EV_A_ & tunnel->send_io);
+    }
+}
+
+static void receive_datagram(EV_P_ struct uot_tunnel *tunnel, uint32_t id,
+                             const char *data, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+
+#ifdef UDPRELAY_LOCAL
+    struct remote_ctx *remote_ctx;
+    HASH_FIND(hh, tunnel->assocs, &id, sizeof(uint32_t), remote_ctx);
+    if (remote_ctx == NULL) {
+        // timed out meanwhile
+        return;
+    }
+
+    char *buf = malloc(len);
+    memcpy(buf, data, len);
+    send_to_client(EV_A_ remote_ctx, buf, len, NULL);
+#else
+    struct sockaddr_storage src_addr;
+    tunnel_src_addr(tunnel, id, &src_addr);
+
+    char *buf = malloc(len);
+    memcpy(buf, data, len);
+    handle_packet(EV_A_ tunnel->server_ctx, &src_addr, buf, len);
+#endif
+}
+
+static void parse_frames(EV_P_ struct uot_tunnel *tunnel)
+{
+    struct uot_buf *in = &tunnel->in;
+
+    while (in->len - in->idx >= UOT_HEADER_LEN) {
+        const uint8_t *p = (const uint8_t *)in->data + in->idx;
+        size_t len  = (p[0] << 8) | p[1];
+        uint32_t id = ((uint32_t)p[2] << 24) | (p[3] << 16) | (p[4] << 8)
+                      | p[5];
+        if (in->len - in->idx < UOT_HEADER_LEN + len) {
+            break;
+        }
+        in->idx += UOT_HEADER_LEN + len;
+        receive_datagram(EV_A_ tunnel, id, (const char *)p + UOT_HEADER_LEN,
+                         len);
+    }
+
+    // keep the partial frame at the front
+    memmove(in->data, in->data + in->idx, in->len - in->idx);
+    in->len -= in->idx;
+    in->idx  = 0;
+}
+
+static void uot_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    struct uot_tunnel *tunnel = cork_container_of(w, struct uot_tunnel,
+                                                  recv_io);
+
+    ssize_t r = recv(tunnel->fd, tunnel->rbuf + tunnel->rbuf_len,
+                     BUF_SIZE - tunnel->rbuf_len, 0);
+
+    if (r == 0) {
+        close_tunnel(EV_A_ tunnel);
+        return;
+    } else if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        ERROR("[udp] tunnel_recv");
+        close_tunnel(EV_A_ tunnel);
+        return;
+    }
+
+#ifdef UDPRELAY_REMOTE
+    tx += r;
+#endif
+
+    // the IV has to arrive in one piece
+    r += tunnel->rbuf_len;
+    if (tunnel->d_ctx != NULL && !tunnel->d_ctx->init
+        && r <= enc_get_iv_len()) {
+        tunnel->rbuf_len = r;
+        return;
+    }
+    tunnel->rbuf_len = 0;
+
+    tunnel->rbuf = ss_decrypt(BUF_SIZE, tunnel->rbuf, &r, tunnel->d_ctx);
+    if (tunnel->rbuf == NULL) {
+        LOGE("[udp] invalid password or cipher");
+        close_tunnel(EV_A_ tunnel);
+        return;
+    }
+
+    memcpy(uot_buf_reserve(&tunnel->in, r), tunnel->rbuf, r);
+    tunnel->in.len += r;
+    parse_frames(EV_A_ tunnel);
+}
+
+static void uot_send_cb(EV_P_ ev_io *w, int revents)
+{
+    struct uot_tunnel *tunnel = cork_container_of(w, struct uot_tunnel,
+                                                  send_io);
+    struct uot_buf *wire = &tunnel->wire;
+
+    if (!tunnel->connected) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof addr;
+        if (getpeername(tunnel->fd, (struct sockaddr *)&addr, &len) == -1) {
+            ERROR("[udp] tunnel_connect");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+        tunnel->connected = 1;
+        ev_io_start(EV_A_ & tunnel->recv_io);
+    }
+
+    if (tunnel->plain.len > 0) {
+        ssize_t len = tunnel->plain.len;
+        size_t size = tunnel->plain.size;
+        char *buf   = ss_encrypt(size, tunnel->plain.data, &len,
+                                 tunnel->e_ctx);
+        memset(&tunnel->plain, 0, sizeof(struct uot_buf));
+        if (buf == NULL) {
+            LOGE("[udp] invalid password or cipher");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+
+        if (wire->idx == wire->len) {
+            // hand the buffer over instead of copying it
+            tunnel->plain.data = wire->data;
+            tunnel->plain.size = wire->size;
+            wire->data = buf;
+            wire->size = max(size, (size_t)len);
+            wire->len  = len;
+            wire->idx  = 0;
+        } else {
+            memcpy(uot_buf_reserve(wire, len), buf, len);
+            wire->len += len;
+            free(buf);
+        }
+    }
+
+    while (wire->idx < wire->len) {
+        ssize_t s = send(tunnel->fd, wire->data + wire->idx,
+                         wire->len - wire->idx, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            ERROR("[udp] tunnel_send");
+            close_tunnel(EV_A_ tunnel);
+            return;
+        }
+        wire->idx += s;
+    }
+
+    wire->len = 0;
+    wire->idx = 0;
+    ev_io_stop(EV_A_ & tunnel->send_io);
+}
+
+static void uot_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct uot_tunnel *tunnel = cork_container_of(watcher, struct uot_tunnel,
+                                                  watcher);
+
+    if (tunnel->connected && tunnel->assoc_num > 0) {
+        return;
+    }
+
+    close_tunnel(EV_A_ tunnel);
+}
+
+#ifdef UDPRELAY_LOCAL
+/*
+ * The tunnel to the server, connecting one if there is none
+ */
+static struct uot_tunnel *open_tunnel(EV_P_ struct server_ctx *server_ctx)
+{
+    if (server_ctx->tunnel != NULL) {
+        return server_ctx->tunnel;
+    }
+
+    const struct sockaddr *remote_addr = server_ctx->remote_addr;
+    int fd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        ERROR("[udp] tunnel_socket");
+        return NULL;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(fd);
+#endif
+    setnonblocking(fd);
+#ifdef SET_INTERFACE
+    if (server_ctx->iface) {
+        setinterface(fd, server_ctx->iface);
+    }
+#endif
+#ifdef ANDROID
+    if (vpn && protect_socket(fd) == -1) {
+        ERROR("protect_socket");
+        close(fd);
+        return NULL;
+    }
+#endif
+
+    connect(fd, remote_addr, get_sockaddr_len((struct sockaddr *)remote_addr));
+
+    struct enc_ctx *e_ctx = NULL;
+    struct enc_ctx *d_ctx = NULL;
+    if (server_ctx->method) {
+        e_ctx = malloc(sizeof(struct enc_ctx));
+        d_ctx = malloc(sizeof(struct enc_ctx));
+        enc_ctx_init(server_ctx->method, e_ctx, 1);
+        enc_ctx_init(server_ctx->method, d_ctx, 0);
+    }
+
+    struct uot_tunnel *tunnel = new_tunnel(EV_A_ fd, e_ctx, d_ctx, server_ctx);
+
+    // the address header turning the connection into a tunnel
+    *uot_buf_reserve(&tunnel->plain, 1) = UOT_ADDRTYPE;
+    tunnel->plain.len++;
+
+    // fires once connected
+    ev_io_start(EV_A_ & tunnel->send_io);
+
+    server_ctx->tunnel = tunnel;
+
+    if (verbose) {
+        LOGI("[udp] tunnel to the server opened");
+    }
+
+    return tunnel;
+}
+#endif
+
+#ifdef UDPRELAY_REMOTE
+/*
+ * Take over a connection whose address header asked for a tunnel. The
+ * cipher contexts now belong to the tunnel, and frames holds what was
+ * decrypted after the header.
+ */
+void udprelay_accept(EV_P_ int fd, struct enc_ctx *e_ctx,
+                     struct enc_ctx *d_ctx, const char *frames, int len)
+{
+    struct uot_tunnel *tunnel = new_tunnel(EV_A_ fd, e_ctx, d_ctx,
+                                           server_ctx_list[0]);
+    struct uot_tunnel *used;
+
+    do {
+        tunnel->serial = ++tunnel_serial;
+        HASH_FIND(hh, tunnels, &tunnel->serial, sizeof(uint32_t), used);
+    } while (used != NULL || tunnel->serial == 0);
+    HASH_ADD(hh, tunnels, serial, sizeof(uint32_t), tunnel);
+
+    tunnel->connected = 1;
+    ev_io_start(EV_A_ & tunnel->recv_io);
+
+    if (verbose) {
+        LOGI("[udp] tunnel accepted");
+    }
+
+    if (len > 0) {
+        memcpy(uot_buf_reserve(&tunnel->in, len), frames, len);
+        tunnel->in.len += len;
+        parse_frames(EV_A_ tunnel);
+    }
+}
+#endif
+
 void free_cb(void *element)
 {
     struct remote_ctx *remote_ctx = (struct remote_ctx *)element;
@@ -1202,9 +1842,9 @@ void free_cb(void *element)
 
 int init_udprelay(const char *server_host, const char *server_port,
 #ifdef UDPRELAY_LOCAL
-                  const struct sockaddr *remote_addr, const int remote_addr_len,
+                  const struct sockaddr *remote_addr, int over_tcp,
 #ifdef UDPRELAY_TUNNEL
-                  const ss_addr_t tunnel_addr,
+                  const ss_addr_t tunnel_addr, int dns_cache,
 #endif
 #endif
                   int method, int timeout, const char *iface)
@@ -1219,12 +1859,21 @@ int init_udprelay(const char *server_host, const char *server_port,
     //////////////////////////////////////////////////
     // Setup server context
 
-    // Bind to port
-    int serverfd = create_server_socket(server_host, server_port);
+    // Bind to port, unless the previous ss-server handed it over
+    int serverfd = -1;
+#ifdef UDPRELAY_REMOTE
+    serverfd = handoff_take(HANDOFF_UDP, server_host, server_port);
+#endif
+    if (serverfd == -1) {
+        serverfd = create_server_socket(server_host, server_port);
+    }
     if (serverfd < 0) {
         FATAL("[udp] bind() error");
     }
     setnonblocking(serverfd);
+#ifdef UDPRELAY_REMOTE
+    handoff_register(HANDOFF_UDP, server_host, server_port, serverfd);
+#endif
 
     struct server_ctx *server_ctx = new_server_ctx(serverfd);
 #ifdef UDPRELAY_REMOTE
@@ -1236,9 +1885,13 @@ int init_udprelay(const char *server_host, const char *server_port,
     server_ctx->conn_cache = conn_cache;
 #ifdef UDPRELAY_LOCAL
     server_ctx->remote_addr = remote_addr;
-    server_ctx->remote_addr_len = remote_addr_len;
+    server_ctx->over_tcp = over_tcp;
 #ifdef UDPRELAY_TUNNEL
     server_ctx->tunnel_addr = tunnel_addr;
+    if (dns_cache) {
+        LOGI("[udp] DNS response cache enabled");
+        dns_cache_create(&server_ctx->dns_cache, DNS_CACHE_SIZE);
+    }
 #endif
 #endif
 
@@ -1249,14 +1902,52 @@ int init_udprelay(const char *server_host, const char *server_port,
     return 0;
 }
 
+#ifdef UDPRELAY_REMOTE
+/*
+ * Stop receiving on the server sockets, which another process reads from
+ * now. Replies to open associations still go out through them.
+ */
+void drain_udprelay(void)
+{
+    struct ev_loop *loop = EV_DEFAULT;
+
+    for (int i = 0; i < server_num; i++) {
+        ev_io_stop(loop, &server_ctx_list[i]->io);
+    }
+}
+#endif
+
 void free_udprelay()
 {
     struct ev_loop *loop = EV_DEFAULT;
+
+#ifdef UDPRELAY_REMOTE
+    struct uot_tunnel *tunnel, *tmp;
+    HASH_ITER(hh, tunnels, tunnel, tmp){
+        close_tunnel(loop, tunnel);
+    }
+#endif
+
     while (server_num-- > 0) {
         struct server_ctx *server_ctx = server_ctx_list[server_num];
         ev_io_stop(loop, &server_ctx->io);
         close(server_ctx->fd);
+#ifdef UDPRELAY_LOCAL
+        if (server_ctx->tunnel != NULL) {
+            close_tunnel(loop, server_ctx->tunnel);
+        }
+#endif
         cache_delete(server_ctx->conn_cache, 0);
+#ifdef UDPRELAY_TUNNEL
+        if (server_ctx->dns_cache != NULL) {
+            if (verbose) {
+                LOGI("[udp] dns cache: %zu hits, %zu misses",
+                     server_ctx->dns_cache->hits,
+                     server_ctx->dns_cache->misses);
+            }
+            dns_cache_delete(server_ctx->dns_cache);
+        }
+#endif
         free(server_ctx);
         server_ctx_list[server_num] = NULL;
     }
@@ -34,6 +34,11 @@
 #endif
 
 #include "cache.h"
+#include "uthash.h"
+
+#ifdef UDPRELAY_TUNNEL
+#include "dnscache.h"
+#endif
 
 #include "common.h"
 
@@ -41,6 +46,52 @@
 
 #define MTU 1397 // 1492 - 1 - 28 - 2 - 64 = 1397, the default MTU for UDP relay
 
+/*
+ * UDP over TCP: after the address header UOT_ADDRTYPE, the encrypted stream
+ * carries one frame per datagram, in both directions:
+ *
+ *    +--------+----------+------+----------+----------+----------+
+ *    | LENGTH |    ID    | ATYP | DST.ADDR | DST.PORT |   DATA   |
+ *    +--------+----------+------+----------+----------+----------+
+ *    |   2    |    4     |  1   | Variable |    2     | Variable |
+ *    +--------+----------+------+----------+----------+----------+
+ *
+ * LENGTH counts from ATYP on. ID names the association, chosen by the
+ * local side, and the server answers with the same ID.
+ */
+#define UOT_HEADER_LEN 6
+#define UOT_HIGH_WATER (1024 * 1024) // drop datagrams above this backlog
+
+struct uot_buf {
+    char *data;
+    size_t len;
+    size_t idx;
+    size_t size;
+};
+
+struct remote_ctx;
+
+struct uot_tunnel {
+    ev_io recv_io;
+    ev_io send_io;
+    ev_timer watcher;
+    int fd;
+    int connected;
+    uint32_t serial;            /**<Names the tunnel on ss-server */
+    uint32_t next_id;
+    int assoc_num;
+    struct enc_ctx *e_ctx;
+    struct enc_ctx *d_ctx;
+    char *rbuf;                 /**<Ciphertext being received */
+    ssize_t rbuf_len;
+    struct uot_buf in;          /**<Decrypted, not yet parsed */
+    struct uot_buf plain;       /**<Frames not yet encrypted */
+    struct uot_buf wire;        /**<Encrypted, not yet sent */
+    struct server_ctx *server_ctx;
+    struct remote_ctx *assocs;  /**<Associations by ID */
+    UT_hash_handle hh;          /**<Tunnels by serial, on ss-server */
+};
+
 struct server_ctx {
     ev_io io;
     int fd;
@@ -50,9 +101,11 @@ struct server_ctx {
     struct cache *conn_cache;
 #ifdef UDPRELAY_LOCAL
     const struct sockaddr *remote_addr;
-    int remote_addr_len;
+    int over_tcp;
+    struct uot_tunnel *tunnel;  // opened on demand when over_tcp
 #ifdef UDPRELAY_TUNNEL
     ss_addr_t tunnel_addr;
+    struct dns_cache *dns_cache; // set when tunneling to port 53
 #endif
 #endif
 #ifdef UDPRELAY_REMOTE
@@ -82,6 +135,9 @@ struct remote_ctx {
     char addr_header[384];
     struct sockaddr_storage src_addr;
     struct server_ctx *server_ctx;
+    struct uot_tunnel *tunnel;  // NULL once the tunnel is closed
+    uint32_t id;
+    UT_hash_handle hh;
 };
 
 #ifdef ANDROID
@@ -0,0 +1,902 @@
+/*
+ * uring.c - Relay established sessions of ss-server with io_uring
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "utils.h"
+#include "uring.h"
+
+// provided buffer rings and multishot accept both came with Linux 5.19
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_ACCEPT_MULTISHOT)
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "bufpool.h"
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES (URING_ENTRIES * 16)
+#define URING_BUFFERS 256   // power of two
+#define URING_GROUP 0
+#define URING_CHUNK (16 * 1024)
+#define URING_BUF_SIZE (URING_CHUNK + 64) // room for an IV or cipher padding
+
+// what a completion belongs to, kept in the low bits of its user_data
+#define URING_OP_RECV   1
+#define URING_OP_SEND   2
+#define URING_OP_ACCEPT 3
+#define URING_OP_MASK   3
+
+#define URING_ACCEPT_RETRY 1.0 // seconds to wait when out of descriptors
+
+extern int verbose;
+extern uint64_t tx;
+extern uint64_t rx;
+
+struct uring_chunk {
+    char *buf;
+    size_t idx;
+    size_t len;
+};
+
+struct uring_dir {
+    int from;                   /**<Socket received from */
+    int to;                     /**<Socket sent to */
+    int encrypt;                /**<Encrypt what is received, or decrypt it */
+    struct enc_ctx *ctx;
+    int recving;                /**<A receive is in flight */
+    int sending;                /**<A send is in flight */
+    int starved;                /**<Waiting for buffers to receive again */
+    int eof;
+    int max;                    /**<Chunks queued before receiving pauses */
+    int head;
+    int num;
+    struct uring_chunk *chunks;
+    struct iovec *iov;
+    struct msghdr msg;
+    uint64_t bytes;
+    const char *eof_reason;
+    const char *recv_reason;
+    const char *send_reason;
+    struct uring_relay *relay;
+    struct cork_dllist_item starved_entries;
+};
+
+struct uring_relay {
+    ev_timer watcher;
+    struct uring_dir up;        /**<From the client to the remote */
+    struct uring_dir down;      /**<From the remote to the client */
+    int closing;
+    const char *reason;
+    void *data;                 /**<NULL once aborted */
+    struct cork_dllist_item entries;
+};
+
+struct uring_listener {
+    ev_timer watcher;           /**<Accepts again after running out of fds */
+    int fd;
+    void *data;
+    struct cork_dllist_item entries;
+};
+
+static struct {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_queued;         /**<Tail including entries not yet entered */
+    unsigned sq_entered;        /**<Tail the kernel has been told about */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs[URING_BUFFERS];
+    ev_io io;
+    ev_prepare prepare;
+    ev_check check;
+    struct cork_dllist relays;
+    struct cork_dllist listeners;
+    struct cork_dllist starved;
+    struct uring_config config;
+} ring;
+
+static struct buf_pool pool = BUF_POOL_INIT(URING_BUF_SIZE);
+
+static void relay_recv(EV_P_ struct uring_dir *dir);
+static void relay_send(EV_P_ struct uring_dir *dir);
+static void relay_close(EV_P_ struct uring_relay *relay, const char *reason);
+static void listener_accept(EV_P_ struct uring_listener *listener);
+
+static int ring_enter(unsigned to_submit, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, flags, NULL, 0);
+}
+
+static void ring_submit(void)
+{
+    unsigned num = ring.sq_queued - ring.sq_entered;
+    int ret;
+
+    if (num == 0) {
+        return;
+    }
+
+    __atomic_store_n(ring.sq_tail, ring.sq_queued, __ATOMIC_RELEASE);
+    ret = ring_enter(num, 0);
+    if (ret < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ERROR("io_uring_enter");
+        }
+        return;
+    }
+    ring.sq_entered += ret;
+}
+
+static struct io_uring_sqe *ring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring.sq_queued - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+        >= ring.sq_entries) {
+        ring_submit();
+        if (ring.sq_queued - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+            >= ring.sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &ring.sqes[ring.sq_queued & ring.sq_mask];
+    ring.sq_queued++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void ring_cancel(uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe();
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = user_data;
+    sqe->user_data = 0;
+}
+
+/*
+ * Post a fresh buffer under the given id. Buffers waiting in the ring are
+ * not charged against the budget, only those holding data are.
+ */
+static void ring_post_buffer(unsigned short bid)
+{
+    struct io_uring_buf *slot;
+    char *buf = buf_pool_get(&pool);
+
+    buf_used -= pool.size;
+    ring.bufs[bid] = buf;
+
+    slot       = &ring.br->bufs[ring.br_tail & (URING_BUFFERS - 1)];
+    slot->addr = (uintptr_t)buf;
+    slot->len  = URING_CHUNK;
+    slot->bid  = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static char *ring_take_buffer(unsigned flags)
+{
+    unsigned short bid;
+    char *buf;
+
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return NULL;
+    }
+
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = ring.bufs[bid];
+    buf_used += pool.size;
+    ring_post_buffer(bid);
+    return buf;
+}
+
+static void dir_init(struct uring_dir *dir, struct uring_relay *relay,
+                     int from, int to, int encrypt, struct enc_ctx *ctx,
+                     int max, const char *eof_reason,
+                     const char *recv_reason, const char *send_reason)
+{
+    dir->from        = from;
+    dir->to          = to;
+    dir->encrypt     = encrypt;
+    dir->ctx         = ctx;
+    dir->max         = max > 0 ? max : 1;
+    dir->chunks      = malloc(dir->max * sizeof(struct uring_chunk));
+    dir->iov         = malloc(dir->max * sizeof(struct iovec));
+    dir->eof_reason  = eof_reason;
+    dir->recv_reason = recv_reason;
+    dir->send_reason = send_reason;
+    dir->relay       = relay;
+}
+
+static void dir_free(struct uring_dir *dir)
+{
+    if (dir->starved) {
+        cork_dllist_remove(&dir->starved_entries);
+        dir->starved = 0;
+    }
+    while (dir->num > 0) {
+        buf_pool_put(&pool, dir->chunks[dir->head].buf);
+        dir->head = (dir->head + 1) % dir->max;
+        dir->num--;
+    }
+    free(dir->chunks);
+    free(dir->iov);
+}
+
+static void dir_starve(struct uring_dir *dir)
+{
+    if (!dir->starved) {
+        dir->starved = 1;
+        cork_dllist_add(&ring.starved, &dir->starved_entries);
+    }
+}
+
+static void dir_cancel(struct uring_dir *dir)
+{
+    if (dir->starved) {
+        cork_dllist_remove(&dir->starved_entries);
+        dir->starved = 0;
+    }
+    if (dir->recving) {
+        ring_cancel((uintptr_t)dir | URING_OP_RECV);
+    }
+    if (dir->sending) {
+        ring_cancel((uintptr_t)dir | URING_OP_SEND);
+    }
+}
+
+/*
+ * Free the relay once the kernel no longer refers to it
+ */
+static void relay_finish(EV_P_ struct uring_relay *relay)
+{
+    if (relay->up.recving || relay->up.sending
+        || relay->down.recving || relay->down.sending) {
+        return;
+    }
+
+    dir_free(&relay->up);
+    dir_free(&relay->down);
+    cork_dllist_remove(&relay->entries);
+
+    if (relay->data != NULL) {
+        ring.config.close(EV_A_ relay->data, relay->reason,
+                          relay->up.bytes, relay->down.bytes);
+    }
+    free(relay);
+}
+
+static void relay_close(EV_P_ struct uring_relay *relay, const char *reason)
+{
+    if (relay->closing) {
+        return;
+    }
+
+    relay->closing = 1;
+    relay->reason  = reason;
+    ev_timer_stop(EV_A_ & relay->watcher);
+
+    dir_cancel(&relay->up);
+    dir_cancel(&relay->down);
+    relay_finish(EV_A_ relay);
+}
+
+static void relay_recv(EV_P_ struct uring_dir *dir)
+{
+    struct io_uring_sqe *sqe;
+
+    if (dir->recving || dir->starved || dir->eof || dir->relay->closing
+        || dir->num >= dir->max) {
+        return;
+    }
+
+    if (buf_budget_exhausted() || (sqe = ring_get_sqe()) == NULL) {
+        dir_starve(dir);
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = dir->from;
+    sqe->len       = URING_CHUNK;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = (uintptr_t)dir | URING_OP_RECV;
+    dir->recving   = 1;
+}
+
+/*
+ * Send everything queued in one go, the next send waits for this one
+ */
+static void relay_send(EV_P_ struct uring_dir *dir)
+{
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if (dir->sending || dir->num == 0) {
+        return;
+    }
+
+    sqe = ring_get_sqe();
+    if (sqe == NULL) {
+        relay_close(EV_A_ dir->relay, dir->send_reason);
+        return;
+    }
+
+    for (i = 0; i < dir->num; i++) {
+        struct uring_chunk *chunk = &dir->chunks[(dir->head + i) % dir->max];
+        dir->iov[i].iov_base = chunk->buf + chunk->idx;
+        dir->iov[i].iov_len  = chunk->len;
+    }
+    memset(&dir->msg, 0, sizeof(dir->msg));
+    dir->msg.msg_iov    = dir->iov;
+    dir->msg.msg_iovlen = dir->num;
+
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = dir->to;
+    sqe->addr      = (uintptr_t)&dir->msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)dir | URING_OP_SEND;
+    dir->sending   = 1;
+}
+
+static void relay_recv_done(EV_P_ struct uring_dir *dir, int res,
+                            unsigned flags)
+{
+    struct uring_relay *relay = dir->relay;
+    char *buf                 = ring_take_buffer(flags);
+    ssize_t len               = res;
+
+    dir->recving = 0;
+
+    if (relay->closing || res <= 0) {
+        if (buf != NULL) {
+            buf_pool_put(&pool, buf);
+        }
+    }
+
+    if (relay->closing) {
+        relay_finish(EV_A_ relay);
+        return;
+    }
+
+    if (res == -ENOBUFS || res == -EAGAIN || res == -EINTR) {
+        dir_starve(dir);
+        return;
+    } else if (res < 0) {
+        errno = -res;
+        if (verbose) {
+            ERROR("uring recv");
+        }
+        relay_close(EV_A_ relay, dir->recv_reason);
+        return;
+    } else if (res == 0) {
+        dir->eof = 1;
+        if (!dir->sending && dir->num == 0) {
+            relay_close(EV_A_ relay, dir->eof_reason);
+        }
+        return;
+    }
+
+    ev_timer_again(EV_A_ & relay->watcher);
+
+    if (dir->encrypt) {
+        rx += res;
+        buf = ss_encrypt(URING_BUF_SIZE, buf, &len, dir->ctx);
+    } else {
+        tx += res;
+        buf = ss_decrypt(URING_BUF_SIZE, buf, &len, dir->ctx);
+    }
+    dir->bytes += res;
+
+    if (buf == NULL) {
+        buf_pool_drop(&pool);
+        LOGE("invalid password or cipher");
+        relay_close(EV_A_ relay, "bad_cipher");
+        return;
+    }
+
+    if (len > 0) {
+        struct uring_chunk *chunk =
+            &dir->chunks[(dir->head + dir->num) % dir->max];
+        chunk->buf = buf;
+        chunk->idx = 0;
+        chunk->len = len;
+        dir->num++;
+        relay_send(EV_A_ dir);
+    } else {
+        buf_pool_put(&pool, buf);
+    }
+
+    relay_recv(EV_A_ dir);
+}
+
+static void relay_send_done(EV_P_ struct uring_dir *dir, int res)
+{
+    struct uring_relay *relay = dir->relay;
+    size_t sent;
+
+    dir->sending = 0;
+
+    if (relay->closing) {
+        relay_finish(EV_A_ relay);
+        return;
+    }
+
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        errno = -res;
+        if (verbose) {
+            ERROR("uring send");
+        }
+        relay_close(EV_A_ relay, dir->send_reason);
+        return;
+    }
+
+    ev_timer_again(EV_A_ & relay->watcher);
+
+    sent = res > 0 ? res : 0;
+    while (sent > 0 && dir->num > 0) {
+        struct uring_chunk *chunk = &dir->chunks[dir->head];
+        if (sent < chunk->len) {
+            chunk->idx += sent;
+            chunk->len -= sent;
+            break;
+        }
+        sent -= chunk->len;
+        buf_pool_put(&pool, chunk->buf);
+        dir->head = (dir->head + 1) % dir->max;
+        dir->num--;
+    }
+
+    if (dir->num > 0) {
+        relay_send(EV_A_ dir);
+    } else if (dir->eof) {
+        relay_close(EV_A_ relay, dir->eof_reason);
+        return;
+    }
+
+    relay_recv(EV_A_ dir);
+}
+
+static void relay_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct uring_relay *relay = cork_container_of(watcher, struct uring_relay,
+                                                  watcher);
+
+    if (verbose) {
+        LOGI("TCP connection timeout");
+    }
+
+    relay_close(EV_A_ relay, "timeout");
+}
+
+static void listener_accept_done(EV_P_ struct uring_listener *listener,
+                                 int res, unsigned flags)
+{
+    if (listener->fd == -1) {
+        // a connection accepted before cancelling is served all the same
+        if (res >= 0) {
+            ring.config.accept(EV_A_ res, listener->data);
+        }
+        return;
+    }
+
+    if (res >= 0) {
+        ring.config.accept(EV_A_ res, listener->data);
+    } else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+        errno = -res;
+        ERROR("accept");
+    }
+
+    if (flags & IORING_CQE_F_MORE) {
+        return;
+    }
+
+    if (res == -EMFILE || res == -ENFILE) {
+        ev_timer_start(EV_A_ & listener->watcher);
+    } else if (res != -ECANCELED) {
+        listener_accept(EV_A_ listener);
+    }
+}
+
+static void listener_accept(EV_P_ struct uring_listener *listener)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe();
+
+    if (sqe == NULL) {
+        ev_timer_start(EV_A_ & listener->watcher);
+        return;
+    }
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listener->fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = (uintptr_t)listener | URING_OP_ACCEPT;
+}
+
+static void listener_retry_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct uring_listener *listener =
+        cork_container_of(watcher, struct uring_listener, watcher);
+
+    listener_accept(EV_A_ listener);
+}
+
+static void ring_complete(EV_P_ uint64_t user_data, int res, unsigned flags)
+{
+    void *ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (user_data & URING_OP_MASK) {
+    case URING_OP_RECV:
+        relay_recv_done(EV_A_ ptr, res, flags);
+        break;
+    case URING_OP_SEND:
+        relay_send_done(EV_A_ ptr, res);
+        break;
+    case URING_OP_ACCEPT:
+        listener_accept_done(EV_A_ ptr, res, flags);
+        break;
+    default:
+        // cancellations
+        break;
+    }
+}
+
+static void ring_cb(EV_P_ ev_io *w, int revents)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail;
+
+    for (;;) {
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // completions the kernel could not fit are flushed on entering
+            if (!(__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED)
+                  & IORING_SQ_CQ_OVERFLOW)
+                || ring_enter(0, IORING_ENTER_GETEVENTS) < 0
+                || head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            uint64_t user_data       = cqe->user_data;
+            int res                  = cqe->res;
+            unsigned flags           = cqe->flags;
+
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            ring_complete(EV_A_ user_data, res, flags);
+        }
+    }
+}
+
+static void ring_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+    ring_submit();
+}
+
+static void ring_check_cb(EV_P_ ev_check *w, int revents)
+{
+    struct cork_dllist_item *curr, *next;
+
+    if (cork_dllist_is_empty(&ring.starved) || buf_budget_exhausted()) {
+        return;
+    }
+
+    cork_dllist_foreach_void(&ring.starved, curr, next) {
+        struct uring_dir *dir =
+            cork_container_of(curr, struct uring_dir, starved_entries);
+        cork_dllist_remove(&dir->starved_entries);
+        dir->starved = 0;
+        relay_recv(EV_A_ dir);
+    }
+}
+
+static void ring_unmap(void)
+{
+    if (ring.br != NULL) {
+        munmap(ring.br, URING_BUFFERS * sizeof(struct io_uring_buf));
+        ring.br = NULL;
+    }
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_size);
+        ring.sqes = NULL;
+    }
+    if (ring.rings != NULL) {
+        munmap(ring.rings, ring.rings_size);
+        ring.rings = NULL;
+    }
+}
+
+int uring_init(EV_P_ const struct uring_config *config)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned *sq_array;
+    unsigned i;
+    char *base;
+
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        ERROR("io_uring_setup");
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_NODROP)) {
+        LOGE("io_uring of this kernel is too old");
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.rings_size = max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                          p.cq_off.cqes
+                          + p.cq_entries * sizeof(struct io_uring_cqe));
+    ring.rings = mmap(NULL, ring.rings_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes      = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    ring.br = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.rings == MAP_FAILED || ring.sqes == MAP_FAILED
+        || ring.br == MAP_FAILED) {
+        ERROR("mmap");
+        ring.rings = ring.rings == MAP_FAILED ? NULL : ring.rings;
+        ring.sqes  = ring.sqes == MAP_FAILED ? NULL : ring.sqes;
+        ring.br    = ring.br == MAP_FAILED ? NULL : ring.br;
+        ring_unmap();
+        close(ring.fd);
+        return -1;
+    }
+
+    base            = ring.rings;
+    ring.sq_head    = (unsigned *)(base + p.sq_off.head);
+    ring.sq_tail    = (unsigned *)(base + p.sq_off.tail);
+    ring.sq_flags   = (unsigned *)(base + p.sq_off.flags);
+    ring.sq_mask    = *(unsigned *)(base + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head    = (unsigned *)(base + p.cq_off.head);
+    ring.cq_tail    = (unsigned *)(base + p.cq_off.tail);
+    ring.cq_mask    = *(unsigned *)(base + p.cq_off.ring_mask);
+    ring.cqes       = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+    // slot i of the submission array always points at sqe i
+    sq_array = (unsigned *)(base + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    ring.sq_queued = ring.sq_entered = *ring.sq_tail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t)ring.br;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid         = URING_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        ERROR("io_uring_register");
+        ring_unmap();
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.br_tail = 0;
+    for (i = 0; i < URING_BUFFERS; i++) {
+        ring_post_buffer(i);
+    }
+
+    cork_dllist_init(&ring.relays);
+    cork_dllist_init(&ring.listeners);
+    cork_dllist_init(&ring.starved);
+    ring.config = *config;
+
+    ev_io_init(&ring.io, ring_cb, ring.fd, EV_READ);
+    ev_prepare_init(&ring.prepare, ring_prepare_cb);
+    ev_check_init(&ring.check, ring_check_cb);
+    ev_io_start(EV_A_ & ring.io);
+    ev_prepare_start(EV_A_ & ring.prepare);
+    ev_check_start(EV_A_ & ring.check);
+
+    return 0;
+}
+
+int uring_listen(EV_P_ int fd, void *data)
+{
+    struct uring_listener *listener = malloc(sizeof(struct uring_listener));
+
+    memset(listener, 0, sizeof(struct uring_listener));
+    listener->fd   = fd;
+    listener->data = data;
+    ev_timer_init(&listener->watcher, listener_retry_cb, URING_ACCEPT_RETRY, 0);
+    cork_dllist_add(&ring.listeners, &listener->entries);
+
+    listener_accept(EV_A_ listener);
+    return 0;
+}
+
+/*
+ * Stop accepting on fd, which stays open
+ */
+void uring_unlisten(EV_P_ int fd)
+{
+    struct cork_dllist_item *curr;
+
+    for (curr = cork_dllist_start(&ring.listeners);
+         !cork_dllist_is_end(&ring.listeners, curr); curr = curr->next) {
+        struct uring_listener *listener =
+            cork_container_of(curr, struct uring_listener, entries);
+        if (listener->fd == fd) {
+            ev_timer_stop(EV_A_ & listener->watcher);
+            ring_cancel((uintptr_t)listener | URING_OP_ACCEPT);
+            ring_submit();
+            listener->fd = -1;
+        }
+    }
+}
+
+struct uring_relay *uring_relay(EV_P_ int client_fd, int remote_fd,
+                                struct enc_ctx *e_ctx, struct enc_ctx *d_ctx,
+                                int up_max, int down_max, int timeout,
+                                void *data)
+{
+    struct uring_relay *relay = malloc(sizeof(struct uring_relay));
+
+    memset(relay, 0, sizeof(struct uring_relay));
+    relay->data = data;
+    dir_init(&relay->up, relay, client_fd, remote_fd, 0, d_ctx, up_max,
+             "client_closed", "client_error", "remote_error");
+    dir_init(&relay->down, relay, remote_fd, client_fd, 1, e_ctx, down_max,
+             "remote_closed", "remote_error", "client_error");
+    ev_timer_init(&relay->watcher, relay_timeout_cb, timeout, timeout);
+    ev_timer_start(EV_A_ & relay->watcher);
+    cork_dllist_add(&ring.relays, &relay->entries);
+
+    relay_recv(EV_A_ & relay->up);
+    relay_recv(EV_A_ & relay->down);
+
+    return relay;
+}
+
+/*
+ * Forget the owner and cancel what is in flight. The sockets may be closed
+ * right after, the kernel holds its own references until cancelled.
+ */
+void uring_relay_abort(EV_P_ struct uring_relay *relay)
+{
+    relay->data = NULL;
+    relay_close(EV_A_ relay, "aborted");
+    ring_submit();
+}
+
+void uring_free(EV_P)
+{
+    struct cork_dllist_item *curr, *next;
+    int i;
+
+    ev_io_stop(EV_A_ & ring.io);
+    ev_prepare_stop(EV_A_ & ring.prepare);
+    ev_check_stop(EV_A_ & ring.check);
+
+    // cancels whatever is still in flight, buffer ring included
+    close(ring.fd);
+
+    cork_dllist_foreach_void(&ring.listeners, curr, next) {
+        struct uring_listener *listener =
+            cork_container_of(curr, struct uring_listener, entries);
+        ev_timer_stop(EV_A_ & listener->watcher);
+        free(listener);
+    }
+
+    cork_dllist_foreach_void(&ring.relays, curr, next) {
+        struct uring_relay *relay =
+            cork_container_of(curr, struct uring_relay, entries);
+        ev_timer_stop(EV_A_ & relay->watcher);
+        dir_free(&relay->up);
+        dir_free(&relay->down);
+        free(relay);
+    }
+
+    ring_unmap();
+
+    for (i = 0; i < URING_BUFFERS; i++) {
+        buf_used += pool.size;
+        buf_pool_put(&pool, ring.bufs[i]);
+    }
+    buf_pool_done(&pool);
+}
+
+#else
+
+int uring_init(EV_P_ const struct uring_config *config)
+{
+    LOGE("io_uring is not supported on this platform");
+    return -1;
+}
+
+int uring_listen(EV_P_ int fd, void *data)
+{
+    return -1;
+}
+
+void uring_unlisten(EV_P_ int fd)
+{
+}
+
+struct uring_relay *uring_relay(EV_P_ int client_fd, int remote_fd,
+                                struct enc_ctx *e_ctx, struct enc_ctx *d_ctx,
+                                int up_max, int down_max, int timeout,
+                                void *data)
+{
+    return NULL;
+}
+
+void uring_relay_abort(EV_P_ struct uring_relay *relay)
+{
+}
+
+void uring_free(EV_P)
+{
+}
+
+#endif
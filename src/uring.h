@@ -0,0 +1,60 @@
+/*
+ * uring.h - Define the io_uring relay engine of ss-server
+ *
+ * Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <ev.h>
+
+#include "encrypt.h"
+
+/*
+ * Once a session is established, the engine takes over both of its sockets
+ * and relays them with io_uring: receives draw from a ring of provided
+ * buffers, queued chunks go out in one vectored send, and everything asked
+ * for during a loop iteration is submitted with a single system call.
+ * libev is only woken by the completion ring.
+ */
+
+struct uring_relay;
+
+struct uring_config {
+    /* A connection was accepted on a listener given to uring_listen() */
+    void (*accept)(EV_P_ int fd, void *data);
+
+    /* A relay is done, its sockets are still open */
+    void (*close)(EV_P_ void *data, const char *reason,
+                  uint64_t up, uint64_t down);
+};
+
+int uring_init(EV_P_ const struct uring_config *config);
+int uring_listen(EV_P_ int fd, void *data);
+void uring_unlisten(EV_P_ int fd);
+struct uring_relay *uring_relay(EV_P_ int client_fd, int remote_fd,
+                                struct enc_ctx *e_ctx, struct enc_ctx *d_ctx,
+                                int up_max, int down_max, int timeout,
+                                void *data);
+void uring_relay_abort(EV_P_ struct uring_relay *relay);
+void uring_free(EV_P);
+
+#endif // _URING_H
@@ -30,6 +30,8 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdarg.h>
+#include <stdint.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -37,6 +39,10 @@
 
 #include "utils.h"
 
+#ifdef HAS_SYSLOG
+#include <pthread.h>
+#endif
+
 #ifdef HAVE_SETRLIMIT
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -63,6 +69,343 @@ void ERROR(const char *s)
 
 int use_tty = 1;
 
+#ifdef HAS_SYSLOG
+
+#define LOG_RING_SIZE (256 * 1024)  // must be a power of two
+#define LOG_LINE_SIZE 1024
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_RATE_LIMIT 1000         // lines per second, errors are exempt
+
+struct log_record {
+    uint16_t len;
+    uint16_t priority;
+};
+
+/*
+ * Any thread may log, but only one formats into the ring at a time,
+ * guarded by a spin lock that is never held across a system call.
+ * The log thread drains the ring and sleeps when it is empty.
+ */
+static char log_ring[LOG_RING_SIZE];
+static size_t log_head = 0;           // advanced by loggers
+static size_t log_tail = 0;           // advanced by the log thread
+static char log_lock   = 0;
+static int log_idle    = 0;
+static int log_stop    = 0;
+static int log_started = 0;
+static int log_sync    = 0;           // no log thread, write synchronously
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond         = PTHREAD_COND_INITIALIZER;
+
+// timestamp formatted once per second, published under the lock
+static time_t log_second = -1;
+static char log_timestr[20];
+static unsigned int log_lines = 0;
+
+static unsigned long log_dropped_rate = 0;
+static unsigned long log_dropped_full = 0;
+
+static void log_lock_acquire(void)
+{
+    while (__atomic_test_and_set(&log_lock, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+}
+
+static void log_lock_release(void)
+{
+    __atomic_clear(&log_lock, __ATOMIC_RELEASE);
+}
+
+static void ring_copy_in(size_t pos, const void *data, size_t len)
+{
+    size_t off   = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(log_ring + off, data, first);
+    memcpy(log_ring, (const char *)data + first, len - first);
+}
+
+static void ring_copy_out(size_t pos, void *data, size_t len)
+{
+    size_t off   = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(data, log_ring + off, first);
+    memcpy((char *)data + first, log_ring, len - first);
+}
+
+// called with the spin lock held
+static int ring_push(int priority, const char *line, size_t len)
+{
+    struct log_record rec = { (uint16_t)len, (uint16_t)priority };
+    size_t tail           = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+
+    if (log_head - tail + sizeof(rec) + len > LOG_RING_SIZE) {
+        log_dropped_full++;
+        return -1;
+    }
+
+    ring_copy_in(log_head, &rec, sizeof(rec));
+    ring_copy_in(log_head + sizeof(rec), line, len);
+    __atomic_store_n(&log_head, log_head + sizeof(rec) + len, __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write out everything in the ring, batching lines into as few
+ * write() calls as possible
+ */
+static void log_drain(void)
+{
+    static char batch[LOG_BATCH_SIZE];
+    size_t batch_len = 0;
+
+    pthread_mutex_lock(&log_drain_mutex);
+
+    size_t head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+    size_t tail = log_tail;
+
+    while (tail != head) {
+        struct log_record rec;
+        ring_copy_out(tail, &rec, sizeof(rec));
+
+        if (use_syslog) {
+            char line[LOG_LINE_SIZE];
+            ring_copy_out(tail + sizeof(rec), line, rec.len);
+            line[rec.len - 1] = '\0';
+            syslog(rec.priority, "%s", line);
+        } else {
+            if (batch_len + rec.len > LOG_BATCH_SIZE) {
+                write_all(batch, batch_len);
+                batch_len = 0;
+            }
+            ring_copy_out(tail + sizeof(rec), batch + batch_len, rec.len);
+            batch_len += rec.len;
+        }
+
+        tail += sizeof(rec) + rec.len;
+        if (batch_len == 0 || tail == head) {
+            __atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (batch_len > 0) {
+        write_all(batch, batch_len);
+        __atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+static void *log_thread_main(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&log_mutex);
+        __atomic_store_n(&log_idle, 1, __ATOMIC_SEQ_CST);
+        while (!log_stop
+               && __atomic_load_n(&log_head, __ATOMIC_SEQ_CST)
+               == __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&log_cond, &log_mutex);
+        }
+        __atomic_store_n(&log_idle, 0, __ATOMIC_SEQ_CST);
+        int stop = log_stop;
+        pthread_mutex_unlock(&log_mutex);
+
+        log_drain();
+
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+static void log_wakeup(void)
+{
+    if (__atomic_load_n(&log_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_mutex);
+        pthread_cond_signal(&log_cond);
+        pthread_mutex_unlock(&log_mutex);
+    }
+}
+
+/*
+ * Nothing may be half written to the ring while forking, and the child
+ * has no log thread, so the ring is drained here and the thread started
+ * again by the first line the child logs.
+ */
+static void log_fork_prepare(void)
+{
+    log_lock_acquire();
+    log_drain();
+    pthread_mutex_lock(&log_drain_mutex);
+}
+
+static void log_fork_parent(void)
+{
+    pthread_mutex_unlock(&log_drain_mutex);
+    log_lock_release();
+}
+
+static void log_fork_child(void)
+{
+    pthread_mutex_unlock(&log_drain_mutex);
+    pthread_mutex_init(&log_mutex, NULL);
+    pthread_cond_init(&log_cond, NULL);
+    log_idle    = 0;
+    log_started = 0;
+    log_lock_release();
+}
+
+/*
+ * Write out whatever is still queued, called at exit
+ */
+void ss_log_flush(void)
+{
+    // later lines are written synchronously
+    log_sync = 1;
+    if (log_started) {
+        pthread_mutex_lock(&log_mutex);
+        log_stop = 1;
+        pthread_cond_signal(&log_cond);
+        pthread_mutex_unlock(&log_mutex);
+    }
+    log_drain();
+}
+
+static void log_start(void)
+{
+    static int registered = 0;
+
+    if (!registered) {
+        registered = 1;
+        pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+        atexit(ss_log_flush);
+    }
+
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+        log_sync = 1;
+    } else {
+        pthread_detach(log_thread);
+    }
+}
+
+static size_t log_format(char *line, int priority, const char *format,
+                         va_list ap)
+{
+    const char *level = priority == LOG_ERR ? "ERROR" : "INFO";
+    int len;
+
+    if (use_syslog) {
+        len = 0;
+    } else if (use_tty) {
+        len = snprintf(line, LOG_LINE_SIZE, "\e[01;%dm %s %s: \e[0m",
+                       priority == LOG_ERR ? 35 : 32, log_timestr, level);
+    } else {
+        len = snprintf(line, LOG_LINE_SIZE, "%s%s %s: ",
+                       priority == LOG_ERR ? " " : "", log_timestr, level);
+    }
+
+    int n = vsnprintf(line + len, LOG_LINE_SIZE - len, format, ap);
+    if (n < 0) {
+        n = 0;
+    }
+    len = len + n < LOG_LINE_SIZE - 1 ? len + n : LOG_LINE_SIZE - 1;
+    line[len++] = '\n';
+
+    return len;
+}
+
+static size_t log_format_args(char *line, int priority, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    size_t len = log_format(line, priority, format, ap);
+    va_end(ap);
+    return len;
+}
+
+void ss_log(int priority, const char *format, ...)
+{
+    char line[LOG_LINE_SIZE];
+    char timestr[sizeof(log_timestr)];
+    va_list ap;
+
+    // localtime_r() may stat the zone file, so format before locking
+    time_t now = time(NULL);
+    int fresh  = now != __atomic_load_n(&log_second, __ATOMIC_RELAXED);
+    if (fresh) {
+        struct tm tm;
+        strftime(timestr, sizeof(timestr), TIME_FORMAT, localtime_r(&now, &tm));
+    }
+
+    log_lock_acquire();
+
+    // a racing logger may have moved on to a later second already
+    if (fresh && now > log_second) {
+        __atomic_store_n(&log_second, now, __ATOMIC_RELAXED);
+        log_lines = 0;
+        memcpy(log_timestr, timestr, sizeof(log_timestr));
+    }
+
+    if (priority != LOG_ERR && ++log_lines > LOG_RATE_LIMIT) {
+        log_dropped_rate++;
+        log_lock_release();
+        return;
+    }
+
+    if (log_dropped_rate || log_dropped_full) {
+        size_t len = log_format_args(line, LOG_ERR,
+                                     "%lu log lines dropped, %lu by rate limit",
+                                     log_dropped_rate + log_dropped_full,
+                                     log_dropped_rate);
+        if (ring_push(LOG_ERR, line, len) == 0) {
+            log_dropped_rate = 0;
+            log_dropped_full = 0;
+        }
+    }
+
+    va_start(ap, format);
+    size_t len = log_format(line, priority, format, ap);
+    va_end(ap);
+    ring_push(priority, line, len);
+
+    int start = !log_started && !log_sync;
+    if (start) {
+        log_started = 1;
+    }
+
+    log_lock_release();
+
+    if (start) {
+        log_start();
+    }
+
+    if (log_sync) {
+        log_drain();
+    } else {
+        log_wakeup();
+    }
+}
+
+#endif
+
 char *ss_itoa(int i)
 {
     /* Room for INT_DIGITS digits, - and '\0' */
@@ -266,6 +609,31 @@ void usage()
     printf(
         "                                  with Linux kernel > 3.7.0\n");
     printf("\n");
+    printf(
+        "       [--fast-open-queue <n>]    accept TCP fast open with up to n\n");
+    printf(
+        "                                  connections pending, 5 on the server\n");
+    printf(
+        "                                  with --fast-open\n");
+    printf("\n");
+    printf(
+        "       [--defer-accept <sec>]     accept connections once data arrives,\n");
+    printf(
+        "                                  waiting sec seconds at most\n");
+    printf("\n");
+    printf(
+        "       [--client-sockopt <opts>]  socket options of client connections,\n");
+    printf(
+        "       [--remote-sockopt <opts>]  and of remote connections, as in\n");
+    printf(
+        "                                  sndbuf=n,rcvbuf=n,notsent_lowat=n,\n");
+    printf(
+        "                                  keepidle=sec,keepintvl=sec,mark=n,\n");
+    printf(
+        "                                  tos=n,congestion=name, only available\n");
+    printf(
+        "                                  in local and server mode\n");
+    printf("\n");
     printf(
         "       [--acl <acl_file>]         config file of ACL (Access Control List)\n");
     printf(
@@ -276,6 +644,93 @@ void usage()
     printf(
         "                                  only available in server and manager mode\n");
     printf("\n");
+    printf(
+        "       [--max-pending <num>]      max buffers queued per direction before\n");
+    printf(
+        "                                  reading pauses, only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--dns-parallel <num>]     name servers to query at once, 1 to 6,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--access-log <path>]      write a JSON line for each closed session,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--access-log-sample <n>]  log only one in every n sessions\n");
+    printf("\n");
+    printf(
+        "       [--max-sessions <n>]       stop accepting while n sessions are open,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--max-accept-rate <n>]    accept at most n sessions per second,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--max-memory <mb>]        pause reading when relay buffers take\n");
+    printf(
+        "                                  this many megabytes,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--metrics <addr>]         serve metrics on host:port or a UNIX\n");
+    printf(
+        "                                  socket path, in Prometheus format,\n");
+    printf(
+        "                                  only available in local and server mode\n");
+    printf("\n");
+    printf(
+        "       [--mux <num>]              relay all clients over num shared\n");
+    printf(
+        "                                  tunnels, only available in local mode,\n");
+    printf(
+        "                                  the server needs --mux as well\n");
+    printf("\n");
+    printf(
+        "       [--mux]                    accept multiplexed tunnels,\n");
+    printf(
+        "                                  only available in server mode\n");
+    printf("\n");
+    printf(
+        "       [--udp-over-tcp]           relay UDP over a TCP connection,\n");
+    printf(
+        "                                  only available in local, redir and\n");
+    printf(
+        "                                  tunnel mode, the server needs -u\n");
+    printf("\n");
+    printf(
+        "       [--dns-cache]              cache DNS responses for their TTL,\n");
+    printf(
+        "                                  only available in tunnel mode\n");
+    printf("\n");
+    printf(
+        "       [--io-uring]               relay established sessions with io_uring,\n");
+    printf(
+        "                                  only available in server mode on Linux\n");
+    printf("\n");
+    printf(
+        "       [--handoff <path>]         take over the sockets of the ss-server\n");
+    printf(
+        "                                  serving path, which then drains its\n");
+    printf(
+        "                                  sessions, and serve them there in turn,\n");
+    printf(
+        "                                  only available in server mode on Linux\n");
+    printf(
+        "                                  and the BSDs\n");
+    printf("\n");
+    printf(
+        "       [--drain-timeout <sec>]    how long sessions may take to close\n");
+    printf(
+        "                                  after a handoff, 60 by default\n");
+    printf("\n");
     printf(
         "       [--executable <path>]      path to the executable of ss-server\n");
     printf(
@@ -137,42 +137,17 @@ extern int use_syslog;
         openlog((ident), LOG_CONS | LOG_PID, 0); } \
     while (0)
 
-#define LOGI(format, ...)                                                        \
-    do {                                                                         \
-        if (use_syslog) {                                                        \
-            syslog(LOG_INFO, format, ## __VA_ARGS__);                            \
-        } else {                                                                 \
-            time_t now = time(NULL);                                             \
-            char timestr[20];                                                    \
-            strftime(timestr, 20, TIME_FORMAT, localtime(&now));                 \
-            if (use_tty) {                                                       \
-                fprintf(stderr, "\e[01;32m %s INFO: \e[0m" format "\n", timestr, \
-                        ## __VA_ARGS__);                                         \
-            } else {                                                             \
-                fprintf(stderr, "%s INFO: " format "\n", timestr,                \
-                        ## __VA_ARGS__);                                         \
-            }                                                                    \
-        }                                                                        \
-    }                                                                            \
-    while (0)
+/*
+ * Lines are formatted into a ring buffer and written to stderr or syslog
+ * by a background thread, so a slow log never stalls the event loop.
+ */
+void ss_log(int priority, const char *format, ...)
+__attribute__ ((format(printf, 2, 3)));
+void ss_log_flush(void);
 
-#define LOGE(format, ...)                                                         \
-    do {                                                                          \
-        if (use_syslog) {                                                         \
-            syslog(LOG_ERR, format, ## __VA_ARGS__);                              \
-        } else {                                                                  \
-            time_t now = time(NULL);                                              \
-            char timestr[20];                                                     \
-            strftime(timestr, 20, TIME_FORMAT, localtime(&now));                  \
-            if (use_tty) {                                                        \
-                fprintf(stderr, "\e[01;35m %s ERROR: \e[0m" format "\n", timestr, \
-                        ## __VA_ARGS__);                                          \
-            } else {                                                              \
-                fprintf(stderr, " %s ERROR: " format "\n", timestr,               \
-                        ## __VA_ARGS__);                                          \
-            }                                                                     \
-        } }                                                                       \
-    while (0)
+#define LOGI(format, ...) ss_log(LOG_INFO, format, ## __VA_ARGS__)
+
+#define LOGE(format, ...) ss_log(LOG_ERR, format, ## __VA_ARGS__)
 
 #endif
 /* _WIN32 */